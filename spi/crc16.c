@@ -3,12 +3,16 @@
 // crc16.c - generate a ccitt 16 bit cyclic redundancy check (crc)
 //
 //      The code in this module generates the crc for a block of data.
+//      Table driven (slicing-by-8), and reentrant, crc16_update() may
+//      be used from several threads at once.
 //
 **************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include "crc16.h"
 
 /*
 //                                16  12  5
@@ -23,9 +27,8 @@
 */
 #define POLY 0x8408
 
-static unsigned short crc;
-
-static void crc_byte(unsigned char data) {
+// Bit at a time, 'crc' is the running value.
+static unsigned short crc_byte(unsigned short crc, unsigned char data) {
 	int i;
 	int mask;
 
@@ -37,16 +40,83 @@ static void crc_byte(unsigned char data) {
 			crc ^= POLY;
 		}
 	}
+	return crc;
+}
+
+// Reference, a bit at a time, for checking crc16_update().
+unsigned short crc16_ref(unsigned short crc, unsigned char *data_p, int length) {
+	while (length-- > 0) {
+		crc = crc_byte(crc, *data_p++);
+	}
+	return crc;
+}
+
+// Slicing-by-8: tab[0] is the usual byte table, and tab[k][i] is the
+// CRC of byte i followed by k zero bytes, so 8 bytes take 8 lookups.
+// Built once, on first use, then only read.
+static unsigned short tab[8][256];
+static pthread_once_t tab_once = PTHREAD_ONCE_INIT;
+
+static void crc_tables(void) {
+	int i, k;
+	for (i = 0; i < 256; i++) {
+		tab[0][i] = crc_byte(i, 0);
+	}
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++) {
+			unsigned short c = tab[k - 1][i];
+			tab[k][i] = (c >> 8) ^ tab[0][c & 0xff];
+		}
+	}
+}
+
+// Continue 'crc' (CRC16_INIT to start) over 'length' more bytes.
+unsigned short crc16_update(unsigned short crc, unsigned char *data_p, int length) {
+	pthread_once(&tab_once, crc_tables);
+	while (length >= 8) {
+		unsigned char *p = data_p;
+		crc ^= p[0] | (p[1] << 8);
+		crc = tab[7][crc & 0xff] ^ tab[6][crc >> 8] ^
+			tab[5][p[2]] ^ tab[4][p[3]] ^ tab[3][p[4]] ^
+			tab[2][p[5]] ^ tab[1][p[6]] ^ tab[0][p[7]];
+		data_p += 8;
+		length -= 8;
+	}
+	while (length-- > 0) {
+		crc = (crc >> 8) ^ tab[0][(crc ^ *data_p++) & 0xff];
+	}
+	return crc;
 }
 
 unsigned short crc16(unsigned char *data_p, int length) {
-	crc = 0xffff;
 	if (length == 0)
-		return (~crc);
-	do {
-		unsigned char b = *data_p++;
-		crc_byte(b);
-//printf("%02x => %04x\n", b, crc);
-	} while (--length);
-	return crc;
+		return 0; // (~CRC16_INIT)
+	return crc16_update(CRC16_INIT, data_p, length);
+}
+
+void crc16_check_init(struct crc16_check *ck, unsigned char *img, int addr) {
+	ck->img = img;
+	ck->addr = addr;
+	ck->crc = CRC16_INIT;
+	ck->bad = -1;
+	ck->badlen = 0;
+}
+
+int crc16_check_chunk(void *arg, unsigned char *buf, int off, int len) {
+	struct crc16_check *ck = arg;
+	unsigned short got = crc16_update(CRC16_INIT, buf, len);
+	if (got != crc16_update(CRC16_INIT, ck->img + off, len)) {
+		ck->bad = ck->addr + off;
+		ck->badlen = len;
+		return -1;
+	}
+	ck->crc = crc16_update(ck->crc, buf, len);
+	return 0;
+}
+
+int crc16_check_result(struct crc16_check *ck, int e) {
+	if (e < 0) {
+		return ck->bad < 0 ? -1 : 1;
+	}
+	return 0;
 }
@@ -0,0 +1,28 @@
+#ifndef __CRC16_H__
+#define __CRC16_H__
+
+// CCITT CRC-16 (crc16.c), reflected, no final inversion.
+#define CRC16_INIT	0xffff
+
+unsigned short crc16(unsigned char *buf, int len);
+// Running CRC, for data that arrives in pieces: start with CRC16_INIT.
+unsigned short crc16_update(unsigned short crc, unsigned char *buf, int len);
+// As crc16_update(), a bit at a time. Slow, for checking.
+unsigned short crc16_ref(unsigned short crc, unsigned char *buf, int len);
+
+// Streaming verify against an image, by CRC16 of each chunk as it is
+// read, so it takes no longer than the read.
+struct crc16_check {
+	unsigned char *img;	// expected data, img[0] at 'addr'
+	int addr;
+	unsigned short crc;	// of all data read (CRC16_INIT if none)
+	int bad;		// address of first bad chunk, or -1
+	int badlen;
+};
+void crc16_check_init(struct crc16_check *ck, unsigned char *img, int addr);
+// A spi_chunk_t, 'arg' the crc16_check. Stops (-1) at the first bad chunk.
+int crc16_check_chunk(void *arg, unsigned char *buf, int off, int len);
+// Given what the read returned: 0 if all match, 1 if not, or -1 on error.
+int crc16_check_result(struct crc16_check *ck, int e);
+
+#endif /* __CRC16_H__ */
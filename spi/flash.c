@@ -0,0 +1,572 @@
+/*
+ * Read/program/erase routines for 25-series SPI NOR flash.
+ *
+ * Size, page, erase types and times, and addressing come from the
+ * SFDP basic flash parameter table (JESD216), or if there is none, from
+ * the JEDEC ID capacity byte and the usual 256-byte page, 4K and 64K
+ * erases. Parts over 16M use the 4-byte address opcodes, so the chip's
+ * address mode is never changed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "flash.h"
+#include "crc16.h"
+
+static unsigned char rdsr[] = { 0x05 };
+
+// 3-byte address opcodes, and their 4-byte forms.
+static unsigned char op3[] = { 0x03, 0x0b, 0x02, 0x20, 0x52, 0xd8 };
+static unsigned char op4[] = { 0x13, 0x0c, 0x12, 0x21, 0x5c, 0xdc };
+
+static int fl_op4(unsigned char op) {
+	int x;
+	for (x = 0; x < sizeof(op3); ++x) {
+		if (op3[x] == op) {
+			return op4[x];
+		}
+	}
+	return -1;
+}
+
+static unsigned int le32(unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// Command 'op' and address in 'hdr'. Returns its length.
+static int fl_hdr(struct flash *fl, unsigned char op, int addr,
+			unsigned char *hdr) {
+	int n = 0;
+	hdr[n++] = op;
+	if (fl->abytes == 4) {
+		hdr[n++] = (addr >> 24) & 0xff; // big-endian address
+	}
+	hdr[n++] = (addr >> 16) & 0xff;
+	hdr[n++] = (addr >> 8) & 0xff;
+	hdr[n++] = addr & 0xff;
+	return n;
+}
+
+static int fl_sfdp_read(struct flash *fl, int addr, unsigned char *buf, int len) {
+	unsigned char cmd[5];
+	cmd[0] = 0x5a; // READ SFDP, 3-byte address and one dummy byte
+	cmd[1] = (addr >> 16) & 0xff;
+	cmd[2] = (addr >> 8) & 0xff;
+	cmd[3] = addr & 0xff;
+	cmd[4] = 0x00;
+	return spi_xfer_cmd(fl->dev, cmd, sizeof(cmd), buf, len);
+}
+
+// Typical time of an erase type, SFDP DWORD 10 field at 'bit'.
+static int fl_erase_us(unsigned int dw, int bit) {
+	static const int unit[] = { 1000, 16000, 128000, 1000000 };
+	return (((dw >> bit) & 0x1f) + 1) * unit[(dw >> (bit + 5)) & 3];
+}
+
+// Read the basic flash parameter table. Returns its address mode
+// (DWORD 1 bits 18:17), or -1 if there is none.
+static int fl_sfdp(struct flash *fl) {
+	unsigned char hdr[8 * 8];
+	unsigned char t[4 * 20];
+	unsigned char *p = NULL;
+	unsigned int dw;
+	int nph;
+	int len;
+	int x;
+
+	if (fl_sfdp_read(fl, 0, hdr, 8) < 0 || memcmp(hdr, "SFDP", 4) != 0) {
+		return -1;
+	}
+	nph = hdr[6] + 1;
+	if (nph > 7) nph = 7;
+	if (fl_sfdp_read(fl, 8, hdr + 8, 8 * nph) < 0) {
+		return -1;
+	}
+	for (x = 1; x <= nph; ++x) {
+		if (hdr[8 * x] == 0x00 && hdr[8 * x + 7] == 0xff) {
+			p = hdr + 8 * x;
+			break;
+		}
+	}
+	len = p ? p[3] : 0;	// DWORDs
+	if (len < 9) {
+		return -1;
+	}
+	if (len > 20) len = 20;
+	if (fl_sfdp_read(fl, p[4] | (p[5] << 8) | (p[6] << 16), t, 4 * len) < 0) {
+		return -1;
+	}
+	fl->sfdp = (p[2] << 8) | p[1];
+	dw = le32(t + 4);	// density, in bits
+	if (dw & 0x80000000) {
+		dw &= 0x7fffffff;
+		if (dw < 3 || dw > 33) return -1;
+		fl->size = 1 << (dw - 3);
+	} else {
+		fl->size = (dw >> 3) + 1;
+	}
+	memset(fl->erase, 0, sizeof(fl->erase));
+	for (x = 0; x < FL_ERASES; ++x) {
+		unsigned char *e = t + 28 + 2 * x;
+		if (e[0] != 0 && e[0] < 31) {
+			fl->erase[x].size = 1 << e[0];
+			fl->erase[x].op = e[1];
+			fl->erase[x].us = (e[0] <= 12 ? 45000 : 150000);
+		}
+	}
+	if (len >= 11) {
+		dw = le32(t + 36);
+		fl->erase_max = 2 * ((dw & 0xf) + 1);
+		for (x = 0; x < FL_ERASES; ++x) {
+			fl->erase[x].us = fl_erase_us(dw, 4 + 7 * x);
+		}
+		dw = le32(t + 40);
+		fl->pp_max = 2 * ((dw & 0xf) + 1);
+		fl->page = 1 << ((dw >> 4) & 0xf);
+		fl->pp_us = (((dw >> 8) & 0x1f) + 1) * ((dw & (1 << 13)) ? 64 : 8);
+	}
+	return (le32(t) >> 17) & 3;
+}
+
+// Opens 'fl' on 'dev'. Returns 0, -1 on transfer failure,
+// -2 if nothing answers, -3 if the size is unknown.
+int flash_open(struct flash *fl, struct spi_dev *dev) {
+	unsigned char rdid[] = { 0x9f };
+	struct flash_erase e;
+	int amode;
+	int x, y;
+
+	memset(fl, 0, sizeof(*fl));
+	fl->dev = dev;
+	if (spi_xfer_cmd(dev, rdid, sizeof(rdid), fl->id, 3) < 0) {
+		return -1;
+	}
+	if ((fl->id[0] == 0xff && fl->id[1] == 0xff) ||
+			(fl->id[0] == 0x00 && fl->id[1] == 0x00)) {
+		return -2; // MISO pulled high, or low
+	}
+	// Usual for parts without SFDP (or with a short table).
+	fl->page = 256;
+	fl->pp_us = 700;
+	fl->pp_max = 10;
+	fl->erase_max = 10;
+	fl->erase[0] = (struct flash_erase){ 4096, 0x20, 45000 };
+	fl->erase[1] = (struct flash_erase){ 65536, 0xd8, 150000 };
+	amode = fl_sfdp(fl);
+	if (amode < 0) {
+		// capacity byte is log2(size) for most makers
+		if (fl->id[2] < 16 || fl->id[2] > 30) {
+			return -3;
+		}
+		fl->size = 1 << fl->id[2];
+		amode = 1;
+	}
+	// smallest erase first, unused last
+	for (x = 0; x < FL_ERASES; ++x) {
+		for (y = x + 1; y < FL_ERASES; ++y) {
+			if (fl->erase[y].size && (fl->erase[x].size == 0 ||
+					fl->erase[y].size < fl->erase[x].size)) {
+				e = fl->erase[x];
+				fl->erase[x] = fl->erase[y];
+				fl->erase[y] = e;
+			}
+		}
+	}
+	fl->abytes = 3;
+	fl->read_op = 0x0b; // FAST_READ, 8 dummy clocks
+	fl->dummy = 1;
+	fl->pp_op = 0x02;
+	if (fl->size > (16 << 20) || amode == 2) {
+		fl->abytes = 4;
+		fl->op4 = (amode != 2); // else 4-byte only, same opcodes
+	}
+	if (fl->op4) {
+		fl->read_op = fl_op4(fl->read_op);
+		fl->pp_op = fl_op4(fl->pp_op);
+		for (x = y = 0; x < FL_ERASES; ++x) {
+			int op = fl_op4(fl->erase[x].op);
+			if (fl->erase[x].size && op >= 0) {
+				fl->erase[y] = fl->erase[x];
+				fl->erase[y++].op = op;
+			}
+		}
+		while (y < FL_ERASES) {
+			fl->erase[y++].size = 0;
+		}
+	}
+	if (fl->page > FL_PAGEMAX) fl->page = FL_PAGEMAX;
+	if (fl->erase[0].size == 0) {
+		return -3;
+	}
+	return 0;
+}
+
+static char *fl_kb(int n) {
+	static char buf[2][16];
+	static int i;
+	i = !i;
+	if (n >= (1 << 20) && (n & ((1 << 20) - 1)) == 0) {
+		snprintf(buf[i], sizeof(buf[i]), "%dM", n >> 20);
+	} else if (n >= 1024 && (n & 1023) == 0) {
+		snprintf(buf[i], sizeof(buf[i]), "%dK", n >> 10);
+	} else {
+		snprintf(buf[i], sizeof(buf[i]), "%d", n);
+	}
+	return buf[i];
+}
+
+void flash_print(struct flash *fl, FILE *fp) {
+	int x;
+	fprintf(fp, "JEDEC ID %02x %02x %02x", fl->id[0], fl->id[1], fl->id[2]);
+	if (fl->sfdp) {
+		fprintf(fp, ", SFDP %d.%d\n", fl->sfdp >> 8, fl->sfdp & 0xff);
+	} else {
+		fprintf(fp, ", no SFDP\n");
+	}
+	fprintf(fp, "size %s, page %s, %d-byte addresses%s\n", fl_kb(fl->size),
+			fl_kb(fl->page), fl->abytes,
+			fl->op4 ? " (4-byte opcodes)" : "");
+	fprintf(fp, "erase");
+	for (x = 0; x < FL_ERASES && fl->erase[x].size; ++x) {
+		fprintf(fp, " %s (%02x, %d mS)", fl_kb(fl->erase[x].size),
+				fl->erase[x].op, fl->erase[x].us / 1000);
+	}
+	fprintf(fp, ", up to x%d\n", fl->erase_max);
+	fprintf(fp, "program %d uS a page, up to x%d\n", fl->pp_us, fl->pp_max);
+}
+
+// Read any length, with FAST_READ. Returns len, or -1 on error.
+int flash_read(struct flash *fl, unsigned char *buf, int addr, int len) {
+	unsigned char cmd[5 + 1];
+	int n = fl_hdr(fl, fl->read_op, addr, cmd);
+	memset(cmd + n, 0, fl->dummy);
+	return spi_xfer_cmd(fl->dev, cmd, n + fl->dummy, buf, len);
+}
+
+// As flash_read(), passing each chunk to 'fn' as it arrives.
+int flash_read_stream(struct flash *fl, int addr, int len,
+			spi_chunk_t fn, void *arg) {
+	unsigned char cmd[5 + 1];
+	int n = fl_hdr(fl, fl->read_op, addr, cmd);
+	memset(cmd + n, 0, fl->dummy);
+	return spi_xfer_stream(fl->dev, cmd, n + fl->dummy, len, fn, arg);
+}
+
+// WREN, then 'op' at 'addr' with any 'data', in one USB write.
+// Then poll until done, 'us' typical. Returns 0, or -1 on error.
+static int fl_wr(struct flash *fl, unsigned char op, int addr,
+			unsigned char *data, int len, int us, int mult) {
+	unsigned char wren[] = { 0x06 };
+	unsigned char hdr[5];
+	struct spi_seg seg[] = {
+		{ wren, NULL, sizeof(wren) },
+		SPI_SEG_CS,
+		{ hdr, NULL, 0 },
+		{ data, NULL, len },
+	};
+	int e;
+
+	seg[2].len = fl_hdr(fl, op, addr, hdr);
+	spi_lock(fl->dev); // the write and its poll, together
+	e = spi_xferv(fl->dev, seg, len > 0 ? 4 : 3) < 0 ? -1 : 0;
+	if (e == 0 && spi_poll(fl->dev, rdsr, sizeof(rdsr), 0x01, 0x00,
+				us, (long long)us * mult / 1000 + 100) < 0) {
+		e = -1;
+	}
+	spi_unlock(fl->dev);
+	return e;
+}
+
+// Erase, largest blocks that fit. Returns len, or -1 on error.
+int flash_erase(struct flash *fl, int addr, int len) {
+	int a = addr;
+	int x;
+	if (len < 0 || addr % fl->erase[0].size || len % fl->erase[0].size ||
+			addr + len > fl->size) {
+		return -1;
+	}
+	while (a < addr + len) {
+		for (x = FL_ERASES - 1; x > 0; --x) {
+			int sz = fl->erase[x].size;
+			if (sz && a % sz == 0 && addr + len - a >= sz) {
+				break;
+			}
+		}
+		if (fl_wr(fl, fl->erase[x].op, a, NULL, 0, fl->erase[x].us,
+						fl->erase_max) < 0) {
+			return -1;
+		}
+		a += fl->erase[x].size;
+	}
+	return len;
+}
+
+// Program erased flash, a page at a time. Pages of all 0xff are
+// skipped, programming them would change nothing.
+// Returns len, or -1 on error.
+int flash_program(struct flash *fl, unsigned char *buf, int addr, int len) {
+	int o, k, x;
+	if (len < 0 || addr < 0 || addr + len > fl->size) {
+		return -1;
+	}
+	for (o = 0; o < len; o += k) {
+		k = fl->page - ((addr + o) % fl->page); // to end of page
+		if (k > len - o) k = len - o;
+		for (x = 0; x < k && buf[o + x] == 0xff; ++x)
+			;
+		if (x == k) {
+			continue;
+		}
+		if (fl_wr(fl, fl->pp_op, addr + o, buf + o, k, fl->pp_us,
+						fl->pp_max) < 0) {
+			return -1;
+		}
+	}
+	return len;
+}
+
+// Erase and program, any alignment. What else was in the first and
+// last sectors is read first, and programmed back.
+// Returns len, or -1 on error.
+int flash_write(struct flash *fl, unsigned char *buf, int addr, int len) {
+	int sec = fl->erase[0].size;
+	int start = addr - (addr % sec);
+	int end = addr + len;
+	unsigned char *img = buf;
+	int e = -1;
+
+	if (len <= 0 || addr < 0 || addr + len > fl->size) {
+		return len == 0 ? 0 : -1;
+	}
+	if (end % sec) end += sec - (end % sec);
+	if (start != addr || end != addr + len) {
+		img = malloc(end - start);
+		if (img == NULL) {
+			return -1;
+		}
+		if ((addr > start && flash_read(fl, img, start, addr - start) < 0) ||
+				(end > addr + len && flash_read(fl, img + (addr + len - start),
+						addr + len, end - addr - len) < 0)) {
+			goto out;
+		}
+		memcpy(img + (addr - start), buf, len);
+	}
+	if (flash_erase(fl, start, end - start) < 0 ||
+			flash_program(fl, img, start, end - start) < 0) {
+		goto out;
+	}
+	e = len;
+out:
+	if (img != buf) {
+		free(img);
+	}
+	return e;
+}
+
+static long long fl_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define FL_SAME		0	// sector already right
+#define FL_PROG		1	// only bits to clear
+#define FL_NEED		2	// needs erasing
+#define FL_ERASED	3	// erased, by an erase from 'erase'
+
+struct flash_sec {
+	int act;
+	int erase;	// erase type + 1 starting here, or 0
+	int used;	// pages of the image not all 0xff
+	int diff;	// pages that differ
+};
+
+// Cost in uS of sectors 's' on, a block of erase type 'x', as it is
+// or as smaller blocks, whichever is less. Each program or erase also
+// costs 'rt', a USB round trip. With 'mark', record it.
+static long long fl_best(struct flash *fl, struct flash_sec *sec, int s,
+			int x, int rt, int mark) {
+	int n = fl->erase[x].size / fl->erase[0].size;
+	int k = x > 0 ? fl->erase[x - 1].size / fl->erase[0].size : 1;
+	long long pp = fl->pp_us + rt;
+	long long big = fl->erase[x].us + rt;
+	long long small = 0;
+	int y;
+
+	if (x == 0) {
+		if (sec[s].act == FL_NEED) {
+			if (mark) {
+				sec[s].act = FL_ERASED;
+				sec[s].erase = 1;
+			}
+			return big + sec[s].used * pp;
+		}
+		return sec[s].diff * pp;
+	}
+	for (y = s; y < s + n; ++y) {
+		big += sec[y].used * pp;
+	}
+	for (y = s; y < s + n; y += k) {
+		small += fl_best(fl, sec, y, x - 1, rt, 0);
+	}
+	if (!mark) {
+		return big < small ? big : small;
+	}
+	if (big < small) {
+		for (y = s; y < s + n; ++y) {
+			sec[y].act = FL_ERASED;
+		}
+		sec[s].erase = x + 1;
+		return big;
+	}
+	for (y = s; y < s + n; y += k) {
+		fl_best(fl, sec, y, x - 1, rt, 1);
+	}
+	return small;
+}
+
+// Read the sectors 'len' bytes at 'addr' cover, and plan how to
+// program 'buf' there, keeping what else is in the first and last.
+// Returns 0, or -1 on error (flash_plan_free() either way).
+int flash_plan(struct flash *fl, unsigned char *buf, int addr, int len,
+			struct flash_plan *pl) {
+	int sz = fl->erase[0].size;
+	int end = addr + len;
+	long long t0 = fl_now();
+	long long cost;
+	long long rtt = spi_rtt(fl->dev);
+	int rt = rtt > 0 ? rtt / 1000 : 0;
+	int s, k, o, x;
+
+	memset(pl, 0, sizeof(*pl));
+	if (len <= 0 || addr < 0 || addr + len > fl->size) {
+		return -1;
+	}
+	pl->addr = addr - (addr % sz);
+	if (end % sz) end += sz - (end % sz);
+	pl->len = end - pl->addr;
+	pl->sectors = pl->len / sz;
+	pl->img = malloc(pl->len);
+	pl->cur = malloc(pl->len);
+	pl->sec = calloc(pl->sectors, sizeof(*pl->sec));
+	if (pl->img == NULL || pl->cur == NULL || pl->sec == NULL) {
+		return -1;
+	}
+	// readback doubles as the blank check
+	if (flash_read(fl, pl->cur, pl->addr, pl->len) < 0) {
+		return -1;
+	}
+	pl->read_us = (fl_now() - t0) / 1000;
+	memcpy(pl->img, pl->cur, pl->len);
+	memcpy(pl->img + (addr - pl->addr), buf, len);
+
+	for (s = 0; s < pl->sectors; ++s) {
+		struct flash_sec *sc = &pl->sec[s];
+		unsigned char *im = pl->img + s * sz;
+		unsigned char *cu = pl->cur + s * sz;
+		for (o = 0; o < sz; o += fl->page) {
+			for (x = 0; x < fl->page && im[o + x] == 0xff; ++x)
+				;
+			sc->used += (x < fl->page);
+			if (memcmp(im + o, cu + o, fl->page) != 0) {
+				++sc->diff;
+			}
+		}
+		sc->act = FL_SAME;
+		for (o = 0; o < sz; ++o) {
+			if ((im[o] & cu[o]) != im[o]) {
+				sc->act = FL_NEED; // a bit to set, 0 to 1
+				break;
+			}
+			if (im[o] != cu[o]) {
+				sc->act = FL_PROG;
+			}
+		}
+	}
+	cost = 0;
+	for (s = 0; s < pl->sectors; s += k) {
+		int a = pl->addr + s * sz;
+		for (x = FL_ERASES - 1; x > 0; --x) {
+			int bs = fl->erase[x].size;
+			if (bs && a % bs == 0 && a + bs <= end) {
+				break;
+			}
+		}
+		cost += fl_best(fl, pl->sec, s, x, rt, 1);
+		k = fl->erase[x].size / sz;
+	}
+	for (s = 0; s < pl->sectors; ++s) {
+		struct flash_sec *sc = &pl->sec[s];
+		if (sc->erase) {
+			++pl->erases[sc->erase - 1];
+		}
+		if (sc->act == FL_SAME) {
+			++pl->same;
+		} else if (sc->act == FL_PROG) {
+			++pl->progonly;
+			pl->pages += sc->diff;
+		} else {
+			++pl->erased;
+			pl->pages += sc->used;
+		}
+	}
+	pl->est_us = cost;
+	return 0;
+}
+
+// Carry out 'pl': erases, then programs. Returns 0, or -1 on error.
+int flash_plan_run(struct flash *fl, struct flash_plan *pl) {
+	int sz = fl->erase[0].size;
+	long long t0 = fl_now();
+	long long t1;
+	int s, o;
+
+	for (s = 0; s < pl->sectors; ++s) {
+		int x = pl->sec[s].erase - 1;
+		if (x >= 0 && flash_erase(fl, pl->addr + s * sz,
+						fl->erase[x].size) < 0) {
+			return -1;
+		}
+	}
+	t1 = fl_now();
+	pl->erase_us = (t1 - t0) / 1000;
+	for (s = 0; s < pl->sectors; ++s) {
+		int a = s * sz;
+		if (pl->sec[s].act == FL_ERASED) {
+			// blank pages skipped
+			if (flash_program(fl, pl->img + a, pl->addr + a, sz) < 0) {
+				return -1;
+			}
+		} else if (pl->sec[s].act == FL_PROG) {
+			for (o = a; o < a + sz; o += fl->page) {
+				if (memcmp(pl->img + o, pl->cur + o, fl->page) != 0 &&
+						flash_program(fl, pl->img + o,
+						pl->addr + o, fl->page) < 0) {
+					return -1;
+				}
+			}
+		}
+	}
+	pl->prog_us = (fl_now() - t1) / 1000;
+	return 0;
+}
+
+void flash_plan_free(struct flash_plan *pl) {
+	free(pl->img);
+	free(pl->cur);
+	free(pl->sec);
+	pl->img = pl->cur = NULL;
+	pl->sec = NULL;
+}
+
+// Verify 'len' bytes at 'addr' against 'buf', as nv_verify().
+// Returns 0 if all match, 1 if not (see 'ck'), or -1 on error.
+int flash_verify(struct flash *fl, unsigned char *buf, int addr, int len,
+			struct crc16_check *ck) {
+	crc16_check_init(ck, buf, addr);
+	return crc16_check_result(ck,
+			flash_read_stream(fl, addr, len, crc16_check_chunk, ck));
+}
@@ -0,0 +1,76 @@
+#ifndef __FLASH_H__
+#define __FLASH_H__
+
+#include "spilib.h"
+#include "crc16.h"
+
+// 25-series SPI NOR flash, geometry from JEDEC ID and SFDP.
+#define FL_ERASES	4	// erase types, as SFDP
+#define FL_PAGEMAX	1024	// largest program burst used
+
+struct flash_erase {
+	int size;		// bytes, 0 if unused
+	unsigned char op;	// opcode (4-byte address form if op4)
+	int us;			// typical time
+};
+
+struct flash {
+	struct spi_dev *dev;
+	unsigned char id[3];	// JEDEC manufacturer, type, capacity
+	int sfdp;		// BFPT revision, major << 8 | minor, 0 if none
+	int size;		// bytes
+	int page;		// program page
+	int abytes;		// address bytes, 3 or 4
+	int op4;		// 4-byte address opcodes, rather than modes
+	unsigned char read_op;	// FAST_READ
+	int dummy;		// dummy bytes after address
+	unsigned char pp_op;
+	int pp_us;		// page program typical time
+	int pp_max;		// and most, as a multiple
+	int erase_max;		// most erase time, as a multiple
+	struct flash_erase erase[FL_ERASES];	// smallest first
+};
+
+int flash_open(struct flash *fl, struct spi_dev *dev);
+void flash_print(struct flash *fl, FILE *fp);
+int flash_read(struct flash *fl, unsigned char *buf, int addr, int len);
+int flash_read_stream(struct flash *fl, int addr, int len,
+			spi_chunk_t fn, void *arg);
+// Erase must be aligned to erase[0].size.
+int flash_erase(struct flash *fl, int addr, int len);
+int flash_program(struct flash *fl, unsigned char *buf, int addr, int len);
+// Any alignment, keeps the rest of partly written sectors.
+int flash_write(struct flash *fl, unsigned char *buf, int addr, int len);
+
+// Programming plan, from the image and a readback of the sectors it
+// covers. Sectors already right are skipped, ones only needing bits
+// cleared are programmed without erasing, the rest are erased with
+// the largest erase types that cost less than the smaller ones.
+struct flash_sec;
+struct flash_plan {
+	int addr;		// sector-aligned region covering the image
+	int len;
+	int sectors;
+	int same;		// already holding the image
+	int progonly;		// only bits to clear, no erase
+	int erased;
+	int erases[FL_ERASES];	// of each erase type
+	int pages;		// to program
+	long long est_us;	// erase and program, from typical times
+	long long read_us;	// actual times
+	long long erase_us;
+	long long prog_us;
+	unsigned char *img;	// region as it will be
+	unsigned char *cur;	// and as it was read
+	struct flash_sec *sec;
+};
+int flash_plan(struct flash *fl, unsigned char *buf, int addr, int len,
+			struct flash_plan *pl);
+int flash_plan_run(struct flash *fl, struct flash_plan *pl);
+void flash_plan_free(struct flash_plan *pl);
+
+// Streaming verify against an image, see crc16_check.
+int flash_verify(struct flash *fl, unsigned char *buf, int addr, int len,
+			struct crc16_check *ck);
+
+#endif /* __FLASH_H__ */
@@ -0,0 +1,730 @@
+/*
+ * In-process stand-in for libftd2xx, for running spilib without
+ * a C232HM. Link with this instead of -lftd2xx.
+ *
+ * Interprets the MPSSE command stream that spilib sends, clocking
+ * bytes through device models (ftsim_model) attached to chip-selects.
+ * With no device selected, MISO reads as all ones (pull-up).
+ *
+ * Timing is modeled, so latency and throughput are close to a real
+ * cable: commands reach the MPSSE one USB turnaround after FT_Write(),
+ * bytes take 8 clocks each at the programmed rate, and responses reach
+ * the host on a flush (0x87), a full IN transfer, or the latency timer.
+ *
+ * Environment:
+ *     FTSIM_USB=us     USB turnaround each way (def 125, 0 = no timing)
+ *     FTSIM_JITTER=us  Random extra delay per FT_Write() (def 0)
+ *     FTSIM_MAXHZ=hz   Wiring limit, faster clocks corrupt MISO (def none)
+ *     FTSIM_PORTn=dev@cs[,...]  Devices on port n, e.g. "w5500@C",
+ *                      (def port 0 25lc512@C, port 1 w5500@C,
+ *                      port 2 w25q256@C)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "ftd2xx.h"
+#include "ftsim.h"
+
+#define SIM_PORTS	4
+#define SIM_DEVS	5	// one per chip-select pin
+#define SIM_RXBUF	(256 * 1024)
+#define SIM_MARKS	1024
+
+#define CLK_RAW		60000000	// internal clock is 60MHz
+
+struct simdev {
+	int csbit;
+	struct ftsim_model *model;
+	void *dev;
+	int sel;
+};
+
+// Bytes on their way to the host, 'n' of them arriving at time 't'.
+struct mark {
+	int n;
+	long long t;
+};
+
+struct sim {
+	int open;
+	unsigned char pins;	// ADBUS output values
+	unsigned char dir;	// ADBUS direction
+	int loop;		// TDI/TDO loopback
+	int div5;
+	int div;
+	int hz;			// SPI clock
+	long long bytens;	// time to clock one byte
+	long long busy;		// MPSSE busy until
+	// command parser, commands may be split across writes
+	unsigned char cmd[3];
+	int ncmd;
+	int left;		// data bytes still to come for cmd[0]
+	int stalled;		// in 0x88/0x89 wait that can't end
+	unsigned char rx[SIM_RXBUF];	// ring, device to host
+	int rxhead;
+	int rxlen;		// in ring
+	int rxvis;		// in ring and visible to host
+	unsigned long arrived;	// total bytes ever made visible
+	unsigned long notified;	// of which, event signalled
+	struct mark marks[SIM_MARKS];	// sent, not yet arrived
+	int mhead;
+	int mcount;
+	int pktn;		// in MPSSE buffer, not yet sent
+	long long pktt;		// time first of those was ready
+	int pktmax;		// bytes per IN transfer
+	int latency;		// latency timer, mS
+	ULONG rdtimeout;	// mS, 0 = forever
+	struct simdev devs[SIM_DEVS];
+	int ndev;
+	EVENT_HANDLE *event;
+	DWORD eventmask;
+	pthread_t notifier;
+	int notifying;
+	pthread_cond_t wake;
+	pthread_mutex_t lock;
+};
+
+static struct sim sims[SIM_PORTS];
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+static long long usb_ns = 125000;
+static long long jitter_ns = 0;
+static int maxhz = 0;
+
+unsigned long ftsim_calls = 0;
+
+static struct ftsim_model *sim_models[] = {
+	&ftsim_25lc512,
+	&ftsim_w5500,
+	&ftsim_w25q64,
+	&ftsim_w25q256,
+	NULL
+};
+
+static char *sim_defaults[SIM_PORTS] = {
+	"25lc512@C",
+	"w5500@C",
+	"w25q256@C",
+};
+
+static long long sim_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sim_ts(struct timespec *ts, long long t) {
+	ts->tv_sec = t / 1000000000LL;
+	ts->tv_nsec = t % 1000000000LL;
+}
+
+static int sim_csbit(char cs) {
+	switch(toupper(cs)) {
+	case '0': return 0x10;
+	case '1': return 0x20;
+	case '2': return 0x40;
+	case '3': return 0x80;
+	case 'C': return 0x08;
+	default: return -1;
+	}
+}
+
+static int sim_add(struct sim *sm, int csbit, struct ftsim_model *model) {
+	int x;
+	for (x = 0; x < sm->ndev; ++x) {
+		if (sm->devs[x].csbit == csbit) {
+			break;
+		}
+	}
+	if (x >= SIM_DEVS) {
+		return -1;
+	}
+	void *dev = model->init();
+	if (dev == NULL) {
+		return -1;
+	}
+	// replaced model is leaked, there are never many
+	sm->devs[x].csbit = csbit;
+	sm->devs[x].model = model;
+	sm->devs[x].dev = dev;
+	sm->devs[x].sel = 0;
+	if (x == sm->ndev) {
+		++sm->ndev;
+	}
+	return 0;
+}
+
+// Parse "dev@cs[,dev@cs...]".
+static void sim_config(struct sim *sm, char *spec) {
+	char buf[128];
+	char *p;
+	char *tok;
+	char *save = NULL;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	for (p = buf; (tok = strtok_r(p, ", ", &save)) != NULL; p = NULL) {
+		char *at = strchr(tok, '@');
+		int csbit = sim_csbit(at ? at[1] : 'C');
+		int x;
+		if (at) *at = '\0';
+		for (x = 0; sim_models[x] != NULL; ++x) {
+			if (strcasecmp(sim_models[x]->name, tok) == 0) {
+				break;
+			}
+		}
+		if (sim_models[x] == NULL || csbit < 0 ||
+				sim_add(sm, csbit, sim_models[x]) < 0) {
+			fprintf(stderr, "ftsim: bad device '%s'\n", tok);
+		}
+	}
+}
+
+static void sim_init(void) {
+	pthread_condattr_t attr;
+	char name[16];
+	char *s;
+	int x;
+
+	s = getenv("FTSIM_USB");
+	if (s != NULL) usb_ns = strtol(s, NULL, 0) * 1000LL;
+	s = getenv("FTSIM_JITTER");
+	if (s != NULL) jitter_ns = strtol(s, NULL, 0) * 1000LL;
+	s = getenv("FTSIM_MAXHZ");
+	if (s != NULL) maxhz = strtod(s, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for (x = 0; x < SIM_PORTS; ++x) {
+		pthread_mutex_init(&sims[x].lock, NULL);
+		pthread_cond_init(&sims[x].wake, &attr);
+		snprintf(name, sizeof(name), "FTSIM_PORT%d", x);
+		s = getenv(name);
+		if (s == NULL) s = sim_defaults[x];
+		if (s != NULL) sim_config(&sims[x], s);
+	}
+	pthread_condattr_destroy(&attr);
+}
+
+int ftsim_attach(int port, char cs, struct ftsim_model *model) {
+	pthread_once(&sim_once, sim_init);
+	int csbit = sim_csbit(cs);
+	if (port < 0 || port >= SIM_PORTS || csbit < 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&sims[port].lock);
+	int e = sim_add(&sims[port], csbit, model);
+	pthread_mutex_unlock(&sims[port].lock);
+	return e;
+}
+
+static struct sim *sim_get(FT_HANDLE ftHandle) {
+	struct sim *sm = ftHandle;
+	__sync_fetch_and_add(&ftsim_calls, 1);
+	if (sm < sims || sm >= sims + SIM_PORTS || !sm->open) {
+		return NULL;
+	}
+	return sm;
+}
+
+static void sim_speed(struct sim *sm) {
+	sm->hz = (sm->div5 ? CLK_RAW / 5 : CLK_RAW) / ((1 + sm->div) * 2);
+	sm->bytens = 8 * 1000000000LL / sm->hz;
+}
+
+// Everything made ready so far goes to the host, 't' is when the
+// last of it was ready in the MPSSE.
+static void sim_send(struct sim *sm, long long t) {
+	struct mark *m;
+	if (sm->pktn == 0) {
+		return;
+	}
+	t += usb_ns;
+	if (sm->mcount > 0) {
+		m = &sm->marks[(sm->mhead + sm->mcount - 1) % SIM_MARKS];
+		if (t < m->t) t = m->t;
+		if (sm->mcount == SIM_MARKS) {
+			m->n += sm->pktn;
+			m->t = t;
+			sm->pktn = 0;
+			return;
+		}
+	}
+	m = &sm->marks[(sm->mhead + sm->mcount) % SIM_MARKS];
+	m->n = sm->pktn;
+	m->t = t;
+	++sm->mcount;
+	sm->pktn = 0;
+}
+
+static void sim_put(struct sim *sm, unsigned char c, long long t) {
+	if (sm->rxlen >= SIM_RXBUF) {
+		return; // overrun, byte lost
+	}
+	sm->rx[(sm->rxhead + sm->rxlen) % SIM_RXBUF] = c;
+	++sm->rxlen;
+	if (usb_ns == 0) {
+		++sm->rxvis;
+		++sm->arrived;
+		return;
+	}
+	if (sm->pktn == 0) {
+		sm->pktt = t;
+	}
+	if (++sm->pktn >= sm->pktmax) {
+		sim_send(sm, t);
+	}
+}
+
+// Make visible what has arrived by 'now'.
+static void sim_update(struct sim *sm, long long now) {
+	while (sm->mcount > 0 && sm->marks[sm->mhead].t <= now) {
+		sm->rxvis += sm->marks[sm->mhead].n;
+		sm->arrived += sm->marks[sm->mhead].n;
+		sm->mhead = (sm->mhead + 1) % SIM_MARKS;
+		--sm->mcount;
+	}
+	if (sm->mcount == 0 && sm->pktn > 0 &&
+			now >= sm->pktt + sm->latency * 1000000LL + usb_ns) {
+		sm->rxvis += sm->pktn;
+		sm->arrived += sm->pktn;
+		sm->pktn = 0;
+	}
+}
+
+// When more will arrive, or 0 if nothing is on the way.
+static long long sim_next(struct sim *sm) {
+	if (sm->mcount > 0) {
+		return sm->marks[sm->mhead].t;
+	}
+	if (sm->pktn > 0) {
+		return sm->pktt + sm->latency * 1000000LL + usb_ns;
+	}
+	return 0;
+}
+
+static void sim_select(struct sim *sm, long long t) {
+	int x;
+	for (x = 0; x < sm->ndev; ++x) {
+		struct simdev *d = &sm->devs[x];
+		int sel = (sm->dir & d->csbit) && !(sm->pins & d->csbit);
+		if (sel && !d->sel) {
+			d->model->select(d->dev, t);
+		} else if (!sel && d->sel) {
+			d->model->deselect(d->dev, t);
+		}
+		d->sel = sel;
+	}
+}
+
+// One byte on the SPI bus, returns MISO.
+static unsigned char sim_clock(struct sim *sm, unsigned char mosi, long long t) {
+	unsigned char miso = 0xff;
+	int x;
+	if (sm->loop) {
+		return mosi;
+	}
+	for (x = 0; x < sm->ndev; ++x) {
+		struct simdev *d = &sm->devs[x];
+		if (d->sel) {
+			miso &= d->model->clock(d->dev, mosi, t);
+		}
+	}
+	// past what the wiring allows, about one byte in 16 is misread
+	if (maxhz && sm->hz > maxhz && (rand() & 15) == 0) {
+		miso ^= 1 << (rand() & 7);
+	}
+	return miso;
+}
+
+// GPIOL1, driven by a device's pin() when it is an input.
+static int sim_gpiol1(struct sim *sm, long long t) {
+	int x;
+	if (sm->dir & 0x20) {
+		return (sm->pins & 0x20) != 0;
+	}
+	for (x = 0; x < sm->ndev; ++x) {
+		struct simdev *d = &sm->devs[x];
+		if (d->model->pin != NULL) {
+			return d->model->pin(d->dev, t);
+		}
+	}
+	return 1; // pulled up
+}
+
+static int sim_cmdlen(unsigned char op) {
+	switch (op) {
+	case 0x80:
+	case 0x86:
+	case 0x11:
+	case 0x20:
+	case 0x31:
+	case 0x8f:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+// Run MPSSE command stream, advancing MPSSE time '*tp'.
+static void sim_mpsse(struct sim *sm, unsigned char *buf, int len, long long *tp) {
+	long long t = *tp;
+	long long bytens = usb_ns ? sm->bytens : 0;
+	int x;
+	int k;
+	int n;
+
+	for (x = 0; x < len; ++x) {
+		if (sm->stalled) {
+			break; // commands stay queued until reset
+		}
+		if (sm->left > 0) {
+			// data for bytes out (0x11), or out and in (0x31)
+			t += bytens;
+			unsigned char miso = sim_clock(sm, buf[x], t);
+			if (sm->cmd[0] == 0x31) {
+				sim_put(sm, miso, t);
+			}
+			--sm->left;
+			continue;
+		}
+		sm->cmd[sm->ncmd++] = buf[x];
+		if (sm->ncmd < sim_cmdlen(sm->cmd[0])) {
+			continue;
+		}
+		sm->ncmd = 0;
+		n = (sm->cmd[1] | (sm->cmd[2] << 8)) + 1;
+		switch (sm->cmd[0]) {
+		case 0x80: // set ADBUS
+			sm->pins = sm->cmd[1];
+			sm->dir = sm->cmd[2];
+			sim_select(sm, t);
+			break;
+		case 0x81: // read ADBUS, inputs pulled up
+			k = (sm->pins & sm->dir) | (~sm->dir & 0xdf);
+			if (!(sm->dir & 0x20) && sim_gpiol1(sm, t)) k |= 0x20;
+			sim_put(sm, k, t);
+			break;
+		case 0x88: // wait for GPIOL1 high
+		case 0x89: // wait for GPIOL1 low
+			// Pins only change on SPI commands here, and none can
+			// run during the wait, so it ends now or never.
+			if (sim_gpiol1(sm, t) != (sm->cmd[0] == 0x88)) {
+				sm->stalled = 1;
+			}
+			break;
+		case 0x86: // clock divisor
+			sm->div = n - 1;
+			sim_speed(sm);
+			break;
+		case 0x84: // loopback on
+			sm->loop = 1;
+			break;
+		case 0x85: // loopback off
+			sm->loop = 0;
+			break;
+		case 0x87: // flush
+			sim_send(sm, t);
+			break;
+		case 0x8a: // div-by-5 off
+			sm->div5 = 0;
+			sim_speed(sm);
+			break;
+		case 0x8b: // div-by-5 on
+			sm->div5 = 1;
+			sim_speed(sm);
+			break;
+		case 0x11: // bytes out
+		case 0x31: // bytes out and in
+			sm->left = n;
+			break;
+		case 0x8f: // clock bytes, no data
+			t += n * bytens;
+			break;
+		case 0x20: // bytes in
+			for (k = 0; k < n; ++k) {
+				t += bytens;
+				sim_put(sm, sim_clock(sm, 0x00, t), t);
+			}
+			break;
+		default:
+			// MPSSE answers unknown commands with 0xfa, cmd
+			sim_put(sm, 0xfa, t);
+			sim_put(sm, sm->cmd[0], t);
+			break;
+		}
+	}
+	*tp = t;
+}
+
+static void sim_signal(struct sim *sm) {
+	if (sm->event != NULL && (sm->eventmask & FT_EVENT_RXCHAR)) {
+		pthread_mutex_lock(&sm->event->eMutex);
+		pthread_cond_signal(&sm->event->eCondVar);
+		pthread_mutex_unlock(&sm->event->eMutex);
+	}
+}
+
+// Signals the event when bytes arrive, as the driver would.
+static void *sim_notify(void *arg) {
+	struct sim *sm = arg;
+	struct timespec ts;
+	pthread_mutex_lock(&sm->lock);
+	while (sm->open) {
+		sim_update(sm, sim_now());
+		if (sm->arrived != sm->notified) {
+			sm->notified = sm->arrived;
+			pthread_mutex_unlock(&sm->lock);
+			sim_signal(sm); // not under sm->lock, caller may hold eMutex
+			pthread_mutex_lock(&sm->lock);
+			continue;
+		}
+		long long next = sim_next(sm);
+		if (next) {
+			sim_ts(&ts, next);
+			pthread_cond_timedwait(&sm->wake, &sm->lock, &ts);
+		} else {
+			pthread_cond_wait(&sm->wake, &sm->lock);
+		}
+	}
+	pthread_mutex_unlock(&sm->lock);
+	return NULL;
+}
+
+FT_STATUS FT_CreateDeviceInfoList(LPDWORD lpdwNumDevs) {
+	pthread_once(&sim_once, sim_init);
+	__sync_fetch_and_add(&ftsim_calls, 1);
+	*lpdwNumDevs = SIM_PORTS;
+	return FT_OK;
+}
+
+FT_STATUS FT_GetDeviceInfoList(FT_DEVICE_LIST_INFO_NODE *pDest,
+						LPDWORD lpdwNumDevs) {
+	int x;
+	pthread_once(&sim_once, sim_init);
+	__sync_fetch_and_add(&ftsim_calls, 1);
+	for (x = 0; x < SIM_PORTS; ++x) {
+		memset(&pDest[x], 0, sizeof(pDest[x]));
+		pDest[x].Flags = sims[x].open ? FT_FLAGS_OPENED : 0;
+		pDest[x].Type = FT_DEVICE_232H;
+		pDest[x].ID = 0x04036014;
+		pDest[x].LocId = x + 1;
+		snprintf(pDest[x].SerialNumber, sizeof(pDest[x].SerialNumber),
+							"FTSIM%03d", x);
+		strcpy(pDest[x].Description, "C232HM-DDHSL-0");
+		pDest[x].ftHandle = sims[x].open ? &sims[x] : NULL;
+	}
+	*lpdwNumDevs = SIM_PORTS;
+	return FT_OK;
+}
+
+FT_STATUS FT_Open(int deviceNumber, FT_HANDLE *pHandle) {
+	pthread_once(&sim_once, sim_init);
+	__sync_fetch_and_add(&ftsim_calls, 1);
+	if (deviceNumber < 0 || deviceNumber >= SIM_PORTS) {
+		return FT_DEVICE_NOT_FOUND;
+	}
+	struct sim *sm = &sims[deviceNumber];
+	pthread_mutex_lock(&sm->lock);
+	if (sm->open) {
+		pthread_mutex_unlock(&sm->lock);
+		return FT_DEVICE_NOT_OPENED;
+	}
+	sm->open = 1;
+	sm->pins = sm->dir = 0;
+	sm->loop = 0;
+	sm->div5 = 1;
+	sm->div = 0;
+	sim_speed(sm);
+	sm->busy = 0;
+	sm->ncmd = sm->left = 0;
+	sm->stalled = 0;
+	sm->rxhead = sm->rxlen = sm->rxvis = 0;
+	sm->arrived = sm->notified = 0;
+	sm->mhead = sm->mcount = 0;
+	sm->pktn = 0;
+	sm->pktmax = 4096 - 2 * (4096 / 512);
+	sm->latency = 16;
+	sm->rdtimeout = 0;
+	sm->event = NULL;
+	sm->eventmask = 0;
+	sm->notifying = 0;
+	pthread_mutex_unlock(&sm->lock);
+	*pHandle = sm;
+	return FT_OK;
+}
+
+FT_STATUS FT_Close(FT_HANDLE ftHandle) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	pthread_mutex_lock(&sm->lock);
+	sm->open = 0;
+	pthread_cond_signal(&sm->wake);
+	pthread_mutex_unlock(&sm->lock);
+	if (sm->notifying) {
+		pthread_join(sm->notifier, NULL);
+		sm->notifying = 0;
+	}
+	return FT_OK;
+}
+
+FT_STATUS FT_GetDriverVersion(FT_HANDLE ftHandle, LPDWORD lpdwVersion) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	*lpdwVersion = 0x010000; // 1.0.0, simulated
+	return FT_OK;
+}
+
+FT_STATUS FT_ResetDevice(FT_HANDLE ftHandle) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	return FT_OK;
+}
+
+FT_STATUS FT_SetBitMode(FT_HANDLE ftHandle, UCHAR ucMask, UCHAR ucEnable) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	pthread_mutex_lock(&sm->lock);
+	sm->stalled = 0;
+	sm->ncmd = sm->left = 0;
+	pthread_mutex_unlock(&sm->lock);
+	return FT_OK;
+}
+
+FT_STATUS FT_SetLatencyTimer(FT_HANDLE ftHandle, UCHAR ucLatency) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	if (ucLatency < 1) return FT_INVALID_PARAMETER;
+	pthread_mutex_lock(&sm->lock);
+	sm->latency = ucLatency;
+	pthread_mutex_unlock(&sm->lock);
+	return FT_OK;
+}
+
+FT_STATUS FT_SetUSBParameters(FT_HANDLE ftHandle, ULONG ulInTransferSize,
+						ULONG ulOutTransferSize) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	if (ulInTransferSize < 64 || ulInTransferSize > 65536 ||
+				(ulInTransferSize % 64) != 0) {
+		return FT_INVALID_PARAMETER;
+	}
+	// Every 512-byte USB packet carries 2 modem status bytes.
+	pthread_mutex_lock(&sm->lock);
+	sm->pktmax = ulInTransferSize -
+			2 * ((ulInTransferSize + 511) / 512);
+	pthread_mutex_unlock(&sm->lock);
+	return FT_OK;
+}
+
+FT_STATUS FT_SetTimeouts(FT_HANDLE ftHandle, ULONG ReadTimeout,
+						ULONG WriteTimeout) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	sm->rdtimeout = ReadTimeout;
+	return FT_OK;
+}
+
+FT_STATUS FT_SetEventNotification(FT_HANDLE ftHandle, DWORD Mask,
+						PVOID Param) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	pthread_mutex_lock(&sm->lock);
+	sm->event = Param;
+	sm->eventmask = Mask;
+	pthread_mutex_unlock(&sm->lock);
+	if (usb_ns && !sm->notifying) {
+		if (pthread_create(&sm->notifier, NULL, sim_notify, sm) != 0) {
+			return FT_INSUFFICIENT_RESOURCES;
+		}
+		sm->notifying = 1;
+	}
+	return FT_OK;
+}
+
+FT_STATUS FT_Purge(FT_HANDLE ftHandle, ULONG Mask) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	pthread_mutex_lock(&sm->lock);
+	if (Mask & FT_PURGE_RX) {
+		sm->rxhead = sm->rxlen = sm->rxvis = 0;
+		sm->mhead = sm->mcount = 0;
+		sm->pktn = 0;
+	}
+	if (Mask & FT_PURGE_TX) {
+		sm->ncmd = sm->left = 0;
+	}
+	pthread_mutex_unlock(&sm->lock);
+	return FT_OK;
+}
+
+FT_STATUS FT_GetQueueStatus(FT_HANDLE ftHandle, DWORD *dwRxBytes) {
+	struct sim *sm = sim_get(ftHandle);
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	pthread_mutex_lock(&sm->lock);
+	sim_update(sm, sim_now());
+	*dwRxBytes = sm->rxvis;
+	pthread_mutex_unlock(&sm->lock);
+	return FT_OK;
+}
+
+FT_STATUS FT_Write(FT_HANDLE ftHandle, LPVOID lpBuffer, DWORD dwBytesToWrite,
+						LPDWORD lpBytesWritten) {
+	struct sim *sm = sim_get(ftHandle);
+	long long t;
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	pthread_mutex_lock(&sm->lock);
+	t = sim_now();
+	if (usb_ns) {
+		t += usb_ns;
+		if (jitter_ns) t += rand() % jitter_ns;
+		if (t < sm->busy) t = sm->busy;
+	}
+	sim_mpsse(sm, lpBuffer, dwBytesToWrite, &t);
+	sm->busy = t;
+	pthread_cond_signal(&sm->wake);
+	pthread_mutex_unlock(&sm->lock);
+	*lpBytesWritten = dwBytesToWrite;
+	if (usb_ns == 0) {
+		sim_signal(sm);
+	}
+	return FT_OK;
+}
+
+FT_STATUS FT_Read(FT_HANDLE ftHandle, LPVOID lpBuffer, DWORD dwBytesToRead,
+						LPDWORD lpBytesReturned) {
+	struct sim *sm = sim_get(ftHandle);
+	unsigned char *buf = lpBuffer;
+	struct timespec ts;
+	long long deadline;
+	long long next;
+	int k;
+	if (sm == NULL) return FT_INVALID_HANDLE;
+	pthread_mutex_lock(&sm->lock);
+	deadline = sm->rdtimeout ? sim_now() + sm->rdtimeout * 1000000LL : 0;
+	// Wait for the bytes, while there are more on the way.
+	for (;;) {
+		sim_update(sm, sim_now());
+		if (sm->rxvis >= dwBytesToRead || (next = sim_next(sm)) == 0) {
+			break;
+		}
+		if (deadline && next > deadline) {
+			next = deadline;
+		}
+		if (deadline && sim_now() >= deadline) {
+			break;
+		}
+		sim_ts(&ts, next);
+		pthread_cond_timedwait(&sm->wake, &sm->lock, &ts);
+	}
+	for (k = 0; k < dwBytesToRead && sm->rxvis > 0; ++k) {
+		buf[k] = sm->rx[sm->rxhead];
+		sm->rxhead = (sm->rxhead + 1) % SIM_RXBUF;
+		--sm->rxlen;
+		--sm->rxvis;
+	}
+	pthread_mutex_unlock(&sm->lock);
+	*lpBytesReturned = k;
+	return FT_OK;
+}
@@ -0,0 +1,33 @@
+#ifndef __FTSIM_H__
+#define __FTSIM_H__
+
+// In-process stand-in for libftd2xx (ftsim.c), so that spilib
+// and programs may be run without a C232HM.
+
+// Count of FT_Xxxx() calls, each would be at least one system call
+// with the real driver.
+extern unsigned long ftsim_calls;
+
+// A simulated SPI device, attached to a chip-select pin of a port.
+// Times are CLOCK_MONOTONIC nS, when the clock edge would happen.
+struct ftsim_model {
+	char *name;
+	void *(*init)(void);
+	void (*select)(void *dev, long long t);		// CS asserted
+	// one byte clocked while selected, returns MISO
+	unsigned char (*clock)(void *dev, unsigned char mosi, long long t);
+	void (*deselect)(void *dev, long long t);	// CS released
+	// level of the device's ready/interrupt output, wired to GPIOL1
+	// (the pin MPSSE can wait on), or NULL if none
+	int (*pin)(void *dev, long long t);
+};
+
+extern struct ftsim_model ftsim_25lc512;	// sim25lc512.c
+extern struct ftsim_model ftsim_w5500;		// simw5500.c
+extern struct ftsim_model ftsim_w25q64;		// simflash.c
+extern struct ftsim_model ftsim_w25q256;
+
+// Attach model to 'port' with chip-select 'cs' (0..3, C as for set_cs()).
+int ftsim_attach(int port, char cs, struct ftsim_model *model);
+
+#endif /* __FTSIM_H__ */
@@ -0,0 +1,331 @@
+/*
+ * Gang programming of 25LC512 SEEPROMs, one per C232HM cable.
+ *
+ * Usage: nvgang [options] [-f file] [-i port:file]... <addr>
+ *
+ * All matching cables are opened and programmed at once,
+ * one thread per cable, and a combined report is printed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "nvlib.h"
+
+#define MAX_CABLES	64
+#define MAX_IMAGES	(MAX_CABLES + 1)	// one per cable, and -f
+
+struct image {
+	char *file;
+	unsigned char *buf;
+	int len;
+};
+
+struct cable {
+	int port;
+	char serial[16];
+	char desc[64];
+	struct image *img;
+	pthread_t thread;
+	int started;
+	int result;	// 0 = pass
+	char *error;	// step that failed
+	FT_STATUS status;
+	double open_ms;
+	double write_ms;
+	double verify_ms;
+};
+
+static int addr = 0;
+static int verify = 0;
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// As much of the file as fits from 'addr' to the end of the part.
+static int load_image(struct image *img) {
+	struct stat stb;
+	int fd = open(img->file, O_RDONLY);
+	if (fd < 0) {
+		perror(img->file);
+		return -1;
+	}
+	if (fstat(fd, &stb) < 0) {
+		perror(img->file);
+		close(fd);
+		return -1;
+	}
+	if (stb.st_size == 0) {
+		fprintf(stderr, "%s: empty image\n", img->file);
+		close(fd);
+		return -1;
+	}
+	img->len = stb.st_size > NV_SIZE - addr ? NV_SIZE - addr : stb.st_size;
+	img->buf = malloc(img->len);
+	if (img->buf == NULL) {
+		perror("malloc");
+		close(fd);
+		return -1;
+	}
+	int x = read(fd, img->buf, img->len);
+	close(fd);
+	if (x < 0) {
+		perror(img->file);
+		return -1;
+	}
+	if (x == 0) {
+		fprintf(stderr, "%s: empty image\n", img->file);
+		return -1;
+	}
+	img->len = x;
+	return 0;
+}
+
+static void *program(void *arg) {
+	struct cable *cb = arg;
+	struct spi_dev *ft;
+	double t0 = now_ms();
+
+	cb->result = -1;
+	ft = spi_open(cb->port);
+	cb->open_ms = now_ms() - t0;
+	if (ft == NULL) {
+		cb->error = "open";
+		cb->status = ftStatus;
+		return NULL;
+	}
+	t0 = now_ms();
+	int e = nv_write(ft, cb->img->buf, addr, cb->img->len);
+	cb->write_ms = now_ms() - t0;
+	if (e < 0) {
+		cb->error = "write";
+		goto out;
+	}
+	if (verify) {
+		struct crc16_check ck;
+		t0 = now_ms();
+		e = nv_verify(ft, cb->img->buf, addr, cb->img->len, &ck);
+		cb->verify_ms = now_ms() - t0;
+		if (e < 0) {
+			cb->error = "read";
+			goto out;
+		}
+		if (e > 0) {
+			cb->error = "verify";
+			goto out;
+		}
+	}
+	cb->result = 0;
+out:
+	cb->status = ft->status;
+	spi_close(ft);
+	return NULL;
+}
+
+// Each file is loaded only once, however many cables use it.
+// Returns NULL if there are already MAX_IMAGES.
+static struct image *add_image(struct image *imgs, int *nimg, char *file) {
+	int x;
+	for (x = 0; x < *nimg; ++x) {
+		if (strcmp(imgs[x].file, file) == 0) {
+			return &imgs[x];
+		}
+	}
+	if (x >= MAX_IMAGES) {
+		fprintf(stderr, "Too many images\n");
+		return NULL;
+	}
+	imgs[x].file = file;
+	++*nimg;
+	return &imgs[x];
+}
+
+int main(int argc, char **argv) {
+	static struct cable cables[MAX_CABLES];
+	static struct image imgs[MAX_IMAGES];
+	static int ports[MAX_CABLES];	// per-port image (index+1), or 0
+	FT_DEVICE_LIST_INFO_NODE *info;
+	DWORD ndev = 0;
+	int ncab = 0;
+	int nimg = 0;
+	int speed = 0;
+	int verbose = 0;
+	int cs = 'C';
+	char *match = "C232HM";
+	struct image *deflt = NULL;
+	int pass = 0;
+	int x;
+	int c;
+
+	extern char *optarg;
+	extern int optind;
+
+	while ((c = getopt(argc, argv, "d:f:g:i:s:u:vV")) != EOF) {
+		switch(c) {
+		case 'd':
+			match = optarg;
+			break;
+		case 'f':
+			deflt = add_image(imgs, &nimg, optarg);
+			if (deflt == NULL) {
+				exit(1);
+			}
+			break;
+		case 'g':
+			cs = set_cs(optarg[0]);
+			if (cs < 0) {
+				fprintf(stderr, "Invalid GPIO /CS\n");
+				exit(1);
+			}
+			break;
+		case 'i': {
+			char *sep = strchr(optarg, ':');
+			x = strtol(optarg, NULL, 0);
+			if (sep == NULL || x < 0 || x >= MAX_CABLES) {
+				fprintf(stderr, "Invalid -i %s\n", optarg);
+				exit(1);
+			}
+			struct image *img = add_image(imgs, &nimg, sep + 1);
+			if (img == NULL) {
+				exit(1);
+			}
+			ports[x] = (img - imgs) + 1;
+			break;
+		}
+		case 's':
+			speed = parse_speed(optarg);
+			break;
+		case 'u':
+			if (spi_tune(parse_tune(optarg)) < 0) {
+				fprintf(stderr, "Invalid USB tuning '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		default:
+			fprintf(stderr, "Unknown option '%c'\n", c);
+			exit(1);
+		}
+	}
+	if (argc - optind != 1) {
+		fprintf(stderr, "Usage: %s [options] <addr>\n", argv[0]);
+		fprintf(stderr, "Options:\n"
+				"    -f file  Image for all cables\n"
+				"    -i p:file  Image for port p (overrides -f)\n"
+				"    -d desc  Use cables matching desc (def C232HM)\n"
+				"    -V       Verify after write\n"
+				"    -s hz   Use hz clock speed (def 1.2M)\n"
+				"    -u tune USB tuning: lat, bulk, auto (def auto)\n"
+				"    -g cs   Use gpio for chip-select (0..3, def C)\n"
+		);
+		exit(1);
+	}
+	addr = strtol(argv[optind], NULL, 0);
+	if (addr < 0 || addr >= NV_SIZE) {
+		fprintf(stderr, "Invalid address\n");
+		exit(1);
+	}
+	for (x = 0; x < nimg; ++x) {
+		if (load_image(&imgs[x]) < 0) {
+			exit(1);
+		}
+	}
+	if (speed > 0) {
+		speed = spi_speed(speed);
+	} else {
+		speed = spi_speed(0);
+	}
+	if (verbose) {
+		printf("Using speed %sHz\n", print_speed(speed));
+		printf("Using chip-select '%c'\n", cs);
+	}
+	ftStatus = FT_CreateDeviceInfoList(&ndev);
+	if (ftStatus != FT_OK) {
+		fprintf(stderr, "Unable to list devices, error = %d\n", ftStatus);
+		exit(1);
+	}
+	info = malloc((ndev ? ndev : 1) * sizeof(*info));
+	if (info == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	ftStatus = FT_GetDeviceInfoList(info, &ndev);
+	if (ftStatus != FT_OK) {
+		fprintf(stderr, "Unable to list devices, error = %d\n", ftStatus);
+		exit(1);
+	}
+	for (x = 0; x < ndev && x < MAX_CABLES; ++x) {
+		if (strncmp(info[x].Description, match, strlen(match)) != 0) {
+			continue;
+		}
+		if (ports[x]) {
+			cables[ncab].img = &imgs[ports[x] - 1];
+		} else if (deflt) {
+			cables[ncab].img = deflt;
+		} else {
+			continue; // no image for this cable
+		}
+		cables[ncab].port = x;
+		strncpy(cables[ncab].serial, info[x].SerialNumber,
+					sizeof(cables[ncab].serial) - 1);
+		strncpy(cables[ncab].desc, info[x].Description,
+					sizeof(cables[ncab].desc) - 1);
+		++ncab;
+	}
+	if (ncab == 0) {
+		fprintf(stderr, "No cables to program\n");
+		exit(1);
+	}
+	double t0 = now_ms();
+	for (x = 0; x < ncab; ++x) {
+		c = pthread_create(&cables[x].thread, NULL, program, &cables[x]);
+		if (c != 0) {
+			cables[x].result = -1;
+			cables[x].error = "thread";
+		} else {
+			cables[x].started = 1;
+		}
+	}
+	for (x = 0; x < ncab; ++x) {
+		if (cables[x].started) {
+			pthread_join(cables[x].thread, NULL);
+		}
+	}
+	double tot = now_ms() - t0;
+	printf("port serial           result    open(ms) write(ms) verify(ms) image\n");
+	for (x = 0; x < ncab; ++x) {
+		struct cable *cb = &cables[x];
+		if (cb->result == 0) {
+			++pass;
+			printf("%4d %-16s PASS      ", cb->port, cb->serial);
+		} else {
+			printf("%4d %-16s FAIL %-6s", cb->port, cb->serial,
+							cb->error);
+		}
+		printf("%8.1f %9.1f %10.1f %s (%d)\n", cb->open_ms,
+			cb->write_ms, cb->verify_ms, cb->img->file, cb->img->len);
+	}
+	printf("%d of %d passed, %.1f mS total\n", pass, ncab, tot);
+	for (x = 0; x < ncab; ++x) {
+		if (cables[x].result != 0 && cables[x].status != FT_OK) {
+			fprintf(stderr, "port %d error = %d\n", cables[x].port,
+							cables[x].status);
+		}
+	}
+	return pass == ncab ? 0 : 2;
+}
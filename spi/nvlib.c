@@ -0,0 +1,210 @@
+/*
+ * Read/write routines for 25LC512 SEEPROM
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "nvlib.h"
+#include "crc16.h"
+
+static unsigned char wren[] = { 0x06 };
+static unsigned char wrdi[] = { 0x04 };
+static unsigned char rdsr[] = { 0x05 };
+
+// Start write of one page (or part), the write cycle follows.
+// Returns 0, or -1..-2 for the step that failed.
+static int nv_page_start(struct spi_dev *dev, unsigned char *buf, int addr, int len) {
+	unsigned char hdr[3];
+	struct spi_seg seg[] = {
+		{ hdr, NULL, sizeof(hdr) },
+		{ buf, NULL, len },	// 1 <= len <= 128
+	};
+	hdr[0] = 0x02; // WRITE command
+	hdr[1] = (addr >> 8) & 0xff; // big-endian address
+	hdr[2] = addr & 0xff;
+	if (spi_xfer_out(dev, wren, sizeof(wren)) < 0) {
+		return -1;
+	}
+	if (spi_xferv(dev, seg, 2) < 0) {
+		return -2;
+	}
+	return 0;
+}
+
+// Wait for the write cycle to finish.
+// Returns 0, or -3..-4 for the step that failed.
+static int nv_page_end(struct spi_dev *dev) {
+	// until WIP clears, or a missing chip (MISO high) times out
+	int sr = spi_poll(dev, rdsr, sizeof(rdsr), 0x01, 0x00, NV_TWC, NV_TIMEOUT);
+	if (sr < 0) {
+		return -3;
+	}
+	// something went wrong if WREN still set...
+	if ((sr & 0x02) != 0) {
+		(void)spi_xfer_out(dev, wrdi, sizeof(wrdi));
+		dev->status = -1;
+		return -4;
+	}
+	return 0;
+}
+
+// Write one page (or part). Must not cross a page boundary.
+// Returns 0, or -1..-4 for the step that failed.
+int nv_page(struct spi_dev *dev, unsigned char *buf, int addr, int len) {
+	spi_lock(dev);
+	int e = nv_page_start(dev, buf, addr, len);
+	if (e == 0) {
+		e = nv_page_end(dev);
+	}
+	spi_unlock(dev);
+	return e;
+}
+
+// Write any length, in pages. Returns len, or -1 on error.
+int nv_write(struct spi_dev *dev, unsigned char *buf, int addr, int len) {
+	int e = 0;
+	int a = addr;
+	int l = len;
+	unsigned char *b = buf;
+	while (l > 0) {
+		int k = NV_PAGE - (a % NV_PAGE); // to end of page
+		if (k > l) k = l;
+		e = nv_page(dev, b, a, k);
+		if (e < 0) break;
+		b += k;
+		a += k;
+		l -= k;
+	}
+	// TODO: or return len-l?
+	return e < 0 ? -1 : len;
+}
+
+static long long nv_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Differential write: read what is there, then write only the pages
+// that differ, and of those only from the first to the last changed
+// byte. Counts and times go in 'df' (may be NULL).
+// Returns len, or -1 on error.
+int nv_update(struct spi_dev *dev, unsigned char *buf, int addr, int len,
+			struct nv_diff *df) {
+	struct nv_diff d;
+	unsigned char *cur;
+	long long t0 = nv_now();
+	long long t1;
+	int e = 0;
+	int o, k, x, y;
+
+	memset(&d, 0, sizeof(d));
+	cur = malloc(len > 0 ? len : 1);
+	if (cur == NULL) {
+		return -1;
+	}
+	spi_lock(dev);
+	if (nv_read(dev, cur, addr, len) < 0) {
+		e = -1;
+		goto out;
+	}
+	t1 = nv_now();
+	d.read_us = (t1 - t0) / 1000;
+	for (o = 0; o < len; o += k) {
+		k = NV_PAGE - ((addr + o) % NV_PAGE); // to end of page
+		if (k > len - o) k = len - o;
+		++d.pages;
+		for (x = 0; x < k && cur[o + x] == buf[o + x]; ++x)
+			;
+		if (x == k) {
+			++d.skipped;
+			continue;
+		}
+		for (y = k; cur[o + y - 1] == buf[o + y - 1]; --y)
+			;
+		e = nv_page(dev, buf + o + x, addr + o + x, y - x);
+		if (e < 0) {
+			e = -1;
+			goto out;
+		}
+		++d.written;
+	}
+	d.write_us = (nv_now() - t1) / 1000;
+out:
+	spi_unlock(dev);
+	free(cur);
+	if (df != NULL) {
+		*df = d;
+	}
+	return e < 0 ? -1 : len;
+}
+
+// Read any length. Returns len, or -1 on error.
+int nv_read(struct spi_dev *dev, unsigned char *buf, int addr, int len) {
+	unsigned char cmd[3];
+	cmd[0] = 0x03; // READ command
+	cmd[1] = (addr >> 8) & 0xff; // big-endian address
+	cmd[2] = addr & 0xff;
+	return spi_xfer_cmd(dev, cmd, sizeof(cmd), buf, len);
+}
+
+// Read 'len' bytes from 'addr' with one READ command, passing each chunk
+// to 'fn' as it arrives. Returns len, or -1 on error.
+int nv_read_stream(struct spi_dev *dev, int addr, int len,
+			spi_chunk_t fn, void *arg) {
+	unsigned char cmd[3];
+	cmd[0] = 0x03; // READ command
+	cmd[1] = (addr >> 8) & 0xff; // big-endian address
+	cmd[2] = addr & 0xff;
+	return spi_xfer_stream(dev, cmd, sizeof(cmd), len, fn, arg);
+}
+
+// Write up to 'len' bytes at 'addr', in pages, 'fn' filling each page
+// buffer in turn (returns bytes filled, fewer only at the end). Pages
+// are double-buffered: the next is filled during the write cycle.
+// Returns bytes written, or -1 on error.
+int nv_write_stream(struct spi_dev *dev, int addr, int len,
+			spi_chunk_t fn, void *arg) {
+	unsigned char buf[2][NV_PAGE];
+	int cur = 0;
+	int tot = 0;
+	int e = 0;
+	int k, n, m;
+
+	k = NV_PAGE - (addr % NV_PAGE); // to end of page
+	if (k > len) k = len;
+	n = k > 0 ? fn(arg, buf[cur], 0, k) : 0;
+	spi_lock(dev);
+	while (n > 0) {
+		e = nv_page_start(dev, buf[cur], addr + tot, n);
+		if (e < 0) {
+			break;
+		}
+		tot += n;
+		k = NV_PAGE - ((addr + tot) % NV_PAGE);
+		if (k > len - tot) k = len - tot;
+		m = k > 0 ? fn(arg, buf[!cur], tot, k) : 0;
+		e = nv_page_end(dev);
+		if (e < 0) {
+			break;
+		}
+		cur = !cur;
+		n = m;
+	}
+	spi_unlock(dev);
+	return (e < 0 || n < 0) ? -1 : tot;
+}
+
+// Verify 'len' bytes at 'addr' against 'buf', comparing the CRC of each
+// chunk with that of the image while later chunks are still being read,
+// so it takes no longer than the read. Stops at the first bad chunk.
+// Returns 0 if all match, 1 if not (see 'ck'), or -1 on error.
+int nv_verify(struct spi_dev *dev, unsigned char *buf, int addr, int len,
+			struct crc16_check *ck) {
+	crc16_check_init(ck, buf, addr);
+	return crc16_check_result(ck,
+			nv_read_stream(dev, addr, len, crc16_check_chunk, ck));
+}
@@ -0,0 +1,37 @@
+#ifndef __NVLIB_H__
+#define __NVLIB_H__
+
+#include "spilib.h"
+#include "crc16.h"
+
+// 25LC512 SEEPROM
+#define NV_SIZE		65536
+#define NV_PAGE		128
+#define NV_TWC		5000	// uS, page write cycle (max)
+#define NV_TIMEOUT	50	// mS, give up on write cycle
+
+int nv_page(struct spi_dev *dev, unsigned char *buf, int addr, int len);
+int nv_write(struct spi_dev *dev, unsigned char *buf, int addr, int len);
+int nv_read(struct spi_dev *dev, unsigned char *buf, int addr, int len);
+
+// Write only pages that differ from what the device holds.
+struct nv_diff {
+	int pages;		// pages in range (or part)
+	int written;
+	int skipped;		// already correct
+	long long read_us;	// reading current contents
+	long long write_us;	// writing changed pages
+};
+int nv_update(struct spi_dev *dev, unsigned char *buf, int addr, int len,
+			struct nv_diff *df);
+// Streaming, see spi_xfer_stream(). For writes 'fn' fills 'buf'.
+int nv_read_stream(struct spi_dev *dev, int addr, int len,
+			spi_chunk_t fn, void *arg);
+int nv_write_stream(struct spi_dev *dev, int addr, int len,
+			spi_chunk_t fn, void *arg);
+
+// Streaming verify against an image, see crc16_check.
+int nv_verify(struct spi_dev *dev, unsigned char *buf, int addr, int len,
+			struct crc16_check *ck);
+
+#endif /* __NVLIB_H__ */
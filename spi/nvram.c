@@ -3,7 +3,19 @@
  *
  * Usage: nvram [-p port] <addr> <len>
  *        nvram [-p port][-w] <addr> <byte>[...]
+ *        nvram [-p port] -f file|- <addr> <len>
+ *        nvram [-p port] -w -f file|- <addr>
  *
+ * With -d, writes read the device first and only write pages that differ.
+ * With -V, the device is checked against the data, after any write, by
+ * CRC16 of each chunk as it is read.
+ *
+ * Reads stream, with one READ command, to stdout (hex dump or '-f -')
+ * or to a file, which is memory-mapped. Writes of '-f' may stream
+ * from a pipe, page by page.
+ *
+ * With -b, each line of the script is a command as above, all run over
+ * one open device.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,224 +23,428 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "ftd2xx.h"
 #include "spilib.h"
+#include "nvlib.h"
 
-static unsigned char wrbuf[3 + 128] = { 0 };
-static unsigned char wxbuf[3 + 128];
-static unsigned char wren[] = { 0x06 };
-static unsigned char wrdi[] = { 0x04 };
-static unsigned char rdsr[] = { 0x05, 0xff };
-static unsigned char rbuf[2];
+// Options and arguments of one command.
+struct nv_cmd {
+	int wr;
+	int port;
+	int speed;
+	int cs;
+	int tune;
+	int verbose;
+	int stats;
+	int diff;
+	int verify;
+	char *file;
+	char *script;
+	int nargs;
+	char **args;
+};
+
+// File, pipe, or stdin/stdout being streamed.
+struct nv_io {
+	int fd;
+	int addr;
+};
 
-static int nvwrite(FT_HANDLE ft, unsigned char *buf, int addr, int len) {
-	memcpy(wrbuf + 3, buf, len); // 1 <= len <= 128
-	wrbuf[0] = 0x02; // WRITE command
-	wrbuf[1] = (addr >> 8) & 0xff; // big-endian address
-	wrbuf[2] = addr & 0xff;
-	int e = spi_xfer(ft, wren, rbuf, sizeof(wren));
-	if (e < 0) return -1;
-	// 
-	e = spi_xfer(ft, wrbuf, wxbuf, len + 3);
-	if (e < 0) return -2;
-	do {
-		e = spi_xfer(ft, rdsr, buf, sizeof(rdsr));
-		if (e < 0) return -3;
-	} while ((buf[1] & 0x01) != 0);
-	// something went wrong if WREN still set...
-	if ((buf[1] & 0x02) != 0) {
-		(void)spi_xfer(ft, wrdi, buf, sizeof(wrdi));
-		ftStatus = -1;
-		return -4;
+// Map a regular file, for reads sized to 'len', for writes
+// shortening 'len' to the file. NULL if it can't be mapped.
+static unsigned char *nv_map(struct nv_io *io, int wr, int *len) {
+	struct stat stb;
+	void *p;
+	if (fstat(io->fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+		return NULL;
+	}
+	if (wr) {
+		if (stb.st_size < *len) *len = stb.st_size;
+		if (*len == 0) return NULL;
+		p = mmap(NULL, *len, PROT_READ, MAP_SHARED, io->fd, 0);
+	} else {
+		if (ftruncate(io->fd, *len) < 0) return NULL;
+		p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, io->fd, 0);
 	}
+	return p == MAP_FAILED ? NULL : p;
+}
+
+// spi_chunk_t for reads, hex dump to stdout.
+static int put_dump(void *arg, unsigned char *buf, int off, int len) {
+	struct nv_io *io = arg;
+	dump_buf(buf, io->addr + off, len);
 	return 0;
 }
 
-static int nvwrbuf(FT_HANDLE ft, unsigned char *buf, int addr, int len) {
-	int e;
-	int a = addr;
-	int l = len;
-	unsigned char *b = buf;
-	while (l >= 128) {
-		e = nvwrite(ft, b, a, 128);
-		if (e < 0) break;
-		b += 128;
-		a += 128;
-		l -= 128;
-	}
-	if (l > 0) {
-		e = nvwrite(ft, b, a, l);
-	}
-	// TODO: or return len-l?
-	return e < 0 ? -1 : len;
+// spi_chunk_t for reads, to file or pipe.
+static int put_fd(void *arg, unsigned char *buf, int off, int len) {
+	struct nv_io *io = arg;
+	while (len > 0) {
+		int n = write(io->fd, buf, len);
+		if (n < 0) {
+			perror("write");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
 }
 
-int main(int argc, char **argv) {
-	int wr = 0;
-	int addr = 0;
-	int len = 0;
-	int tot = 0;
-	int port = 0;
-	int speed = 0;
-	int verbose = 0;
-	int cs = 'C';
-	char *file = NULL;
-	int fd;
-	unsigned char *bufo;
-	unsigned char *bufi;
-	int x;
-	int c;
-	int e;
-	FT_HANDLE ft;
+// spi_chunk_t for writes, fill 'buf' from file or pipe.
+static int get_fd(void *arg, unsigned char *buf, int off, int len) {
+	struct nv_io *io = arg;
+	int got = 0;
+	while (got < len) {
+		int n = read(io->fd, buf + got, len - got);
+		if (n < 0) {
+			perror("read");
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		got += n;
+	}
+	return got;
+}
 
+// Report time taken, and the effective clock rate.
+static void nv_time(char *what, int len, struct timeval *t0, struct timeval *t1) {
+	long long us = (t1->tv_sec - t0->tv_sec) * 1000000LL +
+			(t1->tv_usec - t0->tv_usec);
+	fprintf(stderr, "%s %d bytes in %lld mS", what, len, us / 1000);
+	if (us > 0) {
+		fprintf(stderr, ", %sHz effective",
+				print_speed((int)(len * 8000000LL / us)));
+	}
+	fprintf(stderr, "\n");
+}
+
+// Returns 0, or -1 if the options or arguments don't parse.
+static int nv_parse(struct nv_cmd *d, int argc, char **argv) {
 	extern char *optarg;
 	extern int optind;
+	int c;
+	int e;
 
-	while ((c = getopt(argc, argv, "f:g:p:s:vw")) != EOF) {
+	while ((c = getopt(argc, argv, "b:df:g:p:s:u:vwSV")) != EOF) {
 		switch(c) {
+		case 'b':
+			d->script = optarg;
+			break;
+		case 'd':
+			d->diff = 1;
+			break;
 		case 'f':
-			file = optarg;
+			d->file = optarg;
 			break;
 		case 'g':
-			cs = set_cs(optarg[0]);
-			if (cs < 0) {
+			d->cs = set_cs(optarg[0]);
+			if (d->cs < 0) {
 				fprintf(stderr, "Invalid GPIO /CS\n");
-				exit(1);
+				return -1;
 			}
 			break;
 		case 'p':
-			port = strtol(optarg, NULL, 0);
+			d->port = strtol(optarg, NULL, 0);
 			break;
 		case 's':
-			speed = parse_speed(optarg);
+			d->speed = parse_speed(optarg);
+			break;
+		case 'S':
+			d->stats = 1;
+			break;
+		case 'u':
+			d->tune = parse_tune(optarg);
+			if (spi_tune(d->tune) < 0) {
+				fprintf(stderr, "Invalid USB tuning '%s'\n", optarg);
+				return -1;
+			}
 			break;
 		case 'v':
-			verbose = 1;
+			d->verbose = 1;
 			break;
 		case 'w':
-			wr = 1;
+			d->wr = 1;
+			break;
+		case 'V':
+			d->verify = 1;
 			break;
 		default:
 			fprintf(stderr, "Unknown option '%c'\n", c);
-			exit(1);
+			return -1;
 		}
 	}
+	d->nargs = argc - optind;
+	d->args = argv + optind;
 	e = 0; // command parse error?
-	if (wr) {
-		if (file) e = (argc - optind != 1);
-		else e = (argc - optind < 2);
+	if (d->script) {
+		e = (d->nargs != 0);
+	} else if (d->wr || d->verify) {
+		if (d->file) e = (d->nargs != 1);
+		else e = (d->nargs < 2);
+	} else {
+		e = (d->nargs != 2);
+	}
+	if ((d->diff && !d->wr) || (d->verify && !d->wr && !d->file)) {
+		e = 1;
+	}
+	return e ? -1 : 0;
+}
+
+// Run one command. Returns 0, 1 if verify failed, or -1 on error.
+static int nv_run(struct spi_dev *ft, struct nv_cmd *d) {
+	int wr = d->wr;
+	int verify = d->verify;
+	int diff = d->diff;
+	int verbose = d->verbose;
+	char *file = d->file;
+	int addr = 0;
+	int len = 0;
+	struct nv_diff df;
+	struct crc16_check ck;
+	int rc = 0;
+	struct nv_io io;
+	unsigned char *map = NULL;
+	unsigned char *bufo = NULL;
+	unsigned char *data;
+	struct timeval t0, t1;
+	int x;
+	int e;
+
+	x = 0;
+	addr = strtol(d->args[x++], NULL, 0);
+	if (addr < 0 || addr >= NV_SIZE) {
+		fprintf(stderr, "Invalid address\n");
+		return -1;
+	}
+	// READ and WRITE commands are always 3 bytes.
+	if (wr && !file) {
+		len = d->nargs - x;
+		bufo = malloc(len);
+		if (bufo == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		int y = 0;
+		while (x < d->nargs) {
+			bufo[y++] = (unsigned char)strtol(d->args[x], NULL, 0);
+			++x;
+		}
+	} else if (wr || verify) {
+		len = NV_SIZE - addr; // or to end of file
+	} else {
+		len = strtol(d->args[x++], NULL, 0);
+		if (len <= 0) {
+			fprintf(stderr, "Invalid length\n");
+			return -1;
+		}
+	}
+	if ((wr || verify) && len > NV_SIZE - addr) {
+		len = NV_SIZE - addr;
+	}
+	io.fd = -1;
+	io.addr = addr;
+	if (file && strcmp(file, "-") == 0) {
+		io.fd = (wr || verify) ? 0 : 1;
+		fflush(stdout); // any hex dumps before
+	} else if (file) {
+		if (wr || verify) {
+			io.fd = open(file, O_RDONLY);
+		} else {
+			io.fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		}
+		if (io.fd < 0) {
+			perror(file);
+			free(bufo);
+			return -1;
+		}
+		map = nv_map(&io, wr || verify, &len);
+	}
+	if ((diff || verify) && file && map == NULL) {
+		// whole image needed to compare
+		bufo = malloc(len);
+		if (bufo == NULL) {
+			perror("malloc");
+			rc = -1;
+			goto out;
+		}
+		len = get_fd(&io, bufo, 0, len);
+		if (len < 0) {
+			rc = -1;
+			goto out;
+		}
+	}
+	data = map ? map : bufo;
+	gettimeofday(&t0, NULL);
+	e = 0;
+	if (!wr && verify) {
+		// only verify, below
+	} else if (diff) {
+		e = nv_update(ft, data, addr, len, &df);
+	} else if (wr && data) {
+		e = nv_write(ft, data, addr, len);
+	} else if (wr) {
+		e = nv_write_stream(ft, addr, len, get_fd, &io);
+		len = e;
+	} else if (map) {
+		// straight into the mapped file
+		e = nv_read(ft, map, addr, len);
 	} else {
-		e = (argc - optind != 2);
+		e = nv_read_stream(ft, addr, len, file ? put_fd : put_dump, &io);
+	}
+	gettimeofday(&t1, NULL);
+	if (e < 0) {
+		fprintf(stderr, "Failure during transfer, error = %d\n", ft->status);
+		rc = -1;
+	} else if (diff) {
+		// skipped pages would have cost what written ones did
+		long long page = df.written ? df.write_us / df.written : NV_TWC;
+		fprintf(stderr, "Pages %d, written %d, skipped %d, "
+				"about %lld mS saved\n", df.pages, df.written,
+				df.skipped, (df.skipped * page - df.read_us) / 1000);
 	}
-	if (e) {
+	if (e >= 0 && verbose && (wr || !verify)) {
+		nv_time(wr ? "Wrote" : "Read", len, &t0, &t1);
+	}
+	if (e >= 0 && verify) {
+		gettimeofday(&t0, NULL);
+		e = nv_verify(ft, data, addr, len, &ck);
+		gettimeofday(&t1, NULL);
+		if (e < 0) {
+			fprintf(stderr, "Failure during verify, error = %d\n",
+								ft->status);
+		} else if (e > 0) {
+			fprintf(stderr, "Verify failed in %d bytes at %04x\n",
+							ck.badlen, ck.bad);
+		} else {
+			fprintf(stderr, "Verify OK, CRC %04x\n", ck.crc);
+			if (verbose) {
+				nv_time("Verified", len, &t0, &t1);
+			}
+		}
+		rc = (e != 0);
+	}
+out:
+	if (map) {
+		munmap(map, len);
+	}
+	if (io.fd > 1 && close(io.fd) < 0) {
+		perror(file);
+	}
+	free(bufo);
+	return rc;
+}
+
+// Script mode.
+struct nv_script {
+	struct spi_dev *ft;
+	struct nv_cmd *top;	// command line options, each line starts from
+	int instdin;		// the script is stdin
+};
+
+// spi_line_t, one line of the script.
+static int nv_line(void *arg, int argc, char **argv) {
+	struct nv_script *sc = arg;
+	struct nv_cmd d = *sc->top;
+	d.script = NULL;
+	d.wr = 0;
+	d.diff = 0;
+	d.verify = 0;
+	d.file = NULL;
+	if (nv_parse(&d, argc, argv) < 0 || d.script ||
+				d.port != sc->top->port || d.tune != sc->top->tune) {
+		fprintf(stderr, "Not a command (no -b, -p, -u in scripts)\n");
+		return -1;
+	}
+	if (sc->instdin && d.file && strcmp(d.file, "-") == 0 &&
+				(d.wr || d.verify)) {
+		fprintf(stderr, "The script is stdin, no -f - for data\n");
+		return -1;
+	}
+	if (d.speed != sc->top->speed && spi_set_speed(sc->ft, d.speed) < 0) {
+		return -1;
+	}
+	if (d.cs != sc->top->cs && spi_set_cs(sc->ft, d.cs) < 0) {
+		return -1;
+	}
+	sc->top->speed = d.speed; // -s and -g hold for later lines
+	sc->top->cs = d.cs;
+	return nv_run(sc->ft, &d);
+}
+
+int main(int argc, char **argv) {
+	struct nv_cmd d;
+	int speed;
+	int rc = 0;
+	struct spi_dev *ft;
+
+	memset(&d, 0, sizeof(d));
+	d.cs = 'C';
+	d.tune = SPI_TUNE_AUTO;
+	if (nv_parse(&d, argc, argv) < 0) {
 		fprintf(stderr, "Usage: %s [options] <addr> <len>\n", argv[0]);
 		fprintf(stderr, "       %s [options] -w <addr> <byte>[...]\n", argv[0]);
+		fprintf(stderr, "       %s [options] -V -f file <addr>\n", argv[0]);
+		fprintf(stderr, "       %s [options] -b script|-\n", argv[0]);
 		fprintf(stderr, "Options:\n"
 				"    -p port  Use port instead of 0\n"
-				"    -f file  Use file for data (no <byte>[...])\n"
+				"    -f file  Use file for data (no <byte>[...]),\n"
+				"             - for stdin/stdout\n"
+				"    -b file  Run each line of file (- for stdin) as\n"
+				"             a command, with one open device\n"
 				"    -s hz   Use hz clock speed (def 1.2M)\n"
+				"    -u tune USB tuning: lat, bulk, auto (def auto)\n"
 				"    -g cs   Use gpio for chip-select (0..3, def C)\n"
+				"    -d      Write only pages that differ (with -w)\n"
+				"    -V      Verify against the data (after -w)\n"
+				"    -v      Print settings, and time taken\n"
+				"    -S      Print transfer statistics on exit\n"
 		);
 		exit(1);
 	}
-	if (speed > 0) {
-		speed = spi_speed(speed);
+	if (d.speed > 0) {
+		speed = spi_speed(d.speed);
 	} else {
 		speed = spi_speed(0);
 	}
-	if (verbose) {
-		printf("Using speed %sHz\n", print_speed(speed));
-		printf("Using chip-select '%c'\n", cs);
-	}
-	x = optind;
-	addr = strtol(argv[x++], NULL, 0);
-	// READ and WRITE commands are always 3 bytes.
-	if (wr) {
-		if (file) {
-			struct stat stb;
-			fd = open(file, O_RDONLY);
-			if (fd < 0) {
-				perror(file);
-				exit(1);
-			}
-			fstat(fd, &stb);
-			len = stb.st_size;
-			if (len > 65536) len = 65536;
-			bufo = malloc(len);
-			if (bufo == NULL) {
-				perror("malloc");
-				exit(1);
-			}
-			x = read(fd, bufo, len);
-			if (x < 0) {
-				perror(file);
-				exit(1);
-			}
-			close(fd);
-		} else {
-			len = argc - x;
-			bufo = malloc(len);
-			if (bufo == NULL) {
-				perror("malloc");
-				exit(1);
-			}
-			int y = 0;
-			while (x < argc) {
-				bufo[y++] = (unsigned char)strtol(argv[x], NULL, 0);
-				++x;
-			}
-		}
-	} else {
-		len = strtol(argv[x++], NULL, 0);
-		tot = len + 3;
-		bufo = malloc(tot);
-		bufi = malloc(tot);
-		if (bufo == NULL || bufi == NULL) {
-			fprintf(stderr, "Out of memory, 2x%d bytes\n", tot);
-			exit(1);
-		}
-		// Read data is sent as FF...
-		memset(bufo + 3, 0xff, len);
-		bufo[0] = 0x03; // READ command
-		bufo[1] = (addr >> 8) & 0xff; // big-endian address
-		bufo[2] = addr & 0xff;
-		if (file) {
-			fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-			if (fd < 0) {
-				perror(file);
-				exit(1);
-			}
-		}
+	if (d.verbose) {
+		fprintf(stderr, "Using speed %sHz\n", print_speed(speed));
+		fprintf(stderr, "Using chip-select '%c'\n", d.cs);
 	}
-	ft = spi_open(port);
+	ft = spi_open(d.port);
 	if (ft == NULL) {
 		fprintf(stderr, "Unable to open device, error = %d\n", ftStatus);
 		exit(1);
 	}
-	if (wr) {
-		e = nvwrbuf(ft, bufo, addr, len);
-	} else {
-		e = spi_xfer(ft, bufo, bufi, tot);
-		if (e >= 0) {
-			if (file) {
-				x = write(fd, bufi + 3, len);
-				if (x < 0) {
-					perror(file);
-				}
-				x = close(fd);
-				if (x < 0) {
-					perror(file);
-				}
-			} else {
-				dump_buf(bufi + 3, addr, len);
-			}
+	if (d.script) {
+		struct nv_script sc = { ft, &d, 0 };
+		FILE *fp = stdin;
+		if (strcmp(d.script, "-") != 0) {
+			fp = fopen(d.script, "r");
+		} else {
+			sc.instdin = 1;
 		}
+		if (fp == NULL) {
+			perror(d.script);
+			rc = 1;
+		} else {
+			rc = (spi_script(ft, fp, argv[0], nv_line, &sc) != 0);
+		}
+		if (fp != NULL && fp != stdin) {
+			fclose(fp);
+		}
+	} else {
+		rc = (nv_run(ft, &d) != 0);
 	}
-	if (e < 0) {
-		fprintf(stderr, "Failure during transfer, error = %d\n", ftStatus);
+	fflush(stdout);
+	if (d.stats) {
+		spi_stats_dump(ft, stderr);
 	}
 	spi_close(ft);
-	return 0;
+	return rc;
 }
@@ -0,0 +1,179 @@
+/*
+ * ftsim model of a Microchip 25LC512 SEEPROM, see 25LC512.md.
+ *
+ * 64K bytes in 128-byte pages, blank (0xff) at start. Writes latch
+ * a page and take TWC (5mS) after /CS rises, during which only RDSR
+ * is answered. Status bits WEL, BP1:0 and WIP are modeled.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ftsim.h"
+
+#define NV_SIZE		65536
+#define NV_PAGE		128
+#define NV_TWC		5000000LL	// write cycle time, nS
+
+#define SR_WIP		0x01
+#define SR_WEL		0x02
+#define SR_BP		0x0c
+#define SR_WPEN		0x80
+
+struct nv {
+	unsigned char mem[NV_SIZE];
+	unsigned char page[NV_PAGE];	// write latch
+	unsigned char dirty[NV_PAGE];
+	unsigned char sr;
+	long long busy;		// write cycle ends
+	int n;			// byte of this frame
+	unsigned char cmd;
+	int addr;
+	int dpd;		// deep power-down
+};
+
+static void *nv_init(void) {
+	struct nv *nv = malloc(sizeof(*nv));
+	if (nv == NULL) {
+		return NULL;
+	}
+	memset(nv, 0, sizeof(*nv));
+	memset(nv->mem, 0xff, sizeof(nv->mem));
+	return nv;
+}
+
+static int nv_protected(struct nv *nv, int addr) {
+	static const int start[4] = { NV_SIZE, 0xc000, 0x8000, 0x0000 };
+	return addr >= start[(nv->sr & SR_BP) >> 2];
+}
+
+static void nv_select(void *dev, long long t) {
+	struct nv *nv = dev;
+	nv->n = 0;
+	nv->cmd = 0;
+	nv->addr = 0;
+	memset(nv->dirty, 0, sizeof(nv->dirty));
+}
+
+static unsigned char nv_clock(void *dev, unsigned char mosi, long long t) {
+	struct nv *nv = dev;
+	int busy = (t < nv->busy);
+	int n = nv->n++;
+	if (n == 0) {
+		nv->cmd = mosi;
+		if (busy && mosi != 0x05) {
+			nv->cmd = 0; // ignored during write cycle
+		}
+		if (nv->dpd && mosi != 0xab) {
+			nv->cmd = 0;
+		}
+		return 0xff;
+	}
+	switch (nv->cmd) {
+	case 0x05: // RDSR, repeats while /CS is low
+		return nv->sr | (busy ? SR_WIP : 0);
+	case 0x03: // READ
+		if (n <= 2) {
+			nv->addr = (nv->addr << 8) | mosi;
+			return 0xff;
+		}
+		return nv->mem[nv->addr++ & (NV_SIZE - 1)];
+	case 0x02: // WRITE, wraps within page
+		if (n <= 2) {
+			nv->addr = (nv->addr << 8) | mosi;
+			return 0xff;
+		}
+		nv->page[nv->addr % NV_PAGE] = mosi;
+		nv->dirty[nv->addr % NV_PAGE] = 1;
+		nv->addr = (nv->addr & ~(NV_PAGE - 1)) |
+				((nv->addr + 1) & (NV_PAGE - 1));
+		return 0xff;
+	case 0x01: // WRSR
+		if (n == 1) {
+			nv->addr = mosi;
+		}
+		return 0xff;
+	case 0x42: // PE
+	case 0xd8: // SE
+		if (n <= 2) {
+			nv->addr = (nv->addr << 8) | mosi;
+		}
+		return 0xff;
+	case 0xab: // RDID, releases deep power-down
+		nv->dpd = 0;
+		return n >= 3 ? 0x29 : 0xff;
+	default:
+		return 0xff;
+	}
+}
+
+static void nv_fill(struct nv *nv, int addr, int len, long long t) {
+	int x;
+	for (x = addr; x < addr + len; ++x) {
+		if (!nv_protected(nv, x)) {
+			nv->mem[x] = 0xff;
+		}
+	}
+	nv->busy = t + NV_TWC;
+}
+
+static void nv_deselect(void *dev, long long t) {
+	struct nv *nv = dev;
+	int wel = nv->sr & SR_WEL;
+	int base;
+	int x;
+
+	if (nv->cmd == 0) {
+		return;
+	}
+	switch (nv->cmd) {
+	case 0x06: // WREN
+		nv->sr |= SR_WEL;
+		return;
+	case 0x04: // WRDI
+		nv->sr &= ~SR_WEL;
+		return;
+	case 0xb9: // DPD
+		nv->dpd = 1;
+		return;
+	case 0x02: // WRITE
+		if (!wel || nv->n < 4) break;
+		base = nv->addr & ~(NV_PAGE - 1);
+		if (nv_protected(nv, base)) break;
+		for (x = 0; x < NV_PAGE; ++x) {
+			if (nv->dirty[x]) {
+				nv->mem[base + x] = nv->page[x];
+			}
+		}
+		nv->busy = t + NV_TWC;
+		break;
+	case 0x01: // WRSR
+		if (!wel || nv->n < 2) break;
+		nv->sr = (nv->sr & ~(SR_BP | SR_WPEN)) |
+				(nv->addr & (SR_BP | SR_WPEN));
+		nv->busy = t + NV_TWC;
+		break;
+	case 0x42: // PE
+		if (!wel || nv->n < 3) break;
+		nv_fill(nv, nv->addr & 0xff80, NV_PAGE, t);
+		break;
+	case 0xd8: // SE
+		if (!wel || nv->n < 3) break;
+		nv_fill(nv, nv->addr & 0xc000, NV_SIZE / 4, t);
+		break;
+	case 0xc7: // CE
+		if (!wel || (nv->sr & SR_BP)) break;
+		nv_fill(nv, 0, NV_SIZE, t);
+		break;
+	default:
+		return;
+	}
+	// WEL resets after any write-type command
+	nv->sr &= ~SR_WEL;
+}
+
+struct ftsim_model ftsim_25lc512 = {
+	"25lc512",
+	nv_init,
+	nv_select,
+	nv_clock,
+	nv_deselect,
+};
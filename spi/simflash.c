@@ -0,0 +1,271 @@
+/*
+ * ftsim models of 25-series SPI NOR flash, see FLASH.md.
+ *
+ *     w25q64   8M, 3-byte addresses
+ *     w25q256  32M, also 4-byte address opcodes (0x13 0x0c 0x12 0x21
+ *              0x5c 0xdc), and EN4B/EX4B (0xb7/0xe9)
+ *
+ * JEDEC ID (0x9f), SFDP (0x5a) with a basic parameter table, READ,
+ * FAST_READ, 256-byte page program (wraps within the page, only clears
+ * bits), erase of 4K, 32K and 64K blocks and of the chip, RDSR, WREN
+ * and WRDI. Programs and erases take the typical datasheet times, and
+ * only RDSR is answered meanwhile. Blank (0xff) at start.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ftsim.h"
+
+#define FL_PAGE		256
+
+#define FL_TPP		700000LL	// page program, nS
+#define FL_TSE		45000000LL	// 4K erase
+#define FL_TBE32	120000000LL	// 32K erase
+#define FL_TBE64	150000000LL	// 64K erase
+#define FL_TCE		(20000000000LL / (8 << 20))	// chip, per byte
+
+#define SR_WIP		0x01
+#define SR_WEL		0x02
+
+struct fl {
+	unsigned char *mem;	// inverted, so calloc() is blank
+	int size;
+	unsigned char id[3];
+	unsigned char sfdp[0x100];
+	unsigned char page[FL_PAGE];	// program latch
+	unsigned char dirty[FL_PAGE];
+	unsigned char sr;
+	long long busy;		// program or erase ends
+	int a4;			// 4-byte address mode (EN4B)
+	int n;			// byte of this frame
+	unsigned char cmd;
+	int alen;		// address bytes for cmd
+	int addr;
+};
+
+static void fl_dword(unsigned char *p, unsigned int v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+// SFDP header, one parameter header, and JESD216B basic flash
+// parameter table (16 DWORDs) at 0x80.
+static void fl_sfdp(struct fl *fl) {
+	unsigned char *t = fl->sfdp + 0x80;
+	int big = fl->size > (16 << 20);
+	memset(fl->sfdp, 0xff, sizeof(fl->sfdp));
+	memcpy(fl->sfdp, "SFDP", 4);
+	fl->sfdp[4] = 6;	// rev 1.6
+	fl->sfdp[5] = 1;
+	fl->sfdp[6] = 0;	// one parameter header
+	fl->sfdp[7] = 0xff;
+	fl->sfdp[8] = 0x00;	// BFPT, ID 0xff00
+	fl->sfdp[9] = 6;
+	fl->sfdp[10] = 1;
+	fl->sfdp[11] = 16;	// DWORDs
+	fl->sfdp[12] = 0x80;	// at 0x000080
+	fl->sfdp[13] = 0x00;
+	fl->sfdp[14] = 0x00;
+	fl->sfdp[15] = 0xff;
+	// 1: 4K erase 0x20, address bytes 3 (or 3 and 4)
+	fl_dword(t + 0, 0xff8020e5 | (big ? 1 << 17 : 0));
+	// 2: density, bits - 1
+	fl_dword(t + 4, fl->size * 8U - 1);
+	memset(t + 8, 0, 20);	// 3..7: no multi-I/O reads
+	// 8, 9: erase types 4K 0x20, 32K 0x52, 64K 0xd8
+	fl_dword(t + 28, 0x520f200c);
+	fl_dword(t + 32, 0x0000d810);
+	// 10: typical erase 48, 128, 160 mS (16mS units), max x8
+	fl_dword(t + 36, (1 << 23) | (9 << 18) | (1 << 16) | (7 << 11) |
+				(1 << 9) | (2 << 4) | 3);
+	// 11: 256-byte page, typical program 704uS (64uS units), max x4,
+	// chip erase 20S per 8M (4S units)
+	fl_dword(t + 40, (2 << 29) | (((fl->size >> 23) * 5 - 1) << 24) |
+				(1 << 13) | (10 << 8) | (8 << 4) | 1);
+	memset(t + 44, 0xff, 20);	// 12..16: no suspend, etc.
+}
+
+static void *fl_init(int size, unsigned char type, unsigned char cap) {
+	struct fl *fl = malloc(sizeof(*fl));
+	if (fl == NULL) {
+		return NULL;
+	}
+	memset(fl, 0, sizeof(*fl));
+	fl->mem = calloc(size, 1);	// untouched pages cost nothing
+	if (fl->mem == NULL) {
+		free(fl);
+		return NULL;
+	}
+	fl->size = size;
+	fl->id[0] = 0xef;	// Winbond
+	fl->id[1] = type;
+	fl->id[2] = cap;
+	fl_sfdp(fl);
+	return fl;
+}
+
+static void *fl_init64(void) {
+	return fl_init(8 << 20, 0x40, 0x17);
+}
+
+static void *fl_init256(void) {
+	return fl_init(32 << 20, 0x40, 0x19);
+}
+
+static void fl_select(void *dev, long long t) {
+	struct fl *fl = dev;
+	fl->n = 0;
+	fl->cmd = 0;
+	fl->alen = 0;
+	fl->addr = 0;
+	memset(fl->dirty, 0, sizeof(fl->dirty));
+}
+
+// Address bytes that follow 'cmd', or -1 if not supported.
+static int fl_alen(struct fl *fl, unsigned char cmd) {
+	switch (cmd) {
+	case 0x5a: // SFDP, always 3
+		return 3;
+	case 0x03: case 0x0b: case 0x02:
+	case 0x20: case 0x52: case 0xd8:
+		return fl->a4 ? 4 : 3;
+	case 0x13: case 0x0c: case 0x12:
+	case 0x21: case 0x5c: case 0xdc:
+		return fl->size > (16 << 20) ? 4 : -1;
+	default:
+		return 0;
+	}
+}
+
+static unsigned char fl_clock(void *dev, unsigned char mosi, long long t) {
+	struct fl *fl = dev;
+	int busy = (t < fl->busy);
+	int n = fl->n++;
+	if (n == 0) {
+		fl->cmd = mosi;
+		if (busy && mosi != 0x05) {
+			fl->cmd = 0; // ignored while busy
+		}
+		fl->alen = fl_alen(fl, fl->cmd);
+		if (fl->alen < 0) {
+			fl->cmd = 0;
+			fl->alen = 0;
+		}
+		return 0xff;
+	}
+	if (n <= fl->alen) {
+		fl->addr = (fl->addr << 8) | mosi;
+		return 0xff;
+	}
+	n -= fl->alen;	// data bytes, from 1
+	switch (fl->cmd) {
+	case 0x05: // RDSR, repeats while /CS is low
+		return fl->sr | (busy ? SR_WIP : 0);
+	case 0x9f: // JEDEC ID
+		return n <= 3 ? fl->id[n - 1] : 0xff;
+	case 0x5a: // SFDP, one dummy byte
+		if (n == 1) return 0xff;
+		return fl->sfdp[fl->addr++ & (sizeof(fl->sfdp) - 1)];
+	case 0x0b: // FAST_READ, one dummy byte
+	case 0x0c:
+		if (n == 1) return 0xff;
+		// fall through
+	case 0x03: // READ
+	case 0x13:
+		return ~fl->mem[fl->addr++ & (fl->size - 1)];
+	case 0x02: // PP, wraps within page
+	case 0x12:
+		fl->page[fl->addr % FL_PAGE] = mosi;
+		fl->dirty[fl->addr % FL_PAGE] = 1;
+		fl->addr = (fl->addr & ~(FL_PAGE - 1)) |
+				((fl->addr + 1) & (FL_PAGE - 1));
+		return 0xff;
+	default:
+		return 0xff;
+	}
+}
+
+static void fl_erase(struct fl *fl, int size, long long tb, long long t) {
+	int base = fl->addr & (fl->size - 1) & ~(size - 1);
+	memset(fl->mem + base, 0, size);
+	fl->busy = t + tb;
+}
+
+static void fl_deselect(void *dev, long long t) {
+	struct fl *fl = dev;
+	int wel = fl->sr & SR_WEL;
+	int base;
+	int x;
+
+	if (fl->cmd == 0) {
+		return;
+	}
+	switch (fl->cmd) {
+	case 0x06: // WREN
+		fl->sr |= SR_WEL;
+		return;
+	case 0x04: // WRDI
+		fl->sr &= ~SR_WEL;
+		return;
+	case 0xb7: // EN4B
+		fl->a4 = (fl->size > (16 << 20));
+		return;
+	case 0xe9: // EX4B
+		fl->a4 = 0;
+		return;
+	case 0x02: // PP
+	case 0x12:
+		if (!wel || fl->n <= fl->alen + 1) break;
+		base = fl->addr & (fl->size - 1) & ~(FL_PAGE - 1);
+		for (x = 0; x < FL_PAGE; ++x) {
+			if (fl->dirty[x]) {
+				// programming only clears bits
+				fl->mem[base + x] |= ~fl->page[x];
+			}
+		}
+		fl->busy = t + FL_TPP;
+		break;
+	case 0x20: // SE, 4K
+	case 0x21:
+		if (!wel || fl->n != fl->alen + 1) break;
+		fl_erase(fl, 4096, FL_TSE, t);
+		break;
+	case 0x52: // BE, 32K
+	case 0x5c:
+		if (!wel || fl->n != fl->alen + 1) break;
+		fl_erase(fl, 32768, FL_TBE32, t);
+		break;
+	case 0xd8: // BE, 64K
+	case 0xdc:
+		if (!wel || fl->n != fl->alen + 1) break;
+		fl_erase(fl, 65536, FL_TBE64, t);
+		break;
+	case 0xc7: // CE
+	case 0x60:
+		if (!wel || fl->n != 1) break;
+		fl->addr = 0;
+		fl_erase(fl, fl->size, FL_TCE * fl->size, t);
+		break;
+	default:
+		return;
+	}
+	// WEL resets after any write-type command
+	fl->sr &= ~SR_WEL;
+}
+
+struct ftsim_model ftsim_w25q64 = {
+	"w25q64",
+	fl_init64,
+	fl_select,
+	fl_clock,
+	fl_deselect,
+};
+
+struct ftsim_model ftsim_w25q256 = {
+	"w25q256",
+	fl_init256,
+	fl_select,
+	fl_clock,
+	fl_deselect,
+};
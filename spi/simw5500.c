@@ -0,0 +1,295 @@
+/*
+ * ftsim model of a WizNet W5500, see W5500.md.
+ *
+ * Frames are <off_hi> <off_lo> <bsb:5 rw:1 om:2> <data>...
+ * Common and socket registers read back their reset values, VERSIONR
+ * is 0x04. Socket buffers wrap at their Sn_RXBUF_SIZE/Sn_TXBUF_SIZE.
+ * Sn_CR commands update Sn_SR, and there is no network: SEND puts the
+ * data into the socket's own RX buffer, so every socket echoes (UDP with
+ * the usual 8-byte header, from Sn_DIPR and Sn_DPORT).
+ * /INT is low while any enabled (SIMR, Sn_IMR) socket interrupt is set.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ftsim.h"
+
+#define W_SOCKS		8
+#define W_BUFMAX	(16 * 1024)
+
+// Socket registers
+#define Sn_MR		0x00
+#define Sn_CR		0x01
+#define Sn_IR		0x02
+#define Sn_SR		0x03
+#define Sn_RXBUF_SIZE	0x1e
+#define Sn_TXBUF_SIZE	0x1f
+#define Sn_TX_FSR	0x20
+#define Sn_TX_RD	0x22
+#define Sn_TX_WR	0x24
+#define Sn_RX_RSR	0x26
+#define Sn_RX_RD	0x28
+#define Sn_RX_WR	0x2a
+
+struct wsock {
+	unsigned char reg[0x30];
+	unsigned short tx_rd;
+	unsigned short tx_wr;
+	unsigned short rx_rd;
+	unsigned short rx_wr;
+	unsigned char tx[W_BUFMAX];
+	unsigned char rx[W_BUFMAX];
+};
+
+struct wiz {
+	unsigned char common[0x40];
+	struct wsock sock[W_SOCKS];
+	int n;			// byte of this frame
+	int addr;
+	unsigned char ctl;
+};
+
+static void w_reset(struct wiz *w) {
+	int s;
+	memset(w, 0, sizeof(*w));
+	w->common[0x19] = 0x07;	// RTR = 2000
+	w->common[0x1a] = 0xd0;
+	w->common[0x1b] = 0x08;	// RCR
+	w->common[0x2e] = 0xbf;	// PHYCFGR, link up
+	w->common[0x39] = 0x04;	// VERSIONR
+	for (s = 0; s < W_SOCKS; ++s) {
+		unsigned char *r = w->sock[s].reg;
+		memset(r + 0x06, 0xff, 6);	// Sn_DHAR
+		r[0x16] = 0x80;		// Sn_TTL
+		r[Sn_RXBUF_SIZE] = 2;
+		r[Sn_TXBUF_SIZE] = 2;
+		r[0x2c] = 0xff;		// Sn_IMR
+		r[0x2d] = 0x40;		// Sn_FRAG
+	}
+}
+
+static void *w_init(void) {
+	struct wiz *w = malloc(sizeof(*w));
+	if (w == NULL) {
+		return NULL;
+	}
+	w_reset(w);
+	return w;
+}
+
+static int w_size(struct wsock *sk, int reg) {
+	int kb = sk->reg[reg];
+	return (kb > 16 ? 16 : kb) * 1024;
+}
+
+static int w_txfree(struct wsock *sk) {
+	return w_size(sk, Sn_TXBUF_SIZE) - (unsigned short)(sk->tx_wr - sk->tx_rd);
+}
+
+// UDP SEND: one datagram, into RX behind the 8-byte header the W5500
+// puts on each (peer IP, port, length), here Sn_DIPR and Sn_DPORT.
+// Dropped if it doesn't fit.
+static void w_udp_echo(struct wsock *sk) {
+	int rxsize = w_size(sk, Sn_RXBUF_SIZE);
+	int txsize = w_size(sk, Sn_TXBUF_SIZE);
+	int len = (unsigned short)(sk->tx_wr - sk->tx_rd);
+	unsigned char hdr[8];
+	int x;
+
+	sk->reg[Sn_IR] |= 0x10;	// SEND_OK
+	if (rxsize == 0 || txsize == 0 ||
+			rxsize - (unsigned short)(sk->rx_wr - sk->rx_rd) < len + 8) {
+		sk->tx_rd = sk->tx_wr;
+		return;
+	}
+	memcpy(hdr, sk->reg + 0x0c, 6);	// Sn_DIPR, Sn_DPORT
+	hdr[6] = len >> 8;
+	hdr[7] = len & 0xff;
+	for (x = 0; x < 8; ++x) {
+		sk->rx[sk->rx_wr++ % rxsize] = hdr[x];
+	}
+	while (sk->tx_rd != sk->tx_wr) {
+		sk->rx[sk->rx_wr++ % rxsize] = sk->tx[sk->tx_rd++ % txsize];
+	}
+	sk->reg[Sn_IR] |= 0x04;	// RECV
+}
+
+static void w_command(struct wsock *sk, unsigned char cmd) {
+	int rxsize = w_size(sk, Sn_RXBUF_SIZE);
+	int txsize = w_size(sk, Sn_TXBUF_SIZE);
+	switch (cmd) {
+	case 0x01: // OPEN
+		switch (sk->reg[Sn_MR] & 0x0f) {
+		case 1: sk->reg[Sn_SR] = 0x13; break;	// SOCK_INIT
+		case 2: sk->reg[Sn_SR] = 0x22; break;	// SOCK_UDP
+		case 4: sk->reg[Sn_SR] = 0x42; break;	// SOCK_MACRAW
+		default: return;
+		}
+		sk->tx_rd = sk->tx_wr = sk->rx_rd = sk->rx_wr = 0;
+		break;
+	case 0x02: // LISTEN
+		if (sk->reg[Sn_SR] == 0x13) sk->reg[Sn_SR] = 0x14;
+		break;
+	case 0x04: // CONNECT, peer answers at once
+		if (sk->reg[Sn_SR] == 0x13) {
+			sk->reg[Sn_SR] = 0x17;	// SOCK_ESTABLISHED
+			sk->reg[Sn_IR] |= 0x01;	// CON
+		}
+		break;
+	case 0x08: // DISCON
+	case 0x10: // CLOSE
+		sk->reg[Sn_SR] = 0x00;
+		if (cmd == 0x08) sk->reg[Sn_IR] |= 0x02;
+		break;
+	case 0x20: // SEND, echoed into RX
+		if ((sk->reg[Sn_MR] & 0x0f) == 2) {
+			w_udp_echo(sk);
+			break;
+		}
+		while (sk->tx_rd != sk->tx_wr && rxsize > 0 && txsize > 0 &&
+				(unsigned short)(sk->rx_wr - sk->rx_rd) < rxsize) {
+			sk->rx[sk->rx_wr++ % rxsize] = sk->tx[sk->tx_rd++ % txsize];
+			sk->reg[Sn_IR] |= 0x04;	// RECV
+		}
+		sk->tx_rd = sk->tx_wr;
+		sk->reg[Sn_IR] |= 0x10;	// SEND_OK
+		break;
+	case 0x40: // RECV, Sn_RX_RD already moved
+		break;
+	}
+}
+
+static unsigned char w_reg_rd(struct wsock *sk, int off) {
+	unsigned short v;
+	switch (off & ~1) {
+	case Sn_TX_FSR: v = w_txfree(sk); break;
+	case Sn_TX_RD: v = sk->tx_rd; break;
+	case Sn_TX_WR: v = sk->tx_wr; break;
+	case Sn_RX_RSR: v = sk->rx_wr - sk->rx_rd; break;
+	case Sn_RX_RD: v = sk->rx_rd; break;
+	case Sn_RX_WR: v = sk->rx_wr; break;
+	default:
+		return off < sizeof(sk->reg) ? sk->reg[off] : 0;
+	}
+	return (off & 1) ? (v & 0xff) : (v >> 8);
+}
+
+static void w_reg_wr(struct wsock *sk, int off, unsigned char v) {
+	switch (off) {
+	case Sn_CR:
+		w_command(sk, v);
+		return;	// reads back 0 once done
+	case Sn_IR:
+		sk->reg[Sn_IR] &= ~v;	// write 1 to clear
+		return;
+	case Sn_SR:
+	case Sn_TX_FSR: case Sn_TX_FSR + 1:
+	case Sn_TX_RD: case Sn_TX_RD + 1:
+	case Sn_RX_RSR: case Sn_RX_RSR + 1:
+	case Sn_RX_WR: case Sn_RX_WR + 1:
+		return;	// read-only
+	case Sn_TX_WR: sk->tx_wr = (v << 8) | (sk->tx_wr & 0xff); return;
+	case Sn_TX_WR + 1: sk->tx_wr = (sk->tx_wr & 0xff00) | v; return;
+	case Sn_RX_RD: sk->rx_rd = (v << 8) | (sk->rx_rd & 0xff); return;
+	case Sn_RX_RD + 1: sk->rx_rd = (sk->rx_rd & 0xff00) | v; return;
+	}
+	if (off < sizeof(sk->reg)) {
+		sk->reg[off] = v;
+	}
+}
+
+static void w_select(void *dev, long long t) {
+	struct wiz *w = dev;
+	w->n = 0;
+	w->addr = 0;
+}
+
+// One data byte at w->addr, of block w->ctl >> 3.
+static unsigned char w_data(struct wiz *w, unsigned char mosi) {
+	int bsb = w->ctl >> 3;
+	int wr = w->ctl & 0x04;
+	int off = w->addr & 0xffff;
+	struct wsock *sk = &w->sock[(bsb >> 2) & 7];
+	unsigned char *buf = NULL;
+	int size = 0;
+	unsigned char v = 0;
+
+	switch (bsb & 3) {
+	case 0:
+		if (bsb != 0) {
+			return 0; // reserved block
+		}
+		if (off < sizeof(w->common)) {
+			v = w->common[off];
+			if (wr && off != 0x39 && off != 0x2e) {
+				w->common[off] = mosi;
+			}
+			if (wr && off == 0x00 && (mosi & 0x80)) {
+				w_reset(w); // MR.RST
+			}
+		}
+		return v;
+	case 1:
+		if (wr) {
+			w_reg_wr(sk, off, mosi);
+			return 0;
+		}
+		return w_reg_rd(sk, off);
+	case 2:
+		buf = sk->tx;
+		size = w_size(sk, Sn_TXBUF_SIZE);
+		break;
+	case 3:
+		buf = sk->rx;
+		size = w_size(sk, Sn_RXBUF_SIZE);
+		break;
+	}
+	if (size == 0) {
+		return 0;
+	}
+	if (wr) {
+		buf[off % size] = mosi;
+		return 0;
+	}
+	return buf[off % size];
+}
+
+static unsigned char w_clock(void *dev, unsigned char mosi, long long t) {
+	struct wiz *w = dev;
+	unsigned char v;
+	switch (w->n++) {
+	case 0:
+	case 1:
+		w->addr = (w->addr << 8) | mosi;
+		return 0x00;
+	case 2:
+		w->ctl = mosi;
+		return 0x00;
+	}
+	v = w_data(w, mosi);
+	++w->addr;
+	return v;
+}
+
+static void w_deselect(void *dev, long long t) {
+}
+
+static int w_pin(void *dev, long long t) {
+	struct wiz *w = dev;
+	int s;
+	for (s = 0; s < W_SOCKS; ++s) {
+		if ((w->common[0x18] & (1 << s)) &&
+				(w->sock[s].reg[Sn_IR] & w->sock[s].reg[0x2c])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+struct ftsim_model ftsim_w5500 = {
+	"w5500",
+	w_init,
+	w_select,
+	w_clock,
+	w_deselect,
+	w_pin,
+};
@@ -0,0 +1,225 @@
+/*
+ * Host-side CPU cost of spilib, run against ftsim (no cable needed).
+ *
+ * Usage: spibench [-t ms]
+ *
+ * Prints one CSV line per benchmark: time, allocations, and FT_Xxxx()
+ * calls (each a system call with the real driver) per operation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "crc16.h"
+#include "ftsim.h"
+
+
+// Allocation counting, link with -Wl,--wrap=malloc etc.
+static unsigned long allocs = 0;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size) {
+	++allocs;
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	++allocs;
+	return __real_calloc(nmemb, size);
+}
+void *__wrap_realloc(void *ptr, size_t size) {
+	++allocs;
+	return __real_realloc(ptr, size);
+}
+
+static struct spi_dev *dev;
+static unsigned char bufo[65536];
+static unsigned char bufi[65536];
+static int msecs = 200;
+
+static long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int b_xfer(int len) {
+	return spi_xfer(dev, bufo, bufi, len);
+}
+
+static int b_xfer_long(int len) {
+	return spi_xfer_long(dev, bufo, bufi, len);
+}
+
+static int b_xfer_cmd(int len) {
+	return spi_xfer_cmd(dev, bufo, 1, bufi, len);
+}
+
+static int b_xfer_out(int len) {
+	return spi_xfer_out(dev, bufo, len);
+}
+
+static int b_xferv(int len) {
+	struct spi_seg seg[] = {
+		{ bufo, NULL, 3 },
+		{ bufo + 3, NULL, len },
+	};
+	return spi_xferv(dev, seg, 2);
+}
+
+static int b_cmd_build(int len) {
+	unsigned char buf[3 + 3 + 64 + 3 + 1];
+	struct spi_cmd cmd;
+	spi_cmd_init(&cmd, dev, buf, sizeof(buf));
+	(void)spi_cmd_cs(&cmd, 1);
+	(void)spi_cmd_clk(&cmd, bufo, len);
+	(void)spi_cmd_cs(&cmd, 0);
+	return spi_cmd_flush(&cmd);
+}
+
+static int b_dump_buf(int len) {
+	dump_buf(bufi, 0, len);
+	return 0;
+}
+
+static int b_crc16(int len) {
+	return crc16(bufi, len);
+}
+
+static int b_crc16_ref(int len) {
+	return crc16_ref(CRC16_INIT, bufi, len);
+}
+
+// The table-driven CRC must match the bit at a time one exactly, for
+// any length and alignment, and in pieces.
+static void crc_check(void) {
+	unsigned short a, b;
+	int off, len, x;
+	for (x = 0; x < sizeof(bufo); ++x) {
+		bufo[x] = random();
+	}
+	for (off = 0; off < 8; ++off) {
+		for (len = 0; len < 300; ++len) {
+			a = crc16_update(CRC16_INIT, bufo + off, len);
+			b = crc16_ref(CRC16_INIT, bufo + off, len);
+			if (a != b) {
+				fprintf(stderr, "crc16 mismatch, off %d len %d\n",
+								off, len);
+				exit(1);
+			}
+		}
+	}
+	a = CRC16_INIT;
+	for (x = 0; x < sizeof(bufo); x += len) {
+		len = 1 + random() % 1000;
+		if (len > sizeof(bufo) - x) len = sizeof(bufo) - x;
+		a = crc16_update(a, bufo + x, len);
+	}
+	if (a != crc16(bufo, sizeof(bufo)) || crc16(bufo, 0) != 0) {
+		fprintf(stderr, "crc16 mismatch, in pieces\n");
+		exit(1);
+	}
+}
+
+struct bench {
+	char *name;
+	int (*fn)(int len);
+	int len;
+	int quiet;	// stdout to /dev/null while running
+};
+
+static struct bench benches[] = {
+	{ "spi_xfer", b_xfer, 4 },
+	{ "spi_xfer", b_xfer, 64 },
+	{ "spi_xfer_cmd", b_xfer_cmd, 1 },
+	{ "spi_xfer_cmd", b_xfer_cmd, 4096 },
+	{ "spi_xfer_out", b_xfer_out, 128 },
+	{ "spi_xferv", b_xferv, 128 },
+	{ "spi_xfer_long", b_xfer_long, 4096 },
+	{ "spi_xfer_long", b_xfer_long, 65536 },
+	{ "cmd_build", b_cmd_build, 64 },
+	{ "dump_buf", b_dump_buf, 256, 1 },
+	{ "crc16", b_crc16, 64 },
+	{ "crc16", b_crc16, 4096 },
+	{ "crc16", b_crc16, 65536 },
+	{ "crc16_ref", b_crc16_ref, 65536 },
+	{ NULL }
+};
+
+static void run(struct bench *b) {
+	long long t0, t1;
+	long iters = 0;
+	long batch = 1;
+	unsigned long a0, c0;
+	int out = -1;
+	int null = -1;
+	int x;
+
+	if (b->quiet) {
+		fflush(stdout);
+		out = dup(1);
+		null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+	}
+	a0 = allocs;
+	c0 = ftsim_calls;
+	t0 = now_ns();
+	do {
+		for (x = 0; x < batch; ++x) {
+			if (b->fn(b->len) < 0) {
+				fprintf(stderr, "%s failed\n", b->name);
+				exit(1);
+			}
+		}
+		iters += batch;
+		if (batch < 1000000) batch *= 2;
+		t1 = now_ns();
+	} while (t1 - t0 < msecs * 1000000LL);
+	if (b->quiet) {
+		fflush(stdout);
+		dup2(out, 1);
+		close(out);
+		close(null);
+	}
+	printf("%s,%d,%ld,%.1f,%.3f,%.3f\n", b->name, b->len, iters,
+		(double)(t1 - t0) / iters,
+		(double)(allocs - a0) / iters,
+		(double)(ftsim_calls - c0) / iters);
+}
+
+int main(int argc, char **argv) {
+	struct bench *b;
+	int c;
+
+	extern char *optarg;
+
+	while ((c = getopt(argc, argv, "t:")) != EOF) {
+		switch(c) {
+		case 't':
+			msecs = strtol(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t ms]\n", argv[0]);
+			exit(1);
+		}
+	}
+	crc_check();
+	// Measure spilib itself: no USB timing, nothing on the bus.
+	setenv("FTSIM_USB", "0", 0);
+	setenv("FTSIM_PORT0", "", 0);
+	dev = spi_open(0);
+	if (dev == NULL) {
+		fprintf(stderr, "Unable to open device, error = %d\n", ftStatus);
+		exit(1);
+	}
+	printf("bench,len,iters,ns_per_op,allocs_per_op,ftcalls_per_op\n");
+	for (b = benches; b->name != NULL; ++b) {
+		run(b);
+	}
+	spi_close(dev);
+	return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Find the fastest reliable SPI clock for a fixture.
+ *
+ * Usage: spiclk [options] loop|w5500|nvram
+ *
+ * Steps the clock up from the -s speed, checking each step:
+ *     loop   MPSSE internal loopback (0x84), random data
+ *     w5500  VERSIONR, and socket 0 TX buffer against a reference
+ *     nvram  25LC512 contents against a reference
+ * References are read at the -s speed, which must be reliable.
+ * Nothing is written to the device.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "nvlib.h"
+
+#define MP_LOOP		0x84	// loopback on
+#define MP_NOLOOP	0x85	// loopback off
+
+#define MAX_STEPS	256
+
+enum { M_LOOP, M_W5500, M_NVRAM };
+
+static int mode;
+static int addr = 0;
+static int len = 0;
+static unsigned char *ref;
+static unsigned char *buf;
+
+// Read the device's test data into 'b'.
+// Returns 0, 1 if the device did not identify, or -1 on transfer failure.
+static int readback(struct spi_dev *ft, unsigned char *b) {
+	unsigned char hdr[3];
+	unsigned char ver;
+
+	switch (mode) {
+	case M_W5500:
+		hdr[0] = 0x00;
+		hdr[1] = 0x39;
+		hdr[2] = 0x00; // common, READ
+		if (spi_xfer_cmd(ft, hdr, sizeof(hdr), &ver, 1) < 0) {
+			return -1;
+		}
+		if (ver != 0x04) {
+			return 1;
+		}
+		hdr[0] = (addr >> 8) & 0xff;
+		hdr[1] = addr & 0xff;
+		hdr[2] = (2 << 3); // socket 0 TX buffer, READ
+		return spi_xfer_cmd(ft, hdr, sizeof(hdr), b, len) < 0 ? -1 : 0;
+	case M_NVRAM:
+		return nv_read(ft, b, addr, len) < 0 ? -1 : 0;
+	}
+	return -1;
+}
+
+// Loopback, with /CS off so the device sees nothing.
+static int loopback(struct spi_dev *ft, unsigned char *out, unsigned char *in) {
+	unsigned char cbuf[3 + 4096 + 1];
+	struct spi_cmd cmd;
+	spi_cmd_init(&cmd, ft, cbuf, sizeof(cbuf));
+	if (spi_cmd_clk(&cmd, out, len) < 0 || spi_cmd_flush(&cmd) < 0 ||
+			spi_cmd_send(&cmd) < 0) {
+		return -1;
+	}
+	return spi_read(ft, in, len) == len ? 0 : -1;
+}
+
+// Returns count of bad bytes over 'trials', or -1 on transfer failure.
+static int check(struct spi_dev *ft, int trials) {
+	int bad = 0;
+	int x, y;
+	int e;
+	for (x = 0; x < trials; ++x) {
+		if (mode == M_LOOP) {
+			for (y = 0; y < len; ++y) {
+				ref[y] = random();
+			}
+			e = loopback(ft, ref, buf);
+		} else {
+			e = readback(ft, buf);
+		}
+		if (e < 0) {
+			return -1;
+		}
+		if (e > 0) {
+			bad += len; // wrong device id, count all as bad
+			continue;
+		}
+		for (y = 0; y < len; ++y) {
+			bad += (buf[y] != ref[y]);
+		}
+	}
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	static int speeds[MAX_STEPS];
+	unsigned char cmd[1];
+	char *out = NULL;
+	int port = 0;
+	int speed = 0;
+	int margin = 20;
+	int trials = 4;
+	int cs = 'C';
+	int nsteps = 0;
+	int best = -1;
+	int rec = -1;
+	int hz;
+	int bad;
+	int x;
+	int c;
+	struct spi_dev *ft;
+
+	extern char *optarg;
+	extern int optind;
+
+	while ((c = getopt(argc, argv, "a:g:l:m:n:o:p:s:")) != EOF) {
+		switch(c) {
+		case 'a':
+			addr = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			cs = set_cs(optarg[0]);
+			if (cs < 0) {
+				fprintf(stderr, "Invalid GPIO /CS\n");
+				exit(1);
+			}
+			break;
+		case 'l':
+			len = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			margin = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			trials = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'p':
+			port = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			speed = parse_speed(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unknown option '%c'\n", c);
+			exit(1);
+		}
+	}
+	mode = -1;
+	if (argc - optind == 1) {
+		if (strcmp(argv[optind], "loop") == 0) mode = M_LOOP;
+		if (strcmp(argv[optind], "w5500") == 0) mode = M_W5500;
+		if (strcmp(argv[optind], "nvram") == 0) mode = M_NVRAM;
+	}
+	if (mode < 0 || margin < 0 || margin >= 100 || trials < 1) {
+		fprintf(stderr, "Usage: %s [options] loop|w5500|nvram\n", argv[0]);
+		fprintf(stderr, "Options:\n"
+				"    -p port  Use port instead of 0\n"
+				"    -s hz   Start at hz clock speed (def 1.2M)\n"
+				"    -g cs   Use gpio for chip-select (0..3, def C)\n"
+				"    -a addr  Address of test data (def 0)\n"
+				"    -l len  Length of test data\n"
+				"            (def loop 256, w5500 2048, nvram 4096)\n"
+				"    -n num  Checks per speed (def 4)\n"
+				"    -m pct  Margin below fastest reliable (def 20)\n"
+				"    -o file  Save recommended speed, for -s @file\n"
+		);
+		exit(1);
+	}
+	if (len <= 0) {
+		len = (mode == M_LOOP ? 256 : mode == M_W5500 ? 2048 : 4096);
+	}
+	if ((mode == M_LOOP && len > 4096) ||
+			(mode == M_NVRAM && addr + len > NV_SIZE)) {
+		fprintf(stderr, "Invalid address/length\n");
+		exit(1);
+	}
+	ref = malloc(len);
+	buf = malloc(len);
+	if (ref == NULL || buf == NULL) {
+		fprintf(stderr, "Out of memory, %d bytes\n", len);
+		exit(1);
+	}
+	speed = spi_speed(speed > 0 ? speed : 0);
+	ft = spi_open(port);
+	if (ft == NULL) {
+		fprintf(stderr, "Unable to open device, error = %d\n", ftStatus);
+		exit(1);
+	}
+	if (mode == M_LOOP) {
+		cmd[0] = MP_LOOP;
+		if (spi_write(ft, cmd, 1) != 1) {
+			goto xfer_err;
+		}
+	} else {
+		// Reference, read twice at a speed known to work.
+		int e1 = readback(ft, ref);
+		int e2 = readback(ft, buf);
+		if (e1 < 0 || e2 < 0) {
+			goto xfer_err;
+		}
+		if (e1 || e2 || memcmp(ref, buf, len) != 0) {
+			fprintf(stderr, "Unreliable at %sHz, use a lower -s\n",
+							print_speed(speed));
+			exit(1);
+		}
+	}
+	printf("speed       bad bytes\n");
+	for (hz = speed; nsteps < MAX_STEPS; ) {
+		bad = check(ft, trials);
+		if (bad < 0) {
+			goto xfer_err;
+		}
+		char sp[20];
+		snprintf(sp, sizeof(sp), "%sHz", print_speed(hz));
+		printf("%-11s %d%s\n", sp, bad, bad ? "  FAIL" : "");
+		if (bad) {
+			break;
+		}
+		speeds[nsteps++] = hz;
+		best = hz;
+		// next step at least 5% faster, until divisor reaches 0
+		x = spi_set_speed(ft, hz + hz / 20 + 1);
+		if (x < 0) {
+			goto xfer_err;
+		}
+		if (x <= hz) {
+			break;
+		}
+		hz = x;
+	}
+	if (mode == M_LOOP) {
+		cmd[0] = MP_NOLOOP;
+		(void)spi_write(ft, cmd, 1);
+	}
+	spi_close(ft);
+	if (best < 0) {
+		fprintf(stderr, "Fails at starting speed %sHz\n", print_speed(speed));
+		exit(2);
+	}
+	for (x = 0; x < nsteps; ++x) {
+		if (speeds[x] <= (long long)best * (100 - margin) / 100) {
+			rec = speeds[x];
+		}
+	}
+	if (rec < 0) {
+		rec = speeds[0];
+	}
+	printf("Fastest reliable %sHz\n", print_speed(best));
+	printf("Recommended (%d%% margin) %sHz\n", margin, print_speed(rec));
+	if (out != NULL) {
+		FILE *fp = fopen(out, "w");
+		if (fp == NULL) {
+			perror(out);
+			exit(1);
+		}
+		fprintf(fp, "%s\n", print_speed(rec));
+		fclose(fp);
+	}
+	return 0;
+xfer_err:
+	fprintf(stderr, "Failure during transfer, error = %d\n", ft->status);
+	spi_close(ft);
+	exit(1);
+}
@@ -2,8 +2,13 @@
  * General-purpose debug command for SPI transfers.
  *
  * Usage: spidbg [-p port][-l len] <byte>[...]
+ *        spidbg [-p port] -b script|-
  *
  * 'len' must be at least "<byte>[...]" count.
+ *
+ * With -b, each line of the script is a command as above (options
+ * and bytes), all run over one open device. Transfers are queued, so
+ * that many go out in one write, and print as they complete.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,112 +17,302 @@
 #include <unistd.h>
 #include "ftd2xx.h"
 #include "spilib.h"
+#include "crc16.h"
 
-extern unsigned short crc16(unsigned char *buf, int len);
+#define DBG_DEPTH	16	// queued transfers, in script mode
 
-int main(int argc, char **argv) {
-	int tot;
+// Options and bytes of one command.
+struct dbg {
+	int len;
+	int port;
+	int speed;
+	int cs;
+	int tune;
+	int crc;
+	int raw;
+	int verbose;
+	int stats;
+	char *script;
+	int ncmd;
+	char **cmd;
+};
+
+// One transfer, and how to print it.
+struct dbg_xfer {
+	struct spi_dev *ft;
 	int cmd;
-	int len = 0;
-	int port = 0;
-	int speed = 0;
-	int cs = 'C';
-	int crc = 0;
-	int verbose = 0;
+	int len;
+	int crc;
+	int raw;
+	int verbose;
+	int *failed;
 	unsigned char *bufo;
 	unsigned char *bufi;
-	int x;
-	int c;
-	FT_HANDLE ft;
+};
+
+// spi_chunk_t for -c, CRC of read data as it arrives.
+static int crc_chunk(void *arg, unsigned char *buf, int off, int len) {
+	unsigned short *crc = arg;
+	*crc = crc16_update(*crc, buf, len);
+	return 0;
+}
+
+static void put_crc(unsigned short sum, int raw) {
+	if (raw) {
+		putchar(sum >> 8);
+		putchar(sum & 0xff);
+	} else {
+		printf("CRC: %04x\n", sum);
+	}
+}
+
+// spi_done_t, or called after a synchronous transfer. Frees 'arg'.
+static void dbg_done(void *arg, unsigned char *bufin, int n) {
+	struct dbg_xfer *xf = arg;
+	int tot = xf->cmd + xf->len;
+	if (n < 0) {
+		fprintf(stderr, "Failure during transfer, error = %d\n",
+							xf->ft->status);
+		*xf->failed = 1;
+	} else if (xf->verbose) {
+		printf("Write:\n");
+		dump_buf(xf->bufo, 0, tot);
+		printf("Read (%06x %d):\n", xf->ft->driverVersion, xf->ft->status);
+		dump_buf(xf->bufi, 0, tot);
+	} else if (xf->len > 0) {
+		if (xf->crc) {
+			put_crc(crc16(xf->bufi + xf->cmd, xf->len), xf->raw);
+		} else if (xf->raw) {
+			fwrite(xf->bufi + xf->cmd, 1, xf->len, stdout);
+		} else {
+			dump_buf(xf->bufi + xf->cmd, 0, xf->len);
+		}
+	}
+	free(xf);
+}
 
+// Returns 0, or -1 if the options or bytes don't parse.
+static int dbg_parse(struct dbg *d, int argc, char **argv) {
 	extern char *optarg;
 	extern int optind;
+	int c;
 
-	while ((c = getopt(argc, argv, "cg:l:p:s:v")) != EOF) {
+	while ((c = getopt(argc, argv, "b:cg:l:p:rs:u:vS")) != EOF) {
 		switch(c) {
+		case 'b':
+			d->script = optarg;
+			break;
 		case 'c':
-			crc = 1;
+			d->crc = 1;
 			break;
 		case 'g':
-			cs = set_cs(optarg[0]);
-			if (cs < 0) {
+			d->cs = set_cs(optarg[0]);
+			if (d->cs < 0) {
 				fprintf(stderr, "Invalid GPIO /CS\n");
-				exit(1);
+				return -1;
 			}
 			break;
 		case 'l':
-			len = strtol(optarg, NULL, 0);
+			d->len = strtol(optarg, NULL, 0);
 			break;
 		case 'p':
-			port = strtol(optarg, NULL, 0);
+			d->port = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			d->raw = 1;
 			break;
 		case 's':
-			speed = parse_speed(optarg);
+			d->speed = parse_speed(optarg);
+			break;
+		case 'S':
+			d->stats = 1;
+			break;
+		case 'u':
+			d->tune = parse_tune(optarg);
+			if (spi_tune(d->tune) < 0) {
+				fprintf(stderr, "Invalid USB tuning '%s'\n", optarg);
+				return -1;
+			}
 			break;
 		case 'v':
-			verbose = 1;
+			d->verbose = 1;
 			break;
 		default:
 			fprintf(stderr, "Unknown option '%c'\n", c);
-			exit(1);
+			return -1;
+		}
+	}
+	d->ncmd = argc - optind;
+	d->cmd = argv + optind;
+	if (d->script) {
+		return d->ncmd == 0 ? 0 : -1;
+	}
+	return (d->ncmd < 1 || d->len < 0) ? -1 : 0;
+}
+
+// Transfer, queued if 'q', and print what was read.
+// Returns 0, or -1 on error.
+static int dbg_run(struct spi_dev *ft, struct spi_queue *q, struct dbg *d,
+			int *failed) {
+	int tot = d->ncmd + d->len;
+	struct dbg_xfer *xf = malloc(sizeof(*xf) + 2 * tot);
+	int x;
+
+	if (xf == NULL) {
+		fprintf(stderr, "Out of memory, 2x%d bytes\n", tot);
+		return -1;
+	}
+	xf->ft = ft;
+	xf->cmd = d->ncmd;
+	xf->len = d->len;
+	xf->crc = d->crc;
+	xf->raw = d->raw;
+	xf->verbose = d->verbose;
+	xf->failed = failed;
+	xf->bufo = (unsigned char *)(xf + 1);
+	xf->bufi = xf->bufo + tot;
+	for (x = 0; x < d->ncmd; ++x) {
+		xf->bufo[x] = (unsigned char)strtol(d->cmd[x], NULL, 0);
+	}
+	if (d->len > 0) {
+		// Read data is sent as FF...
+		memset(xf->bufo + d->ncmd, 0xff, d->len);
+	}
+	if (d->crc && !d->verbose && d->len > 0) {
+		// any length, CRC computed while the rest is still coming
+		unsigned short sum = CRC16_INIT;
+		if (q != NULL) {
+			(void)spi_queue_drain(q); // what was queued goes first
 		}
+		x = spi_xfer_stream(ft, xf->bufo, d->ncmd, d->len, crc_chunk, &sum);
+		if (x < 0) {
+			fprintf(stderr, "Failure during transfer, error = %d\n",
+								ft->status);
+		} else {
+			put_crc(sum, d->raw);
+		}
+		free(xf);
+		return x < 0 ? -1 : 0;
+	}
+	if (q != NULL && tot <= SPI_QMAX) {
+		x = spi_submit(q, xf->bufo, xf->bufi, tot, dbg_done, xf);
+		return x < 0 ? -1 : 0;
+	}
+	if (q != NULL) {
+		(void)spi_queue_drain(q);
+	}
+	x = spi_xfer_long(ft, xf->bufo, xf->bufi, tot);
+	dbg_done(xf, xf->bufi, x);
+	return x < 0 ? -1 : 0;
+}
+
+// Script mode.
+struct dbg_script {
+	struct spi_dev *ft;
+	struct spi_queue *q;
+	struct dbg *top;	// command line options, each line starts from
+	int failed;		// a queued transfer
+};
+
+// spi_line_t, one line of the script.
+static int dbg_line(void *arg, int argc, char **argv) {
+	struct dbg_script *sc = arg;
+	struct dbg d = *sc->top;
+	d.script = NULL;
+	d.len = 0;
+	d.crc = 0;
+	d.raw = 0;
+	if (dbg_parse(&d, argc, argv) < 0 || d.script || d.ncmd < 1 ||
+				d.port != sc->top->port || d.tune != sc->top->tune) {
+		fprintf(stderr, "Not a command (no -b, -p, -u in scripts)\n");
+		return -1;
+	}
+	if ((d.speed != sc->top->speed || d.cs != sc->top->cs) &&
+				spi_queue_drain(sc->q) < 0) {
+		return -1;
+	}
+	if (d.speed != sc->top->speed && spi_set_speed(sc->ft, d.speed) < 0) {
+		return -1;
+	}
+	if (d.cs != sc->top->cs && spi_set_cs(sc->ft, d.cs) < 0) {
+		return -1;
+	}
+	sc->top->speed = d.speed; // -s and -g hold for later lines
+	sc->top->cs = d.cs;
+	if (sc->failed) {
+		return -1;
 	}
-	if (argc - optind < 1) {
+	return dbg_run(sc->ft, sc->q, &d, &sc->failed);
+}
+
+int main(int argc, char **argv) {
+	struct dbg d;
+	int speed;
+	int failed = 0;
+	int rc = 0;
+	struct spi_dev *ft;
+
+	memset(&d, 0, sizeof(d));
+	d.cs = 'C';
+	d.tune = SPI_TUNE_AUTO;
+	if (dbg_parse(&d, argc, argv) < 0) {
 		fprintf(stderr, "Usage: %s [options] <byte>[...]\n", argv[0]);
+		fprintf(stderr, "       %s [options] -b script|-\n", argv[0]);
 		fprintf(stderr, "Options:\n"
 				"    -l len  Read len additional bytes\n"
-				"    -c      Print only CRC16 of read data (req -l)\n"
+				"    -c      Print only CRC16 of read data (req -l),\n"
+				"            which may then be any length\n"
+				"    -r      Write read data (or CRC) as binary\n"
 				"    -v      Print full write and read buffers (ovr -c)\n"
+				"    -b file Run each line of file (- for stdin) as\n"
+				"            a command, with one open device\n"
 				"    -p port Use port instead of 0\n"
 				"    -s hz   Use hz clock speed (def 1.2M)\n"
+				"    -u tune USB tuning: lat, bulk, auto (def auto)\n"
 				"    -g cs   Use gpio for chip-select (0..3, def C)\n"
+				"    -S      Print transfer statistics on exit\n"
 		);
 		exit(1);
 	}
-	if (speed > 0) {
-		speed = spi_speed(speed);
+	if (d.speed > 0) {
+		speed = spi_speed(d.speed);
 	} else {
 		speed = spi_speed(0);
 	}
-	if (verbose) {
+	if (d.verbose) {
 		printf("Using speed %sHz\n", print_speed(speed));
-		printf("Using chip-select '%c'\n", cs);
-	}
-	cmd = argc - optind;
-	tot = cmd + len;
-	bufo = malloc(tot);
-	bufi = malloc(tot);
-	if (bufo == NULL || bufi == NULL) {
-		fprintf(stderr, "Out of memory, 2x%d bytes\n", tot);
-		exit(1);
-	}
-	for (x = 0; x < cmd; ++x) {
-		bufo[x] = (unsigned char)strtol(argv[optind + x], NULL, 0);
+		printf("Using chip-select '%c'\n", d.cs);
 	}
-	if (len > 0) {
-		// Read data is sent as FF...
-		memset(bufo + cmd, 0xff, len);
-	}
-	ft = spi_open(port);
+	ft = spi_open(d.port);
 	if (ft == NULL) {
 		fprintf(stderr, "Unable to open device, error = %d\n", ftStatus);
 		exit(1);
 	}
-	x = spi_xfer(ft, bufo, bufi, tot);
-	if (x < 0) {
-		fprintf(stderr, "Failure during transfer, error = %d\n", ftStatus);
-	} else if (verbose) {
-		printf("Write:\n");
-		dump_buf(bufo, 0, tot);
-		printf("Read (%06x %d):\n", driverVersion, ftStatus);
-		dump_buf(bufi, 0, tot);
-	} else if (len > 0) {
-		if (crc) {
-			printf("CRC: %04x\n", crc16(bufi + cmd, len));
+	if (d.script) {
+		struct dbg_script sc = { ft, NULL, &d, 0 };
+		FILE *fp = stdin;
+		if (strcmp(d.script, "-") != 0) {
+			fp = fopen(d.script, "r");
+		}
+		sc.q = spi_queue_new(ft, DBG_DEPTH);
+		if (fp == NULL || sc.q == NULL) {
+			perror(d.script);
+			rc = 1;
 		} else {
-			dump_buf(bufi + cmd, 0, len);
+			rc = (spi_script(ft, fp, argv[0], dbg_line, &sc) != 0 ||
+								sc.failed);
 		}
+		spi_queue_free(sc.q);
+		if (fp != NULL && fp != stdin) {
+			fclose(fp);
+		}
+	} else {
+		rc = (dbg_run(ft, NULL, &d, &failed) != 0 || failed);
+	}
+	fflush(stdout);
+	if (d.stats) {
+		spi_stats_dump(ft, stderr);
 	}
 	spi_close(ft);
-	return 0;
+	return rc;
 }
@@ -0,0 +1,397 @@
+/*
+ * Read/write/erase for 25-series SPI NOR flash
+ *
+ * Usage: spiflash [-p port] -i
+ *        spiflash [-p port] <addr> <len>
+ *        spiflash [-p port] -f file|- <addr> <len>
+ *        spiflash [-p port] -w [-d|-n] -f file|- <addr>
+ *        spiflash [-p port] -e <addr> <len>
+ *
+ * The part is identified by JEDEC ID and SFDP (see FLASH.md), so sizes,
+ * erase types and 3- or 4-byte addresses need no options.
+ *
+ * Reads are one FAST_READ, streamed to stdout (hex dump or '-f -') or
+ * into a memory-mapped file. Writes erase the sectors covered, keeping
+ * what else was in the first and last, and program page by page,
+ * skipping blank pages. With -d, the sectors covered are read first,
+ * and only those that need it erased (see flash_plan()), -n only shows
+ * the plan. With -V, the flash is checked against the file
+ * after any write, by CRC16 of each chunk as it is read.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "flash.h"
+
+// File, pipe, or stdin/stdout being streamed.
+struct fl_io {
+	int fd;
+	int addr;
+};
+
+// Map a regular file, for reads sized to 'len', for writes
+// shortening 'len' to the file. NULL if it can't be mapped.
+static unsigned char *fl_map(struct fl_io *io, int wr, int *len) {
+	struct stat stb;
+	void *p;
+	if (fstat(io->fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+		return NULL;
+	}
+	if (wr) {
+		if (stb.st_size < *len) *len = stb.st_size;
+		if (*len == 0) return NULL;
+		p = mmap(NULL, *len, PROT_READ, MAP_SHARED, io->fd, 0);
+	} else {
+		if (ftruncate(io->fd, *len) < 0) return NULL;
+		p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, io->fd, 0);
+	}
+	return p == MAP_FAILED ? NULL : p;
+}
+
+// spi_chunk_t for reads, hex dump to stdout.
+static int put_dump(void *arg, unsigned char *buf, int off, int len) {
+	struct fl_io *io = arg;
+	dump_buf(buf, io->addr + off, len);
+	return 0;
+}
+
+// spi_chunk_t for reads, to file or pipe.
+static int put_fd(void *arg, unsigned char *buf, int off, int len) {
+	struct fl_io *io = arg;
+	while (len > 0) {
+		int n = write(io->fd, buf, len);
+		if (n < 0) {
+			perror("write");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Read a whole pipe, up to 'len'. Returns bytes read, or -1.
+static int get_fd(struct fl_io *io, unsigned char *buf, int len) {
+	int got = 0;
+	while (got < len) {
+		int n = read(io->fd, buf + got, len - got);
+		if (n < 0) {
+			perror("read");
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		got += n;
+	}
+	return got;
+}
+
+// Report a plan, and how long it took against the estimate.
+static void fl_plan_report(struct flash *fl, struct flash_plan *pl, int ran) {
+	int x;
+	fprintf(stderr, "Sectors %d, same %d, program only %d, erased %d",
+			pl->sectors, pl->same, pl->progonly, pl->erased);
+	for (x = 0; x < FL_ERASES && fl->erase[x].size; ++x) {
+		if (pl->erases[x]) {
+			fprintf(stderr, "%s %dx%dK", x ? "," : " by", pl->erases[x],
+						fl->erase[x].size >> 10);
+		}
+	}
+	fprintf(stderr, "\nPages %d, estimated %lld mS", pl->pages,
+						pl->est_us / 1000);
+	if (ran) {
+		fprintf(stderr, ", took %lld mS (erase %lld, program %lld)",
+				(pl->erase_us + pl->prog_us) / 1000,
+				pl->erase_us / 1000, pl->prog_us / 1000);
+	}
+	fprintf(stderr, ", read %lld mS\n", pl->read_us / 1000);
+}
+
+// Report time taken, and the effective clock rate.
+static void fl_time(char *what, int len, struct timeval *t0, struct timeval *t1) {
+	long long us = (t1->tv_sec - t0->tv_sec) * 1000000LL +
+			(t1->tv_usec - t0->tv_usec);
+	fprintf(stderr, "%s %d bytes in %lld mS", what, len, us / 1000);
+	if (us > 0) {
+		fprintf(stderr, ", %sHz effective",
+				print_speed((int)(len * 8000000LL / us)));
+	}
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+	int ident = 0;
+	int wr = 0;
+	int erase = 0;
+	int addr = 0;
+	int len = 0;
+	int port = 0;
+	int speed = 0;
+	int verbose = 0;
+	int stats = 0;
+	int verify = 0;
+	struct crc16_check ck;
+	int diff = 0;
+	int dry = 0;
+	struct flash_plan pl;
+	struct flash fl;
+	int rc = 0;
+	int cs = 'C';
+	char *file = NULL;
+	struct fl_io io;
+	unsigned char *map = NULL;
+	unsigned char *bufo = NULL;
+	unsigned char *data;
+	struct timeval t0, t1;
+	int x;
+	int c;
+	int e;
+	struct spi_dev *ft;
+
+	extern char *optarg;
+	extern int optind;
+
+	while ((c = getopt(argc, argv, "def:g:inp:s:u:vwSV")) != EOF) {
+		switch(c) {
+		case 'd':
+			diff = 1;
+			break;
+		case 'e':
+			erase = 1;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'g':
+			cs = set_cs(optarg[0]);
+			if (cs < 0) {
+				fprintf(stderr, "Invalid GPIO /CS\n");
+				exit(1);
+			}
+			break;
+		case 'i':
+			ident = 1;
+			break;
+		case 'n':
+			dry = 1;
+			diff = 1;
+			break;
+		case 'p':
+			port = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			speed = parse_speed(optarg);
+			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'u':
+			if (spi_tune(parse_tune(optarg)) < 0) {
+				fprintf(stderr, "Invalid USB tuning '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			wr = 1;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		default:
+			fprintf(stderr, "Unknown option '%c'\n", c);
+			exit(1);
+		}
+	}
+	e = 0; // command parse error?
+	if (ident) {
+		e = (argc - optind != 0 || wr || erase || verify);
+	} else if (wr || verify) {
+		e = (argc - optind != 1 || !file || erase);
+	} else {
+		e = (argc - optind != 2 || (erase && file));
+	}
+	if (diff && !wr) {
+		e = 1;
+	}
+	if (e) {
+		fprintf(stderr, "Usage: %s [options] -i\n", argv[0]);
+		fprintf(stderr, "       %s [options] <addr> <len>\n", argv[0]);
+		fprintf(stderr, "       %s [options] -w [-d|-n] -f file <addr>\n", argv[0]);
+		fprintf(stderr, "       %s [options] -V -f file <addr>\n", argv[0]);
+		fprintf(stderr, "       %s [options] -e <addr> <len>\n", argv[0]);
+		fprintf(stderr, "Options:\n"
+				"    -p port  Use port instead of 0\n"
+				"    -f file  Use file for data,\n"
+				"             - for stdin/stdout\n"
+				"    -s hz   Use hz clock speed (def 1.2M)\n"
+				"    -u tune USB tuning: lat, bulk, auto (def auto)\n"
+				"    -g cs   Use gpio for chip-select (0..3, def C)\n"
+				"    -i      Identify the part, and its parameters\n"
+				"    -w      Erase and write the file at <addr>\n"
+				"    -d      Read first, erase and program only what differs\n"
+				"    -n      As -d, but only show the plan\n"
+				"    -e      Erase <len> at <addr>, sector-aligned\n"
+				"    -V      Verify against the file (after -w)\n"
+				"    -v      Print settings, and time taken\n"
+				"    -S      Print transfer statistics on exit\n"
+		);
+		exit(1);
+	}
+	if (speed > 0) {
+		speed = spi_speed(speed);
+	} else {
+		speed = spi_speed(0);
+	}
+	if (verbose) {
+		fprintf(stderr, "Using speed %sHz\n", print_speed(speed));
+		fprintf(stderr, "Using chip-select '%c'\n", cs);
+	}
+	ft = spi_open(port);
+	if (ft == NULL) {
+		fprintf(stderr, "Unable to open device, error = %d\n", ftStatus);
+		exit(1);
+	}
+	e = flash_open(&fl, ft);
+	if (e < 0) {
+		if (e == -2) {
+			fprintf(stderr, "No flash found\n");
+		} else if (e == -3) {
+			fprintf(stderr, "Unknown flash, ID %02x %02x %02x\n",
+					fl.id[0], fl.id[1], fl.id[2]);
+		} else {
+			fprintf(stderr, "Failure during identify, error = %d\n",
+								ft->status);
+		}
+		spi_close(ft);
+		exit(1);
+	}
+	if (ident || verbose) {
+		flash_print(&fl, ident ? stdout : stderr);
+	}
+	if (ident) {
+		spi_close(ft);
+		return 0;
+	}
+	x = optind;
+	addr = strtol(argv[x++], NULL, 0);
+	if (addr < 0 || addr >= fl.size) {
+		fprintf(stderr, "Invalid address\n");
+		exit(1);
+	}
+	if (wr || verify) {
+		len = fl.size - addr; // or to end of file
+	} else {
+		len = strtol(argv[x++], NULL, 0);
+		if (len <= 0 || len > fl.size - addr) {
+			fprintf(stderr, "Invalid length\n");
+			exit(1);
+		}
+	}
+	io.fd = -1;
+	io.addr = addr;
+	if (file && strcmp(file, "-") == 0) {
+		io.fd = (wr || verify) ? 0 : 1;
+	} else if (file) {
+		if (wr || verify) {
+			io.fd = open(file, O_RDONLY);
+		} else {
+			io.fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		}
+		if (io.fd < 0) {
+			perror(file);
+			exit(1);
+		}
+		map = fl_map(&io, wr || verify, &len);
+	}
+	if ((wr || verify) && map == NULL) {
+		// whole image, from a pipe
+		bufo = malloc(len);
+		if (bufo == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		len = get_fd(&io, bufo, len);
+		if (len <= 0) {
+			fprintf(stderr, "No data\n");
+			exit(1);
+		}
+	}
+	data = map ? map : bufo;
+	gettimeofday(&t0, NULL);
+	e = 0;
+	if (!wr && verify) {
+		// only verify, below
+	} else if (erase) {
+		e = flash_erase(&fl, addr, len);
+		if (e < 0 && (addr | len) % fl.erase[0].size) {
+			fprintf(stderr, "Erase must be in %d-byte sectors\n",
+							fl.erase[0].size);
+		}
+	} else if (diff) {
+		e = flash_plan(&fl, data, addr, len, &pl);
+		if (e == 0 && !dry) {
+			e = flash_plan_run(&fl, &pl);
+		}
+		if (e == 0) {
+			fl_plan_report(&fl, &pl, !dry);
+		}
+		flash_plan_free(&pl);
+	} else if (wr) {
+		e = flash_write(&fl, data, addr, len);
+	} else if (map) {
+		// straight into the mapped file
+		e = flash_read(&fl, map, addr, len);
+	} else {
+		e = flash_read_stream(&fl, addr, len, file ? put_fd : put_dump, &io);
+	}
+	gettimeofday(&t1, NULL);
+	if (e < 0) {
+		fprintf(stderr, "Failure during transfer, error = %d\n", ft->status);
+		rc = 1;
+	}
+	if (e >= 0 && verbose && !dry && (wr || erase || !verify)) {
+		fl_time(wr ? "Wrote" : erase ? "Erased" : "Read", len, &t0, &t1);
+	}
+	if (e >= 0 && verify && !dry) {
+		gettimeofday(&t0, NULL);
+		e = flash_verify(&fl, data, addr, len, &ck);
+		gettimeofday(&t1, NULL);
+		if (e < 0) {
+			fprintf(stderr, "Failure during verify, error = %d\n",
+								ft->status);
+		} else if (e > 0) {
+			fprintf(stderr, "Verify failed in %d bytes at %x\n",
+							ck.badlen, ck.bad);
+		} else {
+			fprintf(stderr, "Verify OK, CRC %04x\n", ck.crc);
+			if (verbose) {
+				fl_time("Verified", len, &t0, &t1);
+			}
+		}
+		rc = (e != 0);
+	}
+	if (map) {
+		munmap(map, len);
+	}
+	if (io.fd > 1 && close(io.fd) < 0) {
+		perror(file);
+	}
+	if (stats) {
+		spi_stats_dump(ft, stderr);
+	}
+	spi_close(ft);
+	return rc;
+}
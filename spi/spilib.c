@@ -6,8 +6,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "ftd2xx.h"
+#include "spilib.h"
 
 #define IODIR	0b11111011	// CS=out, TDO=in, TDI=out, TCK=out
 #define IOINIT	0b11111000	// CS=high (off), SCLK=low
@@ -28,12 +32,18 @@
 
 // C232HM MPSSE commands
 #define	MP_CLKBYTES	0x31	// send/recv bytes, MSB 1st, -ve
+#define	MP_CLKOUT	0x11	// send bytes only, MSB 1st, -ve
+#define	MP_CLKIN	0x20	// recv bytes only, MSB 1st, +ve
+#define MP_GETIO	0x81	// read I/O pins, ADBUS (low byte)
 #define MP_FLUSH	0x87	// flush bytes to recv queue
 #define MP_SETIO	0x80	// set I/O pins, ADBUS (low byte)
 #define MP_NOLOOP	0x85	// loopback off
 #define MP_CLKDIV	0x86	// set clock divisor
 #define MP_DIV5DI	0x8a	// disable clock divide-by-5 prescale (60MHz)
 #define MP_DIV5EN	0x8b	// enable clock divide-by-5 prescale (12MHz)
+#define MP_WAITHI	0x88	// wait until GPIOL1 is high
+#define MP_WAITLO	0x89	// wait until GPIOL1 is low
+#define MP_CLKIDLE	0x8f	// clock bytes, no data (FT232H)
 
 #undef DEBUG
 
@@ -42,6 +52,7 @@
 #define CLK_DIV5	(CLK_RAW / 5)	// default divide-by-5 clock
 #define CLK_DMAX	(CLK_DIV5 / 2)	// max for using default 12MHz
 // Clock defaults: 12MHz divide by 5 = 1.2MHz
+// These are copied into each device by spi_open().
 static unsigned char div5[] = {
 	MP_DIV5EN
 };
@@ -95,8 +106,23 @@ void dump_buf(unsigned char *buf, int off, int len) {
 	}
 }
 
+// "@file" reads the speed from 'file', as saved by spiclk -o.
 int parse_speed(char *arg) {
 	char *end;
+	if (arg[0] == '@') {
+		char line[32];
+		FILE *fp = fopen(arg + 1, "r");
+		if (fp == NULL) {
+			return -1;
+		}
+		end = fgets(line, sizeof(line), fp);
+		fclose(fp);
+		if (end == NULL || line[0] == '@') {
+			return -1;
+		}
+		line[strcspn(line, " \t\r\n")] = '\0';
+		return parse_speed(line);
+	}
 	double clk = strtod(arg, &end);
 	if (toupper(*end) == 'M') {
 		// TODO: *(end+1) == 0
@@ -127,84 +153,153 @@ char *print_speed(int clk) {
 	return buf;
 }
 
-static int get_speed() {
-	int clk = CLK_DIV5;
-	if (div5[0] == MP_DIV5DI) {
-		clk = CLK_RAW;
+static char *tune_names[SPI_NTUNE] = { "lat", "bulk", "auto" };
+
+int parse_tune(char *arg) {
+	int t;
+	for (t = 0; t < SPI_NTUNE; ++t) {
+		if (strcasecmp(arg, tune_names[t]) == 0) {
+			return t;
+		}
 	}
-	int div = setclk[1];
-	div |= (setclk[2] << 8);
-	return (clk / ((1 + div) * 2));
+	return -1;
 }
 
-// Must be called before open.
-// Setup clock speed 'hz'.
-// Returns actual clock speed setup.
-int spi_speed(int hz) {
-	if (hz <= 0) {
-		return get_speed();
+char *print_tune(int tune) {
+	if (tune < 0 || tune >= SPI_NTUNE) {
+		return "?";
 	}
+	return tune_names[tune];
+}
+
+static int clk_speed(unsigned char *d5, unsigned char *clk) {
+	int raw = CLK_DIV5;
+	if (d5[0] == MP_DIV5DI) {
+		raw = CLK_RAW;
+	}
+	int div = clk[1];
+	div |= (clk[2] << 8);
+	return (raw / ((1 + div) * 2));
+}
+
+// Compute prescale and divisor for nearest speed to 'hz'.
+static void clk_setup(int hz, unsigned char *d5, unsigned char *clk) {
 	if (hz > CLK_MAX) {
 		hz = CLK_MAX;
 	}
-	int clk;
+	int raw;
 	if (hz > CLK_DMAX) {
-		div5[0] = MP_DIV5DI;
-		clk = CLK_RAW;
+		d5[0] = MP_DIV5DI;
+		raw = CLK_RAW;
 	} else {
-		div5[0] = MP_DIV5EN;
-		clk = CLK_DIV5;
+		d5[0] = MP_DIV5EN;
+		raw = CLK_DIV5;
 	}
-	int div = (clk / 2 / hz) - 1;
+	int div = (raw / 2 / hz) - 1;
 	if (div < 0) div = 0;
 	if (div > 0xffff) div = 0xffff;
-	setclk[1] = div & 0xff;
-	setclk[2] = (div >> 8) & 0xff;
-	return get_speed();
+	clk[0] = MP_CLKDIV;
+	clk[1] = div & 0xff;
+	clk[2] = (div >> 8) & 0xff;
 }
 
-static int chipsel = IO_CS;
+// Must be called before open.
+// Setup clock speed 'hz', used by subsequent spi_open().
+// Returns actual clock speed setup.
+int spi_speed(int hz) {
+	if (hz > 0) {
+		clk_setup(hz, div5, setclk);
+	}
+	return clk_speed(div5, setclk);
+}
 
-// -1 = for TMS (default), 0-3 for GPIOL0-3.
-int set_cs(char cs) {
+static int chipsel = IO_CS; // default for spi_open()
+
+static int cs_bit(char cs) {
 	switch(toupper(cs)) {
 	case '0':
-		chipsel = IO_GP0;
-		break;
+		return IO_GP0;
 	case '1':
-		chipsel = IO_GP1;
-		break;
+		return IO_GP1;
 	case '2':
-		chipsel = IO_GP2;
-		break;
+		return IO_GP2;
 	case '3':
-		chipsel = IO_GP3;
-		break;
+		return IO_GP3;
 	case 'C':
-		chipsel = IO_CS;
-		break;
+		return IO_CS;
 	default:
 		return -1;
 	}
+}
+
+// -1 = for TMS (default), 0-3 for GPIOL0-3.
+// Sets default for subsequent spi_open().
+int set_cs(char cs) {
+	int b = cs_bit(cs);
+	if (b < 0) {
+		return -1;
+	}
+	chipsel = b;
 	return cs;
 }
 
-// For now, this serves as 'errno'
-FT_STATUS ftStatus = FT_OK;
-DWORD driverVersion = 0;
+static int tune = SPI_TUNE_AUTO; // default for spi_open()
+
+// Must be called before open.
+// Choose USB tuning profile for subsequent spi_open().
+// Returns 'tune', or -1 if not valid.
+int spi_tune(int t) {
+	if (t < 0 || t >= SPI_NTUNE) {
+		return -1;
+	}
+	tune = t;
+	return t;
+}
+
+// Status of last failed spi_open(), per thread.
+// Once open, each device keeps its own 'status'.
+__thread FT_STATUS ftStatus = FT_OK;
+
+// Statistics are kept per device, see spi_stats().
+static long long spi_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Record latency of 'op' started at 't0' (from spi_now()).
+// Bucket 'b' counts latencies under 2^b microseconds.
+static void spi_hist(struct spi_dev *dev, int op, long long t0) {
+	long long us = (spi_now() - t0) / 1000;
+	int b = 0;
+	while (us > 0 && b < SPI_HBUCKETS - 1) {
+		us >>= 1;
+		++b;
+	}
+	++dev->stats.hist[op][b];
+}
+
+static void spi_purge(struct spi_dev *dev) {
+	++dev->stats.purges;
+	(void)FT_Purge(dev->ft, FT_PURGE_RX | FT_PURGE_TX);
+}
 
 // Normally, only open, close, and xfer are used, but provide access anyway...
 
 // Raw write to device, returns bytes written.
-int spi_write(FT_HANDLE ftHandle, unsigned char *buf, const int len) {
+int spi_write(struct spi_dev *dev, unsigned char *buf, const int len) {
 	// assert(len < 0x10000);
-	ftStatus = FT_OK;
+	dev->status = FT_OK;
 	DWORD bytesToWrite = (DWORD)len;
 	DWORD bytesWritten = 0;
+	long long t0 = spi_now();
 
-	ftStatus = FT_Write(ftHandle, buf, bytesToWrite, &bytesWritten);
-	if (ftStatus != FT_OK) {
-		//fprintf(stderr, "Failure.  FT_Write returned %d\n", (int)ftStatus);
+	dev->status = FT_Write(dev->ft, buf, bytesToWrite, &bytesWritten);
+	++dev->stats.writes;
+	spi_hist(dev, SPI_OP_WRITE, t0);
+	dev->stats.bytes_out += bytesWritten;
+	if (dev->status != FT_OK) {
+		//fprintf(stderr, "Failure.  FT_Write returned %d\n", (int)dev->status);
 		// TODO: set errno?
 		return -1;
 	}
@@ -212,17 +307,17 @@ int spi_write(FT_HANDLE ftHandle, unsigned char *buf, const int len) {
 	return (int)bytesWritten;
 }
 
-static void spi_flush(FT_HANDLE ftHandle) {
+static void spi_flush(struct spi_dev *dev) {
 	DWORD bytesReceived = 0;
 	DWORD bytesRead = 0;
 	unsigned char *buf;
 	unsigned char flsh[] = { MP_FLUSH };
-	int n = spi_write(ftHandle, flsh, sizeof(flsh));
+	int n = spi_write(dev, flsh, sizeof(flsh));
 	if (n < 0 || n != sizeof(flsh)) {
 		return;
 	}
-	ftStatus = FT_GetQueueStatus(ftHandle, &bytesReceived);
-	if (ftStatus != FT_OK || bytesReceived == 0) {
+	dev->status = FT_GetQueueStatus(dev->ft, &bytesReceived);
+	if (dev->status != FT_OK || bytesReceived == 0) {
 		return;
 	}
 	buf = malloc(bytesReceived);
@@ -230,8 +325,8 @@ static void spi_flush(FT_HANDLE ftHandle) {
 		perror("malloc");
 		return;
 	}
-	ftStatus = FT_Read(ftHandle, buf, bytesReceived, &bytesRead);
-	if (ftStatus == FT_OK) {
+	dev->status = FT_Read(dev->ft, buf, bytesReceived, &bytesRead);
+	if (dev->status == FT_OK) {
 		// if (bytesReceived != bytesRead) ...
 		dump_buf(buf, 0xf800, bytesRead);
 	}
@@ -239,48 +334,165 @@ static void spi_flush(FT_HANDLE ftHandle) {
 }
 
 // Set /CS on (low) or off (high).
-int spi_cs(FT_HANDLE ftHandle, int on) {
+int spi_cs(struct spi_dev *dev, int on) {
 	unsigned char setio[] = {
-		MP_SETIO, IOINIT, IODIR
+		MP_SETIO, IOINIT, 0
 	};
+	setio[2] = dev->iodir;
 	if (on) {
-		setio[1] &= ~chipsel; // clear bit = on, active low signal
+		setio[1] &= ~dev->chipsel; // clear bit = on, active low signal
 	} else {
-		setio[1] |= chipsel; // set bit = off, active low signal
+		setio[1] |= dev->chipsel; // set bit = off, active low signal
 	}
-	int n = spi_write(ftHandle, setio, sizeof(setio));
+	int n = spi_write(dev, setio, sizeof(setio));
 	if (n < 0 || n != sizeof(setio)) {
 		return -1;
 	}
 	return 0;
 }
 
-int spi_setup(FT_HANDLE ftHandle) {
+// Command stream builder. Collects a sequence of MPSSE commands
+// (and SPI data) so that a whole transaction goes out in one FT_Write().
+void spi_cmd_init(struct spi_cmd *cmd, struct spi_dev *dev,
+			unsigned char *buf, int max) {
+	cmd->dev = dev;
+	cmd->buf = buf;
+	cmd->len = 0;
+	cmd->max = max;
+}
+
+static int spi_cmd_put(struct spi_cmd *cmd, unsigned char *buf, int len) {
+	if (cmd->len + len > cmd->max) {
+		return -1;
+	}
+	memcpy(cmd->buf + cmd->len, buf, len);
+	cmd->len += len;
+	return 0;
+}
+
+// Add /CS on (low) or off (high).
+int spi_cmd_cs(struct spi_cmd *cmd, int on) {
+	unsigned char setio[] = {
+		MP_SETIO, IOINIT, 0
+	};
+	setio[2] = cmd->dev->iodir;
+	if (on) {
+		setio[1] &= ~cmd->dev->chipsel; // clear bit = on, active low signal
+	} else {
+		setio[1] |= cmd->dev->chipsel; // set bit = off, active low signal
+	}
+	return spi_cmd_put(cmd, setio, sizeof(setio));
+}
+
+static int spi_cmd_op(struct spi_cmd *cmd, unsigned char op,
+			unsigned char *buf, int len) {
+	unsigned char xfer[] = {
+		op, 0x00, 0x00  // length bytes set below.
+	};
+	if (len <= 0 || len > 0x10000) {
+		return -1;
+	}
+	xfer[1] = (unsigned char)((len - 1) & 0x00FF); // field is length-1...
+	xfer[2] = (unsigned char)(((len - 1) & 0xFF00) >> 8);
+	if (cmd->len + sizeof(xfer) + (buf ? len : 0) > cmd->max) {
+		return -1;
+	}
+	(void)spi_cmd_put(cmd, xfer, sizeof(xfer));
+	if (buf == NULL) {
+		return 0;
+	}
+	return spi_cmd_put(cmd, buf, len);
+}
+
+// Add SPI write/read of 'len' bytes from 'buf'.
+int spi_cmd_clk(struct spi_cmd *cmd, unsigned char *buf, int len) {
+	return spi_cmd_op(cmd, MP_CLKBYTES, buf, len);
+}
+
+// Add SPI write only of 'len' bytes from 'buf', nothing comes back.
+int spi_cmd_out(struct spi_cmd *cmd, unsigned char *buf, int len) {
+	return spi_cmd_op(cmd, MP_CLKOUT, buf, len);
+}
+
+// Add SPI read only of 'len' bytes (MOSI idles), no data sent down.
+int spi_cmd_in(struct spi_cmd *cmd, int len) {
+	return spi_cmd_op(cmd, MP_CLKIN, NULL, len);
+}
+
+// Add read of GPIO pins, which returns one byte. Used to know when
+// preceeding commands, that return nothing, have completed.
+int spi_cmd_getio(struct spi_cmd *cmd) {
+	unsigned char getio[] = { MP_GETIO };
+	return spi_cmd_put(cmd, getio, sizeof(getio));
+}
+
+// Add flush, so the response is sent back to host immediately.
+int spi_cmd_flush(struct spi_cmd *cmd) {
+	unsigned char flsh[] = { MP_FLUSH };
+	return spi_cmd_put(cmd, flsh, sizeof(flsh));
+}
+
+// Add 'len' bytes worth of clocks, with no data, for a delay timed
+// by the MPSSE. Any length, the longest command is 64K bytes.
+int spi_cmd_idle(struct spi_cmd *cmd, int len) {
+	while (len > 0) {
+		int k = len > 0x10000 ? 0x10000 : len;
+		if (spi_cmd_op(cmd, MP_CLKIDLE, NULL, k) < 0) {
+			return -1;
+		}
+		len -= k;
+	}
+	return 0;
+}
+
+// Add wait for GPIOL1, as set by spi_set_wait(). The MPSSE runs
+// nothing after this until the pin changes.
+int spi_cmd_wait(struct spi_cmd *cmd) {
+	unsigned char wt[1];
+	if (cmd->dev->waitop == 0) {
+		return -1;
+	}
+	wt[0] = cmd->dev->waitop;
+	return spi_cmd_put(cmd, wt, sizeof(wt));
+}
+
+// Write the collected commands to device.
+int spi_cmd_send(struct spi_cmd *cmd) {
+	int n = spi_write(cmd->dev, cmd->buf, cmd->len);
+	if (n < 0 || n != cmd->len) {
+		return -1;
+	}
+	cmd->len = 0;
+	return 0;
+}
+
+int spi_setup(struct spi_dev *dev) {
 	int n;
 	unsigned char setup[] = {
-		MP_SETIO, IOINIT, IODIR
+		MP_SETIO, IOINIT, 0
 	};
 	unsigned char loopback[] = {
 		MP_NOLOOP	// loopback off
 	};
-	ftStatus = FT_SetBitMode(ftHandle, IODIR, FT_BITMODE_MPSSE);
-	if (ftStatus != FT_OK) {
+	setup[2] = dev->iodir;
+	dev->status = FT_SetBitMode(dev->ft, dev->iodir, FT_BITMODE_MPSSE);
+	if (dev->status != FT_OK) {
 		return -1;
 	}
-	n = spi_write(ftHandle, setup, sizeof(setup));
+	n = spi_write(dev, setup, sizeof(setup));
 	if (n < 0 || n != sizeof(setup)) {
 		return -1;
 	}
-	n = spi_write(ftHandle, loopback, sizeof(loopback));
+	n = spi_write(dev, loopback, sizeof(loopback));
 	if (n < 0 || n != sizeof(loopback)) {
 		return -1;
 	}
-	n = spi_write(ftHandle, div5, sizeof(div5));
-	if (n < 0 || n != sizeof(div5)) {
+	n = spi_write(dev, dev->div5, sizeof(dev->div5));
+	if (n < 0 || n != sizeof(dev->div5)) {
 		return -1;
 	}
-	n = spi_write(ftHandle, setclk, sizeof(setclk));
-	if (n < 0 || n != sizeof(setclk)) {
+	n = spi_write(dev, dev->setclk, sizeof(dev->setclk));
+	if (n < 0 || n != sizeof(dev->setclk)) {
 		return -1;
 	}
 	return 0;
@@ -288,229 +500,1520 @@ int spi_setup(FT_HANDLE ftHandle) {
 
 // Send SPI write prefix - prepare to send data to SPI device
 // (not commands to C232HM).
-static int spi_prep(FT_HANDLE ftHandle, DWORD len) {
+static int spi_prep(struct spi_dev *dev, DWORD len) {
 	unsigned char xfer[] = {
 		MP_CLKBYTES, 0x00, 0x00  // Write + read; length bytes set below.
 	};
 	len -= 1;	// field is length-1...
 	xfer[1] = (unsigned char)(len & 0x00FF);
 	xfer[2] = (unsigned char)((len & 0xFF00) >> 8);
-	int n = spi_write(ftHandle, xfer, sizeof(xfer));
+	int n = spi_write(dev, xfer, sizeof(xfer));
 	if (n < 0 || n != sizeof(xfer)) {
 		return -1;
 	}
 	return 0;
 }
 
+// Receive event (dev->rxevent) is signalled by the driver when data
+// arrives. Waits block on this (after a short spin) instead of polling.
+#define SPI_SPIN	32	// queue checks before blocking
+#define SPI_NAP		10	// mS, longest block before re-checking queue
+
+static void spi_event(struct spi_dev *dev) {
+	dev->rxevent_ok = (FT_SetEventNotification(dev->ft, FT_EVENT_RXCHAR,
+					(PVOID)&dev->rxevent) == FT_OK);
+}
+
+static int ts_cmp(struct timespec *a, struct timespec *b) {
+	if (a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	}
+	if (a->tv_nsec != b->tv_nsec) {
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	}
+	return 0;
+}
+
 // Generally, must be preceeded by spi_write().
-static int spi_wait(FT_HANDLE ftHandle, int len) {
-	struct timeval startTime;
-	int journeyDuration;
+// Waits up to 'ms' mS for 'len' bytes.
+static int spi_wait_ms(struct spi_dev *dev, int len, int ms) {
+	struct timespec deadline;
+	struct timespec nap;
 	DWORD bytesReceived = 0;
 	int queueChecks = 0;
+	long long t0 = spi_now();
 
 	// assert(len < 0x10000);
-	journeyDuration = 1;  // One second should be enough
-	gettimeofday(&startTime, NULL);
-	queueChecks = 0;
-	for (bytesReceived = 0; bytesReceived < len; queueChecks++) {
-		if (queueChecks % 512 == 0) {
-			struct timeval now;
-			struct timeval elapsed;
-			gettimeofday(&now, NULL);
-			timersub(&now, &startTime, &elapsed);
-			if (elapsed.tv_sec > (long int)journeyDuration) {
-				break;
-			}
-			// TODO: progress indicator...
-		}
-		ftStatus = FT_GetQueueStatus(ftHandle, &bytesReceived);
-		if (ftStatus != FT_OK) {
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_nsec -= 1000000000L;
+		++deadline.tv_sec;
+	}
+	for (queueChecks = 0; ; queueChecks++) {
+		dev->status = FT_GetQueueStatus(dev->ft, &bytesReceived);
+		++dev->stats.polls;
+		if (dev->status != FT_OK) {
 			return -1;
 		}
+		if (bytesReceived >= len) {
+			break;
+		}
+		if (queueChecks < SPI_SPIN) {
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &nap);
+		if (ts_cmp(&nap, &deadline) >= 0) {
+			++dev->stats.timeouts;
+			break;
+		}
+		if (!dev->rxevent_ok) {
+			continue; // no event from driver, just spin
+		}
+		// Block until driver signals data, but not too long in case
+		// a signal was missed, and never past the deadline.
+		nap.tv_nsec += SPI_NAP * 1000000L;
+		if (nap.tv_nsec >= 1000000000L) {
+			nap.tv_nsec -= 1000000000L;
+			++nap.tv_sec;
+		}
+		if (ts_cmp(&nap, &deadline) > 0) {
+			nap = deadline;
+		}
+		pthread_mutex_lock(&dev->rxevent.eMutex);
+		// re-check, data may have arrived since the last look
+		dev->status = FT_GetQueueStatus(dev->ft, &bytesReceived);
+		if (dev->status == FT_OK && bytesReceived < len) {
+			++dev->stats.blocks;
+			(void)pthread_cond_timedwait(&dev->rxevent.eCondVar,
+						&dev->rxevent.eMutex, &nap);
+		}
+		pthread_mutex_unlock(&dev->rxevent.eMutex);
 	}
 	// This appears to be enough to fix some timing glitch...
 	// Theat caused issues with the 25LC512 nvram, but glitching
 	// more clocks after this point, in FT_Read()?
-	(void)FT_GetQueueStatus(ftHandle, &bytesReceived);
+	(void)FT_GetQueueStatus(dev->ft, &bytesReceived);
+	spi_hist(dev, SPI_OP_WAIT, t0);
 	return (int)bytesReceived;
 }
 
-static int spi_get(FT_HANDLE ftHandle, unsigned char *buf, int len) {
+static int spi_wait(struct spi_dev *dev, int len) {
+	return spi_wait_ms(dev, len, 1000); // One second should be enough
+}
+
+// Wait for 'len' bytes, after clocking 'clocked' bytes: the time they
+// take at the current clock, plus the usual second.
+static int spi_wait_clk(struct spi_dev *dev, int len, int clocked) {
+	long long hz = clk_speed(dev->div5, dev->setclk);
+	if (hz < 1) hz = 1;
+	return spi_wait_ms(dev, len, 1000 + (int)(clocked * 8000LL / hz));
+}
+
+static int spi_get(struct spi_dev *dev, unsigned char *buf, int len) {
 	DWORD bytesRead = 0;
-	ftStatus = FT_Read(ftHandle, buf, len, &bytesRead);
-	if (ftStatus != FT_OK) {
+	long long t0 = spi_now();
+	dev->status = FT_Read(dev->ft, buf, len, &bytesRead);
+	++dev->stats.reads;
+	spi_hist(dev, SPI_OP_READ, t0);
+	dev->stats.bytes_in += bytesRead;
+	if (dev->status != FT_OK) {
 		return -1;
 	}
 	return (int)bytesRead;
 }
 
-// Read as many bytes as are available, at least 'len'
-int spi_read(FT_HANDLE ftHandle, unsigned char *buf, int len) {
+// Collect 'len' bytes of response, 'n' is what spi_wait() found.
+static int spi_recv(struct spi_dev *dev, unsigned char *buf, int len, int n) {
 	int m;
-	int n = spi_wait(ftHandle, len);
 #ifdef DEBUG
-	if (n < 0) {
-		return -1;
-	}
-	(void)spi_cs(ftHandle, 0); // /CS off
 	if (n != len) {
 		printf("Sent %d, got back %d\n", len, n);
 		if (n > len) {
 			unsigned char *b = malloc(n);
 			if (b == NULL) return -1;
-			m = spi_get(ftHandle, b, n);
+			m = spi_get(dev, b, n);
 			memcpy(buf, b, len);
 			dump_buf(b, 0xf000, n);
 			free(b);
 		} else {
-			m = spi_get(ftHandle, buf, n);
+			m = spi_get(dev, buf, n);
 			dump_buf(buf, 0xf000, n);
 		}
 	} else {
-		m = spi_get(ftHandle, buf, len);
+		m = spi_get(dev, buf, len);
 	}
 #else // !DEBUG
-	(void)spi_cs(ftHandle, 0); // /CS off
 	int l = len;
 	if (n != len) {
+		++dev->stats.resyncs;
 		if (n < len) l = n;
-		m = spi_get(ftHandle, buf, l);
-		(void)FT_Purge(ftHandle, FT_PURGE_RX | FT_PURGE_TX);
+		m = spi_get(dev, buf, l);
+		spi_purge(dev);
 		fprintf(stderr, "Sent %d, got back %d\n", len, n);
 		//return -1;
 	}
-	m = spi_get(ftHandle, buf, len);
+	m = spi_get(dev, buf, len);
 #endif // !DEBUG
 	return m;
 }
 
+// Read as many bytes as are available, at least 'len'
+int spi_read(struct spi_dev *dev, unsigned char *buf, int len) {
+	int n = spi_wait(dev, len);
+#ifdef DEBUG
+	if (n < 0) {
+		return -1;
+	}
+#endif
+	(void)spi_cs(dev, 0); // /CS off
+	return spi_recv(dev, buf, len, n);
+}
+
 // Start a command sequence (/CS activated)
-int spi_begin(FT_HANDLE ftHandle, int len) {
-	int n = spi_cs(ftHandle, 1); // /CS on
+int spi_begin(struct spi_dev *dev, int len) {
+	int n = spi_cs(dev, 1); // /CS on
 	if (n < 0) {
 		return -1;
 	}
-	//spi_flush(ftHandle);
-	n = spi_prep(ftHandle, len); // setup write
+	//spi_flush(dev);
+	n = spi_prep(dev, len); // setup write
 	if (n < 0) {
 		return -1;
 	}
 	return 0;
 }
 
-int spi_end(FT_HANDLE ftHandle) {
-	int n = spi_cs(ftHandle, 0); // /CS off
+int spi_end(struct spi_dev *dev) {
+	int n = spi_cs(dev, 0); // /CS off
 	if (n < 0) {
 		return -1;
 	}
-	//spi_flush(ftHandle);
+	//spi_flush(dev);
+	return 0;
+}
+
+// Long transfers are broken into chunks of (at most) the D2XX default
+// USB IN transfer size, and several chunks are kept queued on the device
+// so that the MPSSE is never idle waiting for the host to read.
+#define SPI_CHUNK	4096
+#define SPI_INFLIGHT	2
+#define SPI_LNGBUF	(SPI_CHUNK + 64)	// chunk, plus room for commands
+
+// USB tuning. LAT has the driver hand back short responses at once,
+// BULK moves long responses in as few USB transfers as possible.
+// AUTO measures the round trip at open, and throughput when first
+// needed, then switches between the two as the average transaction
+// size changes.
+struct spi_prof {
+	UCHAR latency;		// mS
+	ULONG in;		// USB transfer sizes
+	ULONG out;
+};
+static struct spi_prof spi_profs[] = {
+	{ 1, 512, 4096 },	// SPI_TUNE_LAT
+	{ 16, 65536, 65536 },	// SPI_TUNE_BULK
+};
+
+#define SPI_RETUNE	32	// transactions between auto checks
+
+static int spi_prof(struct spi_dev *dev, int p) {
+	dev->status = FT_SetLatencyTimer(dev->ft, spi_profs[p].latency);
+	if (dev->status == FT_OK) {
+		dev->status = FT_SetUSBParameters(dev->ft, spi_profs[p].in,
+							spi_profs[p].out);
+	}
+	if (dev->status != FT_OK) {
+		return -1;
+	}
+	if (dev->tuned >= 0 && dev->tuned != p) {
+		++dev->stats.tunes;
+	}
+	dev->tuned = p;
+	return 0;
+}
+
+static int spi_chunk(struct spi_dev *dev);
+
+// Time a round trip, a few bytes each way.
+static int spi_measure_rtt(struct spi_dev *dev) {
+	unsigned char buf[8];
+	struct spi_cmd cmd;
+	long long t0, t;
+	long long rtt = 0;
+	int x;
+
+	for (x = 0; x < 4; ++x) {
+		spi_cmd_init(&cmd, dev, buf, sizeof(buf));
+		(void)spi_cmd_getio(&cmd);
+		(void)spi_cmd_flush(&cmd);
+		t0 = spi_now();
+		if (spi_cmd_send(&cmd) < 0 ||
+				spi_recv(dev, buf, 1, spi_wait(dev, 1)) != 1) {
+			return -1;
+		}
+		t = spi_now() - t0;
+		if (rtt == 0 || t < rtt) rtt = t;
+	}
+	dev->rtt = rtt;
+	return 0;
+}
+
+// Time a chunk read (clocked with /CS off), sized to the clock, to find
+// how many bytes move in one round trip. Transactions much bigger than
+// that are limited by throughput, not latency.
+static int spi_measure(struct spi_dev *dev) {
+	struct spi_cmd cmd;
+	int k = spi_chunk(dev);
+	long long t0, t;
+
+	spi_cmd_init(&cmd, dev, dev->lngbuf, SPI_LNGBUF);
+	(void)spi_cmd_in(&cmd, k);
+	(void)spi_cmd_flush(&cmd);
+	t0 = spi_now();
+	if (spi_cmd_send(&cmd) < 0 || spi_wait_clk(dev, k, k) < k ||
+				spi_get(dev, dev->lngbuf, k) != k) {
+		return -1;
+	}
+	t = spi_now() - t0 - dev->rtt;
+	if (t < 1) t = 1;
+	dev->xover = dev->rtt * k / t;
+	if (dev->xover < 512) dev->xover = 512; // one USB packet
+	if (dev->xover > 65536) dev->xover = 65536;
 	return 0;
 }
 
+// AUTO's crossover, measured the first time a transfer needs it, so
+// that opening the device costs no more than a few round trips. If
+// it can't be measured, the device stays at LAT.
+static int spi_xover(struct spi_dev *dev) {
+	if (dev->xover == 0 && spi_measure(dev) < 0) {
+		spi_purge(dev);
+		dev->tune = SPI_TUNE_LAT;
+		dev->xover = SPI_CHUNK;
+		(void)spi_prof(dev, SPI_TUNE_LAT);
+	}
+	return dev->xover;
+}
+
+// Whether AUTO, now at LAT, should go to BULK for transfers of about
+// 'len' bytes. The crossover is measured first if it wasn't yet, and if
+// that fails the device is left at LAT for good.
+static int spi_want_bulk(struct spi_dev *dev, long len) {
+	if (dev->tune != SPI_TUNE_AUTO || dev->tuned != SPI_TUNE_LAT ||
+				len <= 512) {
+		return 0;
+	}
+	return len > spi_xover(dev) && dev->tune == SPI_TUNE_AUTO;
+}
+
+// Only with AUTO, from spi_enter().
+static void spi_retune(struct spi_dev *dev) {
+	unsigned long bytes = dev->stats.bytes_in + dev->stats.bytes_out;
+	unsigned long n = dev->stats.xfers - dev->tune_xfers;
+	unsigned long avg;
+
+	if (dev->stats.xfers < dev->tune_xfers || bytes < dev->tune_bytes) {
+		n = 0; // stats were reset, start again
+	} else if (n < SPI_RETUNE) {
+		return;
+	}
+	avg = n ? (bytes - dev->tune_bytes) / n : 0;
+	dev->tune_xfers = dev->stats.xfers;
+	dev->tune_bytes = bytes;
+	if (n == 0) {
+		return;
+	}
+	// hysteresis, so a mixed workload doesn't flip every check
+	if (spi_want_bulk(dev, avg / 2)) {
+		(void)spi_prof(dev, SPI_TUNE_BULK);
+	} else if (dev->tuned == SPI_TUNE_BULK && avg < dev->xover / 2) {
+		(void)spi_prof(dev, SPI_TUNE_LAT);
+	}
+}
+
+// Chunk size, limited so that one chunk takes no more than about 100mS
+// at the current clock (spi_wait() gives up after about 1 second).
+static int spi_chunk(struct spi_dev *dev) {
+	int k = clk_speed(dev->div5, dev->setclk) / 8 / 10;
+	if (k < 64) k = 64;
+	if (k > SPI_CHUNK) k = SPI_CHUNK;
+	return k;
+}
+
+// Next segment, at or after 'x', that has data coming back.
+static int seg_in(struct spi_seg *seg, int nseg, int x) {
+	while (x < nseg && (seg[x].in == NULL || seg[x].len <= 0)) {
+		++x;
+	}
+	return x;
+}
+
+// All of the response is queued, in several segments (or with the GPIO
+// byte): read it in one go into 'buf' and scatter it, from segment 'rs'
+// offset 'ro'. 'clocked' bytes are still to go out before it is all
+// back. Returns bytes read, or -1 on error.
+static int spi_gather(struct spi_dev *dev, struct spi_seg *seg, int nseg,
+			int rs, int ro, int len, int clocked, unsigned char *buf) {
+	int n = spi_wait_clk(dev, len, clocked);
+	int k;
+	if (n < len || spi_get(dev, buf, len) != len) {
+		return -1;
+	}
+	for (n = 0; rs < nseg; rs = seg_in(seg, nseg, rs + 1), ro = 0) {
+		k = seg[rs].len - ro;
+		memcpy(seg[rs].in + ro, buf + n, k);
+		n += k;
+	}
+	return len;
+}
+
+// Pipelined scatter-gather transfer, all with /CS held on, except
+// that a segment with neither 'out' nor 'in' (SPI_SEG_CS) turns /CS off
+// and on again. Each segment is full duplex if it has both 'out' and
+// 'in', write-only if 'in' is NULL, read-only if 'out' is NULL.
+// Command streams are built straight from 'out' segments, and data read
+// goes straight into 'in' segments. Small segments share a write, large
+// ones are chunked, and up to SPI_INFLIGHT chunks of response are kept
+// queued. If the last segment is write-only, a GPIO read is added so
+// that completion is known. Once all is written, a response of several
+// segments that fits in lngbuf is read in one FT_Read and scattered.
+// Waits allow for the bytes still to be clocked ahead of what is
+// awaited, so long writes at slow clocks don't time out.
+// Returns total length, or -1 on error.
+static int spi_pipe(struct spi_dev *dev, struct spi_seg *seg, int nseg) {
+	long long t0 = spi_now();
+	struct spi_cmd cmd;
+	int chunk = spi_chunk(dev);
+	int ws = 0, wo = 0;	// write position, segment and offset
+	int rs, ro = 0;		// read position
+	int queued = 0;		// response bytes queued, not yet read
+	int ack = 0;		// GPIO byte expected at end
+	int wpos = 0;		// bytes clocked, as written
+	int rbase = 0;		// bytes before segment 'rs'
+	int done = 0;		// bytes known to be clocked
+	int cs_on = 0;		// /CS asserted
+	int tot = 0;
+	int n = 0;
+	int x;
+	for (x = 0; x < nseg; ++x) {
+		if (seg[x].len < 0 || (seg[x].out == NULL &&
+					seg[x].in == NULL && seg[x].len != 0)) {
+			return -1;
+		}
+		tot += seg[x].len;
+	}
+	// A long transfer needn't wait for the average to catch up.
+	if (spi_want_bulk(dev, tot / (SPI_INFLIGHT * 4))) {
+		(void)spi_prof(dev, SPI_TUNE_BULK);
+	}
+	while (ws < nseg && seg[ws].len == 0) {
+		++ws;
+	}
+	if (ws >= nseg) {
+		return 0;
+	}
+	rs = seg_in(seg, nseg, 0);
+	for (x = 0; x < rs; ++x) {
+		rbase += seg[x].len;
+	}
+	while (ws < nseg || rs < nseg || ack) {
+		if (ws < nseg && queued < SPI_INFLIGHT * chunk) {
+			spi_cmd_init(&cmd, dev, dev->lngbuf, SPI_LNGBUF);
+			if (!cs_on) {
+				(void)spi_cmd_cs(&cmd, 1); // /CS on
+				cs_on = 1;
+			}
+			while (ws < nseg) {
+				struct spi_seg *sg = &seg[ws];
+				int k = sg->len - wo;
+				int room = cmd.max - cmd.len - 3 - 8;
+				if (sg->out == NULL && sg->in == NULL) {
+					if (room < 6) {
+						break;
+					}
+					(void)spi_cmd_cs(&cmd, 0); // next frame
+					(void)spi_cmd_cs(&cmd, 1);
+					++ws;
+					while (ws < nseg && seg[ws].len == 0 &&
+							(seg[ws].out || seg[ws].in)) {
+						++ws;
+					}
+					continue;
+				}
+				if (k > chunk) k = chunk;
+				if (sg->out != NULL && k > room) k = room;
+				if (sg->in != NULL && queued > 0 &&
+					queued + k > SPI_INFLIGHT * chunk) {
+					k = SPI_INFLIGHT * chunk - queued;
+				}
+				if (k <= 0 || room < 0) {
+					break;
+				}
+				if (sg->in == NULL) {
+					(void)spi_cmd_out(&cmd, sg->out + wo, k);
+				} else if (sg->out == NULL) {
+					(void)spi_cmd_in(&cmd, k);
+					queued += k;
+				} else {
+					(void)spi_cmd_clk(&cmd, sg->out + wo, k);
+					queued += k;
+				}
+				wo += k;
+				wpos += k;
+				while (ws < nseg && wo >= seg[ws].len &&
+						(seg[ws].out || seg[ws].in)) {
+					++ws;
+					wo = 0;
+				}
+			}
+			if (ws >= nseg) {
+				(void)spi_cmd_cs(&cmd, 0); // /CS off
+				if (seg[nseg - 1].in == NULL || seg[nseg - 1].len == 0) {
+					(void)spi_cmd_getio(&cmd);
+					ack = 1;
+				}
+			}
+			(void)spi_cmd_flush(&cmd);
+			n = spi_cmd_send(&cmd);
+			if (n < 0) {
+				break;
+			}
+			continue;
+		}
+		if (rs < nseg && ws >= nseg && queued + ack <= SPI_LNGBUF &&
+				(ack || seg_in(seg, nseg, rs + 1) < nseg)) {
+			n = spi_gather(dev, seg, nseg, rs, ro, queued + ack,
+						wpos - done, dev->lngbuf);
+			if (n < 0) {
+				break;
+			}
+			rs = nseg;
+			queued = ack = 0;
+			continue;
+		}
+		if (rs < nseg) {
+			int k = seg[rs].len - ro;
+			if (k > chunk) k = chunk;
+			n = spi_wait_clk(dev, k, wpos - done);
+			if (n >= k) {
+				n = spi_get(dev, seg[rs].in + ro, k);
+			} else {
+				n = -1;
+			}
+			if (n < 0) {
+				break;
+			}
+			queued -= k;
+			ro += k;
+			done = rbase + ro;
+			if (ro >= seg[rs].len) {
+				x = seg_in(seg, nseg, rs + 1);
+				while (rs < x) {
+					rbase += seg[rs++].len;
+				}
+				ro = 0;
+			}
+			continue;
+		}
+		if (ack && ws >= nseg) {
+			// wait for GPIO byte, that says all was sent
+			unsigned char io;
+			n = spi_wait_clk(dev, 1, wpos - done);
+			if (n >= 1) {
+				n = spi_get(dev, &io, 1);
+			} else {
+				n = -1;
+			}
+			if (n < 0) {
+				break;
+			}
+			ack = 0;
+		}
+	}
+	if (n < 0) {
+		// leave device in a known state
+		spi_purge(dev);
+		(void)spi_end(dev);
+		return -1;
+	}
+	++dev->stats.xfers;
+	spi_hist(dev, SPI_OP_XFER, t0);
+	return tot;
+}
+
+// Per-device lock. Recursive, so callers may hold it across several
+// transfers that must not be interleaved with other threads.
+void spi_lock(struct spi_dev *dev) {
+	pthread_mutex_lock(&dev->lock);
+}
+
+void spi_unlock(struct spi_dev *dev) {
+	pthread_mutex_unlock(&dev->lock);
+}
+
+// Lock for a synchronous transfer. Any queued transfers already written
+// to the device must complete first, to keep the response stream in order.
+static void spi_enter(struct spi_dev *dev) {
+	spi_lock(dev);
+	if (dev->q != NULL && dev->q->nreq > dev->q->unsent) {
+		(void)spi_queue_drain(dev->q);
+	}
+	if (dev->tune == SPI_TUNE_AUTO) {
+		spi_retune(dev);
+	}
+}
+
 // Returns bytes read, or -1 on error.
 // handles > 64 bytes.
-int spi_xfer_long(FT_HANDLE ftHandle, unsigned char *bufout,
+int spi_xfer_long(struct spi_dev *dev, unsigned char *bufout,
 			unsigned char *bufin, const int len) {
-	int l = len;
-	int n = spi_cs(ftHandle, 1); // /CS on
-	if (n < 0) {
+	struct spi_seg seg = { bufout, bufin, len };
+	spi_enter(dev);
+	int n = spi_pipe(dev, &seg, 1);
+	spi_unlock(dev);
+	return n;
+}
+
+// Write only, any length. Nothing is echoed back.
+// Returns bytes written, or -1 on error.
+int spi_xfer_out(struct spi_dev *dev, unsigned char *bufout, const int len) {
+	struct spi_seg seg = { bufout, NULL, len };
+	spi_enter(dev);
+	int n = spi_pipe(dev, &seg, 1);
+	spi_unlock(dev);
+	return n;
+}
+
+// Read only, any length. No filler bytes are sent.
+// Returns bytes read, or -1 on error.
+int spi_xfer_in(struct spi_dev *dev, unsigned char *bufin, const int len) {
+	struct spi_seg seg = { NULL, bufin, len };
+	spi_enter(dev);
+	int n = spi_pipe(dev, &seg, 1);
+	spi_unlock(dev);
+	return n;
+}
+
+// Write command 'cmd', then read 'len' bytes, in one chip-select.
+// Returns bytes read (not including command), or -1 on error.
+int spi_xfer_cmd(struct spi_dev *dev, unsigned char *cmd, int clen,
+			unsigned char *bufin, const int len) {
+	struct spi_seg seg[] = {
+		{ cmd, NULL, clen },
+		{ NULL, bufin, len },
+	};
+	spi_enter(dev);
+	int n = spi_pipe(dev, seg, 2);
+	spi_unlock(dev);
+	return n < 0 ? -1 : len;
+}
+
+// Streams read with in-only commands, which are 3 bytes whatever the
+// length, so chunks may be larger than SPI_CHUNK.
+#define SPI_STREAM	16384	// largest stream chunk
+
+// Write command 'cmd', then read 'len' bytes, in one chip-select, handing
+// each chunk to 'fn' (offset from start) as it arrives. The following
+// chunks are already queued on the MPSSE when 'fn' is called, so its
+// work (e.g. disk writes) overlaps the bus. If 'fn' returns < 0, nothing
+// more is queued, and what was is read and dropped.
+// Returns len, or -1 on error or if 'fn' failed.
+int spi_xfer_stream(struct spi_dev *dev, unsigned char *cmd, int clen,
+			int len, spi_chunk_t fn, void *arg) {
+	long long t0 = spi_now();
+	struct spi_cmd sc;
+	unsigned char *buf;
+	int chunk = clk_speed(dev->div5, dev->setclk) / 8 / 10;
+	int wr = 0;		// bytes queued
+	int rd = 0;		// bytes read
+	int got = 0;		// of those, not yet given to 'fn'
+	int end = len;		// where /CS goes off
+	int csoff = 0;
+	int e = 0;
+	int n;
+	int k;
+
+	if (clen <= 0 || clen > SPI_CHUNK || len <= 0) {
 		return -1;
 	}
-	while (l > 0) {
-		int k = l;
-		if (k > 64) k = 64;
-		n = spi_prep(ftHandle, k); // setup write
-		if (n < 0) {
-			break;
+	if (chunk > SPI_STREAM) chunk = SPI_STREAM;
+	chunk &= ~63;
+	if (chunk < 64) chunk = 64;
+	buf = malloc(chunk);
+	if (buf == NULL) {
+		return -1;
+	}
+	spi_enter(dev);
+	if (spi_want_bulk(dev, len / (SPI_INFLIGHT * 4))) {
+		(void)spi_prof(dev, SPI_TUNE_BULK);
+	}
+	for (;;) {
+		while (!csoff && (wr >= end || wr - rd < SPI_INFLIGHT * chunk)) {
+			spi_cmd_init(&sc, dev, dev->lngbuf, SPI_LNGBUF);
+			if (wr == 0) {
+				(void)spi_cmd_cs(&sc, 1); // /CS on
+				(void)spi_cmd_out(&sc, cmd, clen);
+			}
+			if (wr < end) {
+				k = end - wr;
+				if (k > chunk) k = chunk;
+				(void)spi_cmd_in(&sc, k);
+				wr += k;
+			}
+			if (wr >= end) {
+				(void)spi_cmd_cs(&sc, 0); // /CS off
+				csoff = 1;
+			}
+			(void)spi_cmd_flush(&sc);
+			if (spi_cmd_send(&sc) < 0) {
+				e = -1;
+				goto out;
+			}
+		}
+		if (got > 0) {
+			if (e == 0 && fn(arg, buf, rd - got, got) < 0) {
+				e = -1;
+				end = wr; // stop queueing, drain the rest
+			}
+			got = 0;
 		}
-		n = spi_write(ftHandle, bufout, k);
-		if (n < 0 || n != k) {
+		if (rd >= wr && csoff) {
 			break;
 		}
-		n = spi_wait(ftHandle, k);
-		if (n == k) {
-			n = spi_get(ftHandle, bufin, k);
+		k = wr - rd;
+		if (k > chunk) k = chunk;
+		// as much as wr - rd may still be queued ahead of this chunk
+		n = spi_wait_clk(dev, k, wr - rd + (rd == 0 ? clen : 0));
+		if (n < k || spi_get(dev, buf, k) != k) {
+			e = -1;
+			goto out;
+		}
+		rd += k;
+		got = k;
+	}
+	++dev->stats.xfers;
+	spi_hist(dev, SPI_OP_XFER, t0);
+	spi_unlock(dev);
+	free(buf);
+	return e < 0 ? -1 : len;
+out:
+	// leave device in a known state
+	spi_purge(dev);
+	(void)spi_end(dev);
+	spi_unlock(dev);
+	free(buf);
+	return -1;
+}
+
+// Scatter-gather transfer of 'nseg' segments, in one chip-select.
+// Returns total length of all segments, or -1 on error.
+int spi_xferv(struct spi_dev *dev, struct spi_seg *seg, int nseg) {
+	spi_enter(dev);
+	int n = spi_pipe(dev, seg, nseg);
+	spi_unlock(dev);
+	return n;
+}
+
+// MPSSE stuck in a wait: reset it, dropping whatever was queued.
+static int spi_recover(struct spi_dev *dev) {
+	(void)FT_SetBitMode(dev->ft, 0x00, FT_BITMODE_RESET);
+	spi_purge(dev);
+	return spi_setup(dev);
+}
+
+// As spi_xferv(), but the MPSSE first waits for GPIOL1 (spi_set_wait()),
+// so the transfer runs as soon as the device signals. Up to SPI_CHUNK
+// bytes may be read. Returns total length of all segments, -1 on error,
+// or -2 if the pin did not change within 'ms' mS.
+int spi_xfer_wait(struct spi_dev *dev, struct spi_seg *seg, int nseg, int ms) {
+	struct spi_cmd cmd;
+	long long t0 = spi_now();
+	int nin = 0;
+	int tot = 0;
+	int e = 0;
+	int n;
+	int x;
+
+	spi_enter(dev);
+	spi_cmd_init(&cmd, dev, dev->lngbuf, SPI_LNGBUF);
+	if (spi_cmd_wait(&cmd) < 0 || spi_cmd_cs(&cmd, 1) < 0) {
+		e = -1;
+		goto out;
+	}
+	for (x = 0; x < nseg && e == 0; ++x) {
+		if (seg[x].out == NULL && seg[x].in == NULL) {
+			e = spi_cmd_cs(&cmd, 0); // next frame
+			if (e == 0) e = spi_cmd_cs(&cmd, 1);
+			continue;
+		}
+		if (seg[x].len <= 0) {
+			continue;
+		}
+		if (seg[x].out && seg[x].in) {
+			e = spi_cmd_clk(&cmd, seg[x].out, seg[x].len);
+		} else if (seg[x].out) {
+			e = spi_cmd_out(&cmd, seg[x].out, seg[x].len);
 		} else {
-			n = -1; // TODO: more grace
+			e = spi_cmd_in(&cmd, seg[x].len);
 		}
-		if (n < 0) { // || n != k) {
-			break;
+		if (seg[x].in) nin += seg[x].len;
+		tot += seg[x].len;
+	}
+	if (e == 0) e = spi_cmd_cs(&cmd, 0);
+	if (e == 0 && nin == 0) {
+		e = spi_cmd_getio(&cmd); // something to wait for
+		nin = 1;
+	}
+	if (e == 0) e = spi_cmd_flush(&cmd);
+	if (e < 0 || nin > SPI_CHUNK) {
+		e = -1;
+		goto out;
+	}
+	if (spi_cmd_send(&cmd) < 0) {
+		spi_purge(dev);
+		e = -1;
+		goto out;
+	}
+	n = spi_wait_ms(dev, nin, ms > 0 ? ms : 1000);
+	if (n < nin) {
+		e = (n < 0 || spi_recover(dev) < 0) ? -1 : -2;
+		goto out;
+	}
+	// response lands in lngbuf, the command is already sent
+	if (spi_recv(dev, dev->lngbuf, nin, n) != nin) {
+		e = -1;
+		goto out;
+	}
+	for (x = 0, n = 0; x < nseg; ++x) {
+		if (seg[x].in && seg[x].len > 0) {
+			memcpy(seg[x].in, dev->lngbuf + n, seg[x].len);
+			n += seg[x].len;
+		}
+	}
+	++dev->stats.xfers;
+	spi_hist(dev, SPI_OP_XFER, t0);
+out:
+	spi_unlock(dev);
+	return e < 0 ? e : tot;
+}
+
+// Status polling. A burst is up to SPI_POLLN frames of /CS on, 'cmd'
+// out, one byte in, /CS off, each followed by idle clocks to space them,
+// all in one write, and the status bytes come back in one read.
+// The MPSSE runs a whole burst, so frames after the one that finds the
+// device ready are wasted, and bursts are kept short once it is known
+// where to look.
+#define SPI_POLLN	16	// most frames per burst
+#define SPI_POLLFEW	4	// frames per burst, when timing is known
+#define SPI_POLLGAP	(8 * 0x10000)	// most idle bytes between frames
+
+// Bytes clocked in 'ns' at 'hz'.
+static long long spi_ns_bytes(long long ns, int hz) {
+	return ns * hz / 8000000000LL;
+}
+
+// Slot for the timing of polls for 'us'.
+static int spi_poll_slot(struct spi_dev *dev, int us) {
+	int x;
+	for (x = 0; x < SPI_POLLT; ++x) {
+		if (dev->poll[x].us == us) {
+			return x;
 		}
-		l -= k;
-		bufout += k;
-		bufin += k;
 	}
-	int m = spi_end(ftHandle);
-	if (m < 0 || n < 0) {
+	return -1;
+}
+
+// Poll with 'cmd' until (status & mask) == val, for a device that takes
+// up to 'us' uS (datasheet) to be ready. The first time, one burst idles
+// through half of 'us', then samples the rest. The time the device
+// actually took is kept, for a few values of 'us' at once (e.g. program
+// and erase alternating), and later polls for the same 'us' send a few
+// frames close around it. Times a little over 'us' are kept too, short
+// writes often run past their typical time once USB latency is counted.
+// If it is not ready by then, bursts follow with the spacing doubling
+// each time, up to 'us' / SPI_POLLN.
+// Returns the status byte, -1 on error, or -2 if not ready in 'ms' mS.
+int spi_poll(struct spi_dev *dev, unsigned char *cmd, int clen,
+			int mask, int val, int us, int ms) {
+	unsigned char st[SPI_POLLN];
+	struct spi_cmd sc;
+	long long t0 = spi_now();
+	int hz = clk_speed(dev->div5, dev->setclk);
+	long long fns = (clen + 1) * 8000000000LL / hz; // one frame
+	long long most = us * 1000LL / SPI_POLLN;
+	long long lead, step, at;
+	long long gap;
+	long long ts;
+	int nf;
+	int e = 0;
+	int n;
+	int x;
+	int p;
+
+	if (clen <= 0 || us <= 0) {
 		return -1;
 	}
-	return len - l;
+	spi_enter(dev);
+	p = spi_poll_slot(dev, us);
+	if (p >= 0 && dev->poll[p].took > 0 && dev->poll[p].took <= 2 * us) {
+		nf = SPI_POLLFEW;
+		step = dev->poll[p].took * 1000LL / 64;
+		lead = dev->poll[p].took * 1000LL - 2 * step;
+	} else {
+		nf = SPI_POLLN;
+		step = us * 1000LL / 2 / (SPI_POLLN - 1);
+		lead = us * 1000LL / 2;
+	}
+	for (;;) {
+		if (step < fns) step = fns;
+		gap = spi_ns_bytes(step - fns, hz);
+		if (gap > SPI_POLLGAP) {
+			gap = SPI_POLLGAP;
+			step = fns + gap * 8000000000LL / hz;
+		}
+		spi_cmd_init(&sc, dev, dev->lngbuf, SPI_LNGBUF);
+		e = spi_cmd_idle(&sc, spi_ns_bytes(lead - fns, hz));
+		for (x = 0; x < nf && e == 0; ++x) {
+			if (x > 0) e = spi_cmd_idle(&sc, gap);
+			if (e == 0) e = spi_cmd_cs(&sc, 1);
+			if (e == 0) e = spi_cmd_out(&sc, cmd, clen);
+			if (e == 0) e = spi_cmd_in(&sc, 1);
+			if (e == 0) e = spi_cmd_cs(&sc, 0);
+		}
+		if (e == 0) e = spi_cmd_flush(&sc);
+		if (e < 0) {
+			break;
+		}
+		ts = spi_now();
+		if (spi_cmd_send(&sc) < 0) {
+			spi_purge(dev);
+			e = -1;
+			break;
+		}
+		n = spi_wait_ms(dev, nf, (lead + nf * step) / 1000000 + 1000);
+		if (n < nf) {
+			(void)spi_recover(dev);
+			e = -1;
+			break;
+		}
+		if (spi_recv(dev, st, nf, n) != nf) {
+			e = -1;
+			break;
+		}
+		++dev->stats.xfers;
+		for (x = 0; x < nf; ++x) {
+			if ((st[x] & mask) == val) {
+				break;
+			}
+		}
+		if (x < nf) {
+			// Ready by this frame. At x == 0 it may have been well
+			// before, and next time looks a step earlier.
+			at = (ts - t0) + lead + (x > 0 ? x * step : -step);
+			if (p < 0) {
+				p = dev->poll_next;
+				dev->poll_next = (p + 1) % SPI_POLLT;
+				dev->poll[p].us = us;
+			}
+			dev->poll[p].took = at / 1000;
+			e = st[x];
+			break;
+		}
+		if (spi_now() - t0 >= ms * 1000000LL) {
+			e = -2;
+			break;
+		}
+		lead = step;
+		step *= 2;
+		if (step >= most) {
+			step = most;
+			nf = SPI_POLLN;
+		}
+	}
+	spi_hist(dev, SPI_OP_XFER, t0);
+	spi_unlock(dev);
+	return e;
 }
 
-// Returns bytes read, or -1 on error.
-int spi_xfer(FT_HANDLE ftHandle, unsigned char *bufout,
+static int spi_short(struct spi_dev *dev, unsigned char *bufout,
 			unsigned char *bufin, const int len) {
+	unsigned char buf[3 + 3 + 64 + 3 + 1];
+	struct spi_cmd cmd;
+	long long t0 = spi_now();
 	if (len > 64) {
 		return -1;
 	}
-	int n = spi_begin(ftHandle, len); // setup write
+	spi_cmd_init(&cmd, dev, buf, sizeof(buf));
+	(void)spi_cmd_cs(&cmd, 1); // /CS on
+	if (spi_cmd_clk(&cmd, bufout, len) < 0) {
+		return -1;
+	}
+	(void)spi_cmd_cs(&cmd, 0); // /CS off
+	(void)spi_cmd_flush(&cmd);
+	int n = spi_cmd_send(&cmd);
 	if (n < 0) {
 		return -1;
 	}
-	n = spi_write(ftHandle, bufout, len);
-	if (n < 0 || n != len) {
+	n = spi_wait(dev, len);
+	if (n < 0) {
 		return -1;
 	}
-	n = spi_read(ftHandle, bufin, len);
-	int m = spi_end(ftHandle);
-	if (m < 0) {
+	n = spi_recv(dev, bufin, len, n);
+	++dev->stats.xfers;
+	spi_hist(dev, SPI_OP_XFER, t0);
+	return n;
+}
+
+// Returns bytes read, or -1 on error.
+// The whole transaction, /CS on, data, /CS off, goes out in one write.
+int spi_xfer(struct spi_dev *dev, unsigned char *bufout,
+			unsigned char *bufin, const int len) {
+	spi_enter(dev);
+	int n = spi_short(dev, bufout, bufin, len);
+	spi_unlock(dev);
+	return n;
+}
+
+// Change clock speed of an open device.
+// Returns actual clock speed setup, or -1 on error.
+int spi_set_speed(struct spi_dev *dev, int hz) {
+	int n = 0;
+	spi_enter(dev);
+	if (hz > 0) {
+		clk_setup(hz, dev->div5, dev->setclk);
+		n = spi_write(dev, dev->div5, sizeof(dev->div5));
+		if (n == sizeof(dev->div5)) {
+			n = spi_write(dev, dev->setclk, sizeof(dev->setclk));
+		}
+		n = (n < 0 ? -1 : 0);
+		// what was learned at the old clock no longer holds
+		memset(dev->poll, 0, sizeof(dev->poll));
+		if (n == 0 && dev->tune == SPI_TUNE_AUTO) {
+			n = spi_prof(dev, SPI_TUNE_LAT);
+			dev->xover = 0; // measured again when first needed
+		}
+	}
+	spi_unlock(dev);
+	return n < 0 ? -1 : clk_speed(dev->div5, dev->setclk);
+}
+
+// Choose chip select of an open device, as for set_cs().
+int spi_set_cs(struct spi_dev *dev, char cs) {
+	int b = cs_bit(cs);
+	if (b < 0) {
+		return -1;
+	}
+	if (b == IO_GP1 && dev->waitop != 0) {
+		return -1; // GPIOL1 is an input, see spi_set_wait()
+	}
+	spi_enter(dev);
+	dev->chipsel = b;
+	spi_unlock(dev);
+	return cs;
+}
+
+// Use GPIOL1, the only pin the MPSSE can wait on, as a device ready
+// or interrupt line. 'level' is SPI_WAIT_LOW (e.g. W5500 /INT) or
+// SPI_WAIT_HIGH, or SPI_WAIT_OFF to make GPIOL1 an output again.
+// Returns 0, or -1 on error.
+int spi_set_wait(struct spi_dev *dev, int level) {
+	int n;
+	if (level != SPI_WAIT_OFF && dev->chipsel == IO_GP1) {
 		return -1;
 	}
+	spi_enter(dev);
+	switch (level) {
+	case SPI_WAIT_LOW:
+		dev->waitop = MP_WAITLO;
+		dev->iodir = IODIR & ~IO_GP1;
+		break;
+	case SPI_WAIT_HIGH:
+		dev->waitop = MP_WAITHI;
+		dev->iodir = IODIR & ~IO_GP1;
+		break;
+	default:
+		dev->waitop = 0;
+		dev->iodir = IODIR;
+		break;
+	}
+	n = spi_cs(dev, 0); // sets direction
+	spi_unlock(dev);
 	return n;
 }
 
-FT_HANDLE spi_open(int port) {
-	FT_HANDLE ftHandle = NULL;
-	ftStatus = FT_Open(port, &ftHandle);
-	if (ftStatus != FT_OK || ftHandle == NULL) {
+// Choose USB tuning of an open device, as for spi_tune().
+// Returns 'tune', or -1 on error.
+int spi_set_tune(struct spi_dev *dev, int tune) {
+	int e;
+	if (tune < 0 || tune >= SPI_NTUNE) {
+		return -1;
+	}
+	spi_enter(dev);
+	dev->tune = tune;
+	if (tune == SPI_TUNE_AUTO) {
+		e = spi_prof(dev, SPI_TUNE_LAT);
+		if (e == 0) {
+			e = spi_measure_rtt(dev);
+		}
+		dev->xover = 0; // measured when first needed
+		dev->tune_xfers = dev->stats.xfers;
+		dev->tune_bytes = dev->stats.bytes_in + dev->stats.bytes_out;
+	} else {
+		e = spi_prof(dev, tune);
+		dev->rtt = 0; // measured again when asked for
+	}
+	spi_unlock(dev);
+	return e < 0 ? -1 : tune;
+}
+
+// USB round trip of an open device, nS, under the tuning in effect.
+// AUTO measures it at open, otherwise it is measured when first asked.
+// Returns -1 on error.
+long long spi_rtt(struct spi_dev *dev) {
+	long long rtt;
+	spi_enter(dev);
+	if (dev->rtt == 0 && spi_measure_rtt(dev) < 0) {
+		spi_purge(dev);
+	}
+	rtt = dev->rtt;
+	spi_unlock(dev);
+	return rtt > 0 ? rtt : -1;
+}
+
+// Asynchronous transfers. Transactions are submitted to a queue, their
+// command streams are written back-to-back, and the response stream is
+// split back into transactions as it arrives (in order), calling each
+// transaction's 'done' routine.
+
+struct spi_queue *spi_queue_new(struct spi_dev *dev, int depth) {
+	struct spi_queue *q;
+	if (depth < 1) {
+		return NULL;
+	}
+	q = malloc(sizeof(*q));
+	if (q == NULL) {
+		return NULL;
+	}
+	memset(q, 0, sizeof(*q));
+	q->dev = dev;
+	q->maxreq = depth;
+	q->req = malloc(depth * sizeof(*q->req));
+	q->cmdmax = 2 * SPI_CHUNK;
+	q->cmd = malloc(q->cmdmax);
+	if (q->req == NULL || q->cmd == NULL) {
+		spi_queue_free(q);
 		return NULL;
 	}
-	ftStatus = FT_GetDriverVersion(ftHandle, &driverVersion);
-	if (ftStatus != FT_OK) {
+	spi_lock(dev);
+	if (dev->q != NULL) {
+		// one per device, synchronous transfers drain only that one
+		spi_unlock(dev);
+		q->dev = NULL;
+		spi_queue_free(q);
+		return NULL;
+	}
+	dev->q = q;
+	spi_unlock(dev);
+	return q;
+}
+
+void spi_queue_free(struct spi_queue *q) {
+	if (q == NULL) {
+		return;
+	}
+	if (q->dev != NULL) {
+		spi_lock(q->dev);
+		if (q->dev->q == q) {
+			q->dev->q = NULL;
+		}
+		spi_unlock(q->dev);
+	}
+	free(q->req);
+	free(q->cmd);
+	free(q);
+}
+
+// Abandon all outstanding transactions, 'done' is called with len -1.
+static void spi_queue_abort(struct spi_queue *q) {
+	spi_purge(q->dev);
+	(void)spi_end(q->dev);
+	q->cmdlen = 0;
+	while (q->nreq > 0) {
+		struct spi_req *r = &q->req[q->head];
+		q->head = (q->head + 1) % q->maxreq;
+		--q->nreq;
+		if (r->done) {
+			r->done(r->arg, r->bufin, -1);
+		}
+	}
+	q->unsent = 0;
+	q->got = 0;
+}
+
+// Write all pending command streams to device. Does not wait.
+int spi_queue_kick(struct spi_queue *q) {
+	struct spi_cmd cmd;
+	if (q->cmdlen == 0) {
+		return 0;
+	}
+	spi_lock(q->dev);
+	spi_cmd_init(&cmd, q->dev, q->cmd, q->cmdmax);
+	cmd.len = q->cmdlen;
+	if (spi_cmd_send(&cmd) < 0) {
+		spi_queue_abort(q);
+		spi_unlock(q->dev);
+		return -1;
+	}
+	q->cmdlen = 0;
+	q->unsent = 0;
+	spi_unlock(q->dev);
+	return 0;
+}
+
+// Complete the oldest transaction, if possible without blocking
+// (or, if 'wait', wait for it). Returns 1 if completed, 0 if not.
+static int spi_queue_one(struct spi_queue *q, int wait) {
+	struct spi_req *r = &q->req[q->head];
+	DWORD bytesReceived = 0;
+	int k = r->len - q->got;
+	int n;
+	if (q->nreq - q->unsent <= 0) {
+		return 0; // nothing on the wire
+	}
+	if (wait) {
+		n = spi_wait_clk(q->dev, k, k);
+		if (n < k) {
+			return -1;
+		}
+	} else {
+		q->dev->status = FT_GetQueueStatus(q->dev->ft, &bytesReceived);
+		if (q->dev->status != FT_OK) {
+			return -1;
+		}
+		if (bytesReceived == 0) {
+			return 0;
+		}
+		if (bytesReceived < k) k = bytesReceived;
+	}
+	n = spi_get(q->dev, r->bufin + q->got, k);
+	if (n < 0 || n != k) {
+		return -1;
+	}
+	q->got += k;
+	if (q->got < r->len) {
+		return 0;
+	}
+	q->got = 0;
+	q->head = (q->head + 1) % q->maxreq;
+	--q->nreq;
+	++q->dev->stats.xfers;
+	if (r->done) {
+		r->done(r->arg, r->bufin, r->len);
+	}
+	return 1;
+}
+
+// Complete what has already arrived, without blocking.
+// Returns number of transactions completed, or -1 on error.
+int spi_queue_poll(struct spi_queue *q) {
+	int c = 0;
+	int n;
+	spi_lock(q->dev);
+	while ((n = spi_queue_one(q, 0)) > 0) {
+		++c;
+	}
+	if (n < 0) {
+		spi_queue_abort(q);
+		c = -1;
+	}
+	spi_unlock(q->dev);
+	return c;
+}
+
+// Send anything pending, and wait for all transactions to complete.
+int spi_queue_drain(struct spi_queue *q) {
+	spi_lock(q->dev);
+	int n = spi_queue_kick(q);
+	while (n >= 0 && q->nreq > 0) {
+		n = spi_queue_one(q, 1);
+		if (n < 0) {
+			spi_queue_abort(q);
+		}
+	}
+	spi_unlock(q->dev);
+	return n < 0 ? -1 : 0;
+}
+
+// Queue one transaction (CS framed, len <= 4K). 'bufin' must remain
+// valid until 'done' is called. Full queues are written out as needed,
+// and completed transactions are harvested to make room.
+int spi_submit(struct spi_queue *q, unsigned char *bufout,
+		unsigned char *bufin, int len, spi_done_t done, void *arg) {
+	struct spi_cmd cmd;
+	int n;
+	if (len <= 0 || len > SPI_QMAX) {
+		return -1;
+	}
+	spi_lock(q->dev);
+	if (q->cmdlen + 3 + 3 + len + 3 + 1 > q->cmdmax) {
+		if (spi_queue_kick(q) < 0) {
+			spi_unlock(q->dev);
+			return -1;
+		}
+	}
+	if (q->nreq >= q->maxreq) {
+		// full: wait for the older half, so the next half is one write
+		n = spi_queue_kick(q);
+		while (n >= 0 && q->nreq > q->maxreq / 2) {
+			n = spi_queue_one(q, 1);
+		}
+		if (n < 0) {
+			spi_queue_abort(q);
+			spi_unlock(q->dev);
+			return -1;
+		}
+	}
+	spi_cmd_init(&cmd, q->dev, q->cmd + q->cmdlen, q->cmdmax - q->cmdlen);
+	(void)spi_cmd_cs(&cmd, 1); // /CS on
+	(void)spi_cmd_clk(&cmd, bufout, len);
+	(void)spi_cmd_cs(&cmd, 0); // /CS off
+	(void)spi_cmd_flush(&cmd);
+	q->cmdlen += cmd.len;
+	struct spi_req *r = &q->req[(q->head + q->nreq) % q->maxreq];
+	r->bufin = bufin;
+	r->len = len;
+	r->done = done;
+	r->arg = arg;
+	++q->nreq;
+	++q->unsent;
+	spi_unlock(q->dev);
+	return 0;
+}
+
+static void spi_free(struct spi_dev *dev) {
+	pthread_cond_destroy(&dev->rxevent.eCondVar);
+	pthread_mutex_destroy(&dev->rxevent.eMutex);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev->lngbuf);
+	free(dev);
+}
+
+// Returns NULL on error, with status in 'ftStatus'.
+struct spi_dev *spi_open(int port) {
+	struct spi_dev *dev;
+	pthread_mutexattr_t attr;
+	pthread_condattr_t cattr;
+	dev = malloc(sizeof(*dev));
+	if (dev == NULL) {
+		ftStatus = FT_INSUFFICIENT_RESOURCES;
+		return NULL;
+	}
+	memset(dev, 0, sizeof(*dev));
+	dev->lngbuf = malloc(SPI_LNGBUF);
+	if (dev->lngbuf == NULL) {
+		free(dev);
+		ftStatus = FT_INSUFFICIENT_RESOURCES;
+		return NULL;
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&dev->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dev->rxevent.eCondVar, &cattr);
+	pthread_condattr_destroy(&cattr);
+	pthread_mutex_init(&dev->rxevent.eMutex, NULL);
+	dev->chipsel = chipsel;
+	dev->iodir = IODIR;
+	memcpy(dev->div5, div5, sizeof(dev->div5));
+	memcpy(dev->setclk, setclk, sizeof(dev->setclk));
+	dev->status = FT_Open(port, &dev->ft);
+	if (dev->status != FT_OK || dev->ft == NULL) {
+		ftStatus = dev->status;
+		spi_free(dev);
+		return NULL;
+	}
+	dev->status = FT_GetDriverVersion(dev->ft, &dev->driverVersion);
+	if (dev->status != FT_OK) {
 		// ignore?
 	}
-	ftStatus = FT_ResetDevice(ftHandle);
-	if (ftStatus != FT_OK) {
+	dev->status = FT_ResetDevice(dev->ft);
+	if (dev->status != FT_OK) {
 		// TODO: need to close?
 		goto err_out;
 	}
-	ftStatus = FT_SetBitMode(ftHandle, 0x00, FT_BITMODE_RESET);
-	if (ftStatus != FT_OK) {
+	dev->status = FT_SetBitMode(dev->ft, 0x00, FT_BITMODE_RESET);
+	if (dev->status != FT_OK) {
 		goto err_out;
 	}
-	ftStatus = FT_SetLatencyTimer(ftHandle, 2);
-	if (ftStatus != FT_OK) {
+	dev->status = FT_SetTimeouts(dev->ft, 3000, 3000);
+	if (dev->status != FT_OK) {
 		goto err_out;
 	}
-	ftStatus = FT_SetTimeouts(ftHandle, 3000, 3000);
-	if (ftStatus != FT_OK) {
-		goto err_out;
-	}
-	int n = spi_setup(ftHandle);
+	spi_event(dev); // if this fails, waits will spin
+	int n = spi_setup(dev);
 	if (n < 0) {
 		goto err_out;
 	}
-	return ftHandle;
+	// if this fails, driver's USB defaults stay
+	dev->tuned = -1;
+	dev->xover = SPI_CHUNK;
+	(void)spi_set_tune(dev, tune);
+	dev->status = FT_OK;
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	return dev;
 err_out:
-	(void)FT_SetBitMode(ftHandle, 0x00, FT_BITMODE_RESET);
-	FT_Close(ftHandle);
+	ftStatus = dev->status;
+	(void)FT_SetBitMode(dev->ft, 0x00, FT_BITMODE_RESET);
+	FT_Close(dev->ft);
+	spi_free(dev);
 	return NULL;
 }
 
-void spi_close(FT_HANDLE ftHandle) {
-	if (ftHandle != NULL) {
-		(void)FT_SetBitMode(ftHandle, 0x00, FT_BITMODE_RESET);
-		FT_Close(ftHandle);
+void spi_close(struct spi_dev *dev) {
+	if (dev != NULL) {
+		(void)FT_SetBitMode(dev->ft, 0x00, FT_BITMODE_RESET);
+		FT_Close(dev->ft);
+		spi_free(dev);
+	}
+}
+
+// Copy of device statistics.
+void spi_stats(struct spi_dev *dev, struct spi_stats *st) {
+	spi_lock(dev);
+	*st = dev->stats;
+	spi_unlock(dev);
+}
+
+void spi_stats_reset(struct spi_dev *dev) {
+	spi_lock(dev);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	spi_unlock(dev);
+}
+
+void spi_stats_dump(struct spi_dev *dev, FILE *fp) {
+	static char *ops[SPI_NOPS] = { "xfer", "write", "wait", "read" };
+	struct spi_stats st;
+	int op, b;
+	spi_stats(dev, &st);
+	fprintf(fp, "transactions %lu\n", st.xfers);
+	fprintf(fp, "usb bytes out %lu in %lu\n", st.bytes_out, st.bytes_in);
+	fprintf(fp, "FT_Write %lu FT_Read %lu\n", st.writes, st.reads);
+	fprintf(fp, "queue polls %lu blocks %lu timeouts %lu\n",
+					st.polls, st.blocks, st.timeouts);
+	fprintf(fp, "purges %lu resyncs %lu\n", st.purges, st.resyncs);
+	spi_lock(dev);
+	fprintf(fp, "usb tuning %s (%s), changes %lu", print_tune(dev->tune),
+				print_tune(dev->tuned), st.tunes);
+	if (dev->tune == SPI_TUNE_AUTO && dev->xover == 0) {
+		fprintf(fp, ", rtt %lld uS, crossover not needed yet",
+							dev->rtt / 1000);
+	} else if (dev->tune == SPI_TUNE_AUTO) {
+		fprintf(fp, ", rtt %lld uS, crossover %d",
+				dev->rtt / 1000, dev->xover);
+	}
+	fprintf(fp, "\n");
+	spi_unlock(dev);
+	for (op = 0; op < SPI_NOPS; ++op) {
+		int lo = SPI_HBUCKETS, hi = -1;
+		for (b = 0; b < SPI_HBUCKETS; ++b) {
+			if (st.hist[op][b] != 0) {
+				if (b < lo) lo = b;
+				hi = b;
+			}
+		}
+		if (hi < 0) {
+			continue;
+		}
+		fprintf(fp, "%s latency (uS):\n", ops[op]);
+		for (b = lo; b <= hi; ++b) {
+			fprintf(fp, "  < %8ld %lu\n", 1L << b, st.hist[op][b]);
+		}
+	}
+}
+
+#define SPI_ARGS	4096	// words in a script line
+
+// Split 'line' into words, in place. Quotes (' or ") keep spaces in a
+// word, e.g. a wizdbg -W string. Returns the count, or -1 if it won't.
+static int spi_words(char *line, char **argv, int max) {
+	char *p = line;
+	char *o;
+	char end;
+	int n = 0;
+	while (1) {
+		while (isspace((unsigned char)*p)) {
+			++p;
+		}
+		if (*p == '\0' || *p == '#') {
+			break;
+		}
+		if (n == max) {
+			return -1;
+		}
+		argv[n++] = o = p;
+		while (*p != '\0' && !isspace((unsigned char)*p)) {
+			if (*p == '"' || *p == '\'') {
+				char q = *p++;
+				while (*p != '\0' && *p != q) {
+					*o++ = *p++;
+				}
+				if (*p == '\0') {
+					return -1; // unterminated
+				}
+				++p;
+			} else {
+				*o++ = *p++;
+			}
+		}
+		end = *p;
+		*o = '\0';
+		if (end != '\0') {
+			++p;
+		}
+	}
+	argv[n] = NULL;
+	return n;
+}
+
+int spi_script(struct spi_dev *dev, FILE *fp, char *name, spi_line_t fn,
+			void *arg) {
+	static char *argv[SPI_ARGS + 2];
+	char *line = NULL;
+	size_t size = 0;
+	int tty = isatty(fileno(fp));
+	int lineno = 0;
+	int rc = 0;
+	int n;
+	extern int optind;
+
+	while (rc == 0 && getline(&line, &size, fp) >= 0) {
+		++lineno;
+		argv[0] = name;
+		n = spi_words(line, argv + 1, SPI_ARGS);
+		if (n < 0) {
+			fprintf(stderr, "%s: line %d: too long, or unmatched quote\n",
+								name, lineno);
+			rc = -1;
+			break;
+		}
+		if (n == 0) {
+			continue;
+		}
+		optind = 0; // glibc: start over, forgetting any partial scan
+		rc = fn(arg, n + 1, argv);
+		if (rc != 0) {
+			fprintf(stderr, "%s: line %d failed\n", name, lineno);
+		} else if (tty && dev->q != NULL) {
+			rc = spi_queue_drain(dev->q); // the answer, before the next
+		}
+	}
+	if (dev->q != NULL && spi_queue_drain(dev->q) < 0 && rc == 0) {
+		rc = -1;
 	}
+	free(line);
+	return rc;
 }
@@ -1,6 +1,8 @@
 #ifndef __SPILIB_H__
 #define __SPILIB_H__
 
+#include <stdio.h>
+#include <pthread.h>
 #include "ftd2xx.h"
 
 void dump_buf(unsigned char *buf, int off, int len);
@@ -10,25 +12,185 @@ char *print_speed(int clk);
 int spi_speed(int hz); // before spi_open()
 int set_cs(char cs);	// select CS gpio bit, '0'..'3','C'
 
-// For now, this serves as 'errno'
-extern FT_STATUS ftStatus;
-extern DWORD driverVersion;
+// USB tuning profiles, latency timer and USB transfer sizes.
+enum { SPI_TUNE_LAT, SPI_TUNE_BULK, SPI_TUNE_AUTO, SPI_NTUNE };
+int parse_tune(char *arg);	// "lat", "bulk", "auto"
+char *print_tune(int tune);
+int spi_tune(int tune); // before spi_open()
+
+// Status of last failed spi_open(), per thread.
+extern __thread FT_STATUS ftStatus;
+
+struct spi_queue;
+
+// Per-device statistics, see spi_stats().
+// Latency histograms have log2 buckets, bucket 'b' counts < 2^b uS.
+#define SPI_HBUCKETS	24
+enum { SPI_OP_XFER, SPI_OP_WRITE, SPI_OP_WAIT, SPI_OP_READ, SPI_NOPS };
+struct spi_stats {
+	unsigned long xfers;		// transactions
+	unsigned long bytes_out;	// USB bytes written
+	unsigned long bytes_in;		// USB bytes read
+	unsigned long writes;		// FT_Write() calls
+	unsigned long reads;		// FT_Read() calls
+	unsigned long polls;		// FT_GetQueueStatus() calls in waits
+	unsigned long blocks;		// waits blocked on RX event
+	unsigned long timeouts;		// waits that gave up
+	unsigned long purges;		// FT_Purge() calls
+	unsigned long resyncs;		// short/long responses recovered
+	unsigned long tunes;		// USB profile changes (auto)
+	unsigned long hist[SPI_NOPS][SPI_HBUCKETS];
+};
+
+#define SPI_POLLT	4	// spi_poll() timings kept, by 'us'
+
+// One open device. All state is per-device, so several devices
+// may be used at once, and one device may be shared between threads.
+struct spi_dev {
+	FT_HANDLE ft;
+	FT_STATUS status;	// For now, this serves as 'errno'
+	DWORD driverVersion;
+	int chipsel;		// CS gpio bit mask
+	unsigned char iodir;	// ADBUS directions
+	unsigned char waitop;	// GPIOL1 wait command, or 0
+	unsigned char div5[1];	// clock prescale command
+	unsigned char setclk[3];	// clock divisor command
+	pthread_mutex_t lock;	// see spi_lock()
+	EVENT_HANDLE rxevent;	// signalled by driver when data arrives
+	int rxevent_ok;
+	unsigned char *lngbuf;	// command stream for long transfers
+	struct spi_queue *q;	// asynchronous transfers, if any
+	int tune;		// SPI_TUNE_xxx chosen
+	int tuned;		// profile in effect, LAT or BULK
+	long long rtt;		// round trip, nS, see spi_rtt(), 0 until measured
+	int xover;		// avg transfer size where BULK wins, 0 until needed
+	unsigned long tune_xfers;	// stats at last auto check
+	unsigned long tune_bytes;
+	struct {
+		int us;		// datasheet uS given to spi_poll(), 0 if unused
+		int took;	// and how long the device actually took
+	} poll[SPI_POLLT];
+	int poll_next;		// slot to reuse, when 'us' is new
+	struct spi_stats stats;
+};
 
 // Returns bytes read, or -1 on error. len <= 64
-int spi_xfer(FT_HANDLE ftHandle, unsigned char *bufout,
+int spi_xfer(struct spi_dev *dev, unsigned char *bufout,
 			unsigned char *bufin, const int len);
-int spi_xfer_long(FT_HANDLE ftHandle, unsigned char *bufout,
+int spi_xfer_long(struct spi_dev *dev, unsigned char *bufout,
 			unsigned char *bufin, const int len);
+// Half-duplex transfers, any length. Only data that matters crosses USB.
+int spi_xfer_out(struct spi_dev *dev, unsigned char *bufout, const int len);
+int spi_xfer_in(struct spi_dev *dev, unsigned char *bufin, const int len);
+int spi_xfer_cmd(struct spi_dev *dev, unsigned char *cmd, int clen,
+			unsigned char *bufin, const int len);
+
+// Scatter-gather transfer, all segments in one chip-select.
+// 'out' NULL is read-only, 'in' NULL is write-only. A SPI_SEG_CS
+// segment ends one chip-select and starts the next, so several frames
+// go in one transaction.
+struct spi_seg {
+	unsigned char *out;
+	unsigned char *in;
+	int len;
+};
+#define SPI_SEG_CS	{ NULL, NULL, 0 }
+int spi_xferv(struct spi_dev *dev, struct spi_seg *seg, int nseg);
+// Write 'cmd', then read 'len' bytes (any length) in one chip-select,
+// passing each chunk to 'fn' while the next is being clocked.
+typedef int (*spi_chunk_t)(void *arg, unsigned char *buf, int off, int len);
+int spi_xfer_stream(struct spi_dev *dev, unsigned char *cmd, int clen,
+			int len, spi_chunk_t fn, void *arg);
+// As spi_xferv(), after GPIOL1 reaches the spi_set_wait() level.
+// Returns -2 if it doesn't within 'ms'.
+int spi_xfer_wait(struct spi_dev *dev, struct spi_seg *seg, int nseg, int ms);
+// Repeat 'cmd' (e.g. read status) until (status & mask) == val, in bursts
+// sized to the device's datasheet time 'us'. Returns status, or -2 after
+// 'ms' mS.
+int spi_poll(struct spi_dev *dev, unsigned char *cmd, int clen,
+			int mask, int val, int us, int ms);
+
+// Asynchronous transfers: submit many, then poll or drain.
+// 'done' is called with len -1 if the transaction failed.
+typedef void (*spi_done_t)(void *arg, unsigned char *bufin, int len);
+struct spi_req {
+	unsigned char *bufin;
+	int len;
+	spi_done_t done;
+	void *arg;
+};
+struct spi_queue {
+	struct spi_dev *dev;
+	unsigned char *cmd;	// command streams not yet written
+	int cmdlen;
+	int cmdmax;
+	struct spi_req *req;	// ring of incomplete transactions
+	int maxreq;
+	int nreq;
+	int head;
+	int unsent;		// newest 'unsent' of 'nreq' not yet written
+	int got;		// bytes already read for 'head'
+};
+#define SPI_QMAX	4096	// longest transaction spi_submit() takes
+// 'depth' transactions outstanding, at least 1 (else returns NULL).
+// One queue per device: NULL if it already has one.
+struct spi_queue *spi_queue_new(struct spi_dev *dev, int depth);
+void spi_queue_free(struct spi_queue *q);
+int spi_submit(struct spi_queue *q, unsigned char *bufout,
+		unsigned char *bufin, int len, spi_done_t done, void *arg);
+int spi_queue_kick(struct spi_queue *q);
+int spi_queue_poll(struct spi_queue *q);
+int spi_queue_drain(struct spi_queue *q);
 
-FT_HANDLE spi_open(int port);
-void spi_close(FT_HANDLE ftHandle);
+struct spi_dev *spi_open(int port);
+void spi_close(struct spi_dev *dev);
+int spi_set_speed(struct spi_dev *dev, int hz);
+int spi_set_cs(struct spi_dev *dev, char cs);
+int spi_set_tune(struct spi_dev *dev, int tune);
+long long spi_rtt(struct spi_dev *dev);	// nS, -1 on error
+enum { SPI_WAIT_OFF = -1, SPI_WAIT_LOW, SPI_WAIT_HIGH };
+int spi_set_wait(struct spi_dev *dev, int level);	// GPIOL1 only
+void spi_lock(struct spi_dev *dev);
+void spi_unlock(struct spi_dev *dev);
+void spi_stats(struct spi_dev *dev, struct spi_stats *st);
+void spi_stats_reset(struct spi_dev *dev);
+void spi_stats_dump(struct spi_dev *dev, FILE *fp);
+
+// Script mode for the tools (-b): each line of 'fp' is a command with the
+// tool's own syntax, split into words as by a shell (quotes, # comments,
+// no expansion), and run by 'fn' with getopt() reset. Transfers 'fn'
+// leaves on the device queue go out in batches, and after each line when
+// 'fp' is a terminal. Stops at the first command that returns non-zero,
+// and returns that.
+typedef int (*spi_line_t)(void *arg, int argc, char **argv);
+int spi_script(struct spi_dev *dev, FILE *fp, char *name, spi_line_t fn,
+			void *arg);
 
 // Normally, only open, close, and xfer are used. but provide access anyway...
-int spi_write(FT_HANDLE ftHandle, unsigned char *buf, const int len);
-int spi_setup(FT_HANDLE ftHandle, DWORD len);
-int spi_read(FT_HANDLE ftHandle, unsigned char *buf, int len);
-int spi_begin(FT_HANDLE ftHandle, int len);
-int spi_end(FT_HANDLE ftHandle);
-int spi_cs(FT_HANDLE ftHandle, int on);
+int spi_write(struct spi_dev *dev, unsigned char *buf, const int len);
+int spi_setup(struct spi_dev *dev);
+int spi_read(struct spi_dev *dev, unsigned char *buf, int len);
+int spi_begin(struct spi_dev *dev, int len);
+int spi_end(struct spi_dev *dev);
+int spi_cs(struct spi_dev *dev, int on);
+
+// Command stream builder, for sending several commands in one write.
+struct spi_cmd {
+	struct spi_dev *dev;
+	unsigned char *buf;
+	int len;
+	int max;
+};
+void spi_cmd_init(struct spi_cmd *cmd, struct spi_dev *dev,
+			unsigned char *buf, int max);
+int spi_cmd_cs(struct spi_cmd *cmd, int on);
+int spi_cmd_clk(struct spi_cmd *cmd, unsigned char *buf, int len);
+int spi_cmd_out(struct spi_cmd *cmd, unsigned char *buf, int len);
+int spi_cmd_in(struct spi_cmd *cmd, int len);
+int spi_cmd_getio(struct spi_cmd *cmd);
+int spi_cmd_flush(struct spi_cmd *cmd);
+int spi_cmd_idle(struct spi_cmd *cmd, int len);
+int spi_cmd_wait(struct spi_cmd *cmd);
+int spi_cmd_send(struct spi_cmd *cmd);
 
 #endif /* __SPILIB_H__ */
@@ -0,0 +1,805 @@
+/*
+ * Socket routines for the WizNet W5500, see W5500.md.
+ *
+ * Each call is as few transactions as it can be: the frames it needs
+ * (register writes, the command, status and pointer reads) go as one
+ * spi_xferv() with SPI_SEG_CS between them, so one USB round trip.
+ * Data goes straight between the caller's buffer and the socket buffer,
+ * in one burst however it wraps, as the W5500 wraps buffer offsets
+ * itself. Sn_RX_RD and Sn_TX_WR are kept here, and never read back.
+ *
+ * Sn_TX_FSR and Sn_RX_RSR are read high byte first in one burst. Only
+ * this side ever lowers them, so a torn read is never more than is
+ * there, but may be less, even less than the read before it. That is
+ * used as is where reading low only means doing less now (wiz_recv(),
+ * the free space to send); wiz_recvfrom() needs the whole datagram, so
+ * re-reads until two reads agree before giving up on one.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "w5500.h"
+
+// Socket registers
+#define Sn_MR		0x00
+#define Sn_CR		0x01
+#define Sn_IR		0x02
+#define Sn_SR		0x03
+#define Sn_PORT		0x04
+#define Sn_DIPR		0x0c
+#define Sn_RXBUF_SIZE	0x1e
+#define Sn_TX_FSR	0x20
+#define Sn_TX_WR	0x24
+#define Sn_RX_RSR	0x26
+#define Sn_RX_RD	0x28
+
+// Sn_CR
+#define CR_OPEN		0x01
+#define CR_LISTEN	0x02
+#define CR_CONNECT	0x04
+#define CR_CLOSE	0x10
+#define CR_SEND		0x20
+#define CR_RECV		0x40
+
+// Sn_IR
+#define IR_TIMEOUT	0x08
+#define IR_SEND_OK	0x10
+
+#define VERSIONR	0x39
+
+#define WIZ_PEEK	256	// data read with Sn_RX_RSR, if none was known
+#define WIZ_FRAMES	16	// a frame or two for each socket
+
+// One transaction of up to WIZ_FRAMES frames.
+struct wiz_io {
+	struct spi_seg seg[WIZ_FRAMES * 4];
+	unsigned char hdr[WIZ_FRAMES][3];
+	int nseg;
+	int nfr;
+};
+
+static long long wiz_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void wiz_hdr(unsigned char *hdr, int bsb, int off, int wr) {
+	hdr[0] = (off >> 8) & 0xff; // big-endian address
+	hdr[1] = off & 0xff;
+	hdr[2] = (bsb << 3) | (wr ? 0x04 : 0); // variable length data
+}
+
+static void wio_init(struct wiz_io *io) {
+	io->nseg = 0;
+	io->nfr = 0;
+}
+
+// Start a frame at 'bsb'/'off', writing 'out' or reading into 'in'.
+static void wio_frame(struct wiz_io *io, int bsb, int off,
+			unsigned char *out, unsigned char *in, int len) {
+	unsigned char *hdr = io->hdr[io->nfr++];
+	if (io->nseg > 0) {
+		io->seg[io->nseg++] = (struct spi_seg)SPI_SEG_CS;
+	}
+	wiz_hdr(hdr, bsb, off, out != NULL);
+	io->seg[io->nseg++] = (struct spi_seg){ hdr, NULL, 3 };
+	io->seg[io->nseg++] = (struct spi_seg){ out, in, len };
+}
+
+// More data in the same frame.
+static void wio_more(struct wiz_io *io, unsigned char *out,
+			unsigned char *in, int len) {
+	io->seg[io->nseg++] = (struct spi_seg){ out, in, len };
+}
+
+static int wio_run(struct wiz *w, struct wiz_io *io) {
+	return spi_xferv(w->dev, io->seg, io->nseg) < 0 ? -1 : 0;
+}
+
+static int wiz_kb(unsigned char kb) {
+	return (kb > 16 ? 16 : kb) * 1024;
+}
+
+static int get16(unsigned char *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static void put16(unsigned char *p, int v) {
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+// Read any length at 'bsb'/'off'. Returns len, or -1 on error.
+int wiz_read(struct wiz *w, int bsb, int off, unsigned char *buf, int len) {
+	unsigned char hdr[3];
+	wiz_hdr(hdr, bsb, off, 0);
+	return spi_xfer_cmd(w->dev, hdr, sizeof(hdr), buf, len);
+}
+
+// Write any length at 'bsb'/'off'. Returns len, or -1 on error.
+int wiz_write(struct wiz *w, int bsb, int off, unsigned char *buf, int len) {
+	unsigned char hdr[3];
+	struct spi_seg seg[] = {
+		{ hdr, NULL, sizeof(hdr) },
+		{ buf, NULL, len },
+	};
+	wiz_hdr(hdr, bsb, off, 1);
+	return spi_xferv(w->dev, seg, 2) < 0 ? -1 : len;
+}
+
+// Registers the W5500 changes itself, or that act when written.
+static int wiz_volatile(int blk, int off) {
+	if (blk == 0) {
+		return off == 0x00 ||			// MR, RST self-clears
+			off == 0x15 || off == 0x17 ||	// IR, SIR
+			(off >= 0x28 && off <= 0x2e);	// UIPR, UPORTR, PHYCFGR
+	}
+	return (off >= Sn_CR && off <= Sn_SR) ||	// CR, IR, SR
+		(off >= 0x06 && off <= 0x13) ||		// DHAR, DIPR, DPORT, MSSR
+		(off >= Sn_TX_FSR && off <= 0x2b);	// buffer pointers
+}
+
+// Shadow block of 'bsb', or -1 if it isn't a register block.
+static int wiz_blk(int bsb) {
+	if (bsb == WIZ_COMMON) {
+		return 0;
+	}
+	if ((bsb & 3) == 1) {
+		return 1 + (bsb >> 2);
+	}
+	return -1;
+}
+
+static int wiz_bsb(int blk) {
+	return blk == 0 ? WIZ_COMMON : WIZ_SREG(blk - 1);
+}
+
+// Note what was read from, or written to, the chip.
+static void wiz_note(struct wiz *w, int bsb, int off, unsigned char *buf,
+			int len) {
+	int blk = wiz_blk(bsb);
+	int x;
+	if (blk < 0 || off < 0 || off + len > WIZ_REGS) {
+		return;
+	}
+	for (x = 0; x < len; ++x) {
+		if (!w->sh.dirty[blk][off + x]) {
+			w->sh.reg[blk][off + x] = buf[x];
+			w->sh.valid[blk][off + x] = 1;
+		}
+	}
+}
+
+void wiz_invalidate(struct wiz *w) {
+	memset(&w->sh.valid, 0, sizeof(w->sh.valid));
+	memset(&w->sh.dirty, 0, sizeof(w->sh.dirty));
+	w->sh.ndirty = 0;
+}
+
+// Registers not worth a frame of their own: a gap up to this long
+// between two runs is read (or rewritten, if known) with them.
+#define WIZ_GAP		4
+
+// Read registers. Volatile ones, and ones not yet known, are read from
+// the chip, nearby runs merged, all in one transaction where they fit.
+// Returns len, or -1 on error.
+int wiz_reg_read(struct wiz *w, int bsb, int off, unsigned char *buf, int len) {
+	int blk = wiz_blk(bsb);
+	unsigned char tmp[WIZ_REGS];
+	struct wiz_io io;
+	int got = 0;
+	int a, b, x;
+
+	if (blk < 0 || off < 0 || len < 0 || off + len > WIZ_REGS) {
+		return wiz_read(w, bsb, off, buf, len);
+	}
+	wio_init(&io);
+	for (a = off; a < off + len; a = b) {
+		// next run of bytes to read, gaps of WIZ_GAP or less included
+		while (a < off + len && w->sh.valid[blk][a] &&
+				!wiz_volatile(blk, a)) {
+			++a;
+		}
+		if (a >= off + len) {
+			break;
+		}
+		for (b = x = a + 1; x < off + len && x - b <= WIZ_GAP; ++x) {
+			if (!w->sh.valid[blk][x] || wiz_volatile(blk, x)) {
+				b = x + 1;
+			}
+		}
+		if (io.nfr == WIZ_FRAMES - 1) {
+			b = off + len; // last frame, the rest in this one
+		}
+		wio_frame(&io, bsb, a, NULL, tmp + a, b - a);
+		got += b - a;
+	}
+	if (io.nfr > 0) {
+		if (wio_run(w, &io) < 0) {
+			return -1;
+		}
+		// header, data, then CS and the same for each further frame
+		for (x = 1; x < io.nseg; x += 3) {
+			a = get16(io.seg[x - 1].out);
+			wiz_note(w, bsb, a, tmp + a, io.seg[x].len);
+		}
+	}
+	for (x = off; x < off + len; ++x) {
+		if (wiz_volatile(blk, x)) {
+			buf[x - off] = tmp[x];
+		} else {
+			buf[x - off] = w->sh.reg[blk][x];
+		}
+	}
+	w->sh.hits += len - got;
+	w->sh.misses += got;
+	return len;
+}
+
+// Write registers. Stable ones are held in the shadow for wiz_flush(),
+// any volatile one writes the whole range through, after what is held.
+// Returns len, or -1 on error.
+int wiz_reg_write(struct wiz *w, int bsb, int off, unsigned char *buf, int len) {
+	int blk = wiz_blk(bsb);
+	int vol = 0;
+	int x;
+
+	if (blk < 0 || off < 0 || len < 0 || off + len > WIZ_REGS) {
+		return wiz_write(w, bsb, off, buf, len);
+	}
+	for (x = off; x < off + len; ++x) {
+		vol |= wiz_volatile(blk, x);
+	}
+	if (!vol) {
+		for (x = off; x < off + len; ++x) {
+			w->sh.ndirty += !w->sh.dirty[blk][x];
+			w->sh.reg[blk][x] = buf[x - off];
+			w->sh.valid[blk][x] = 1;
+			w->sh.dirty[blk][x] = 1;
+		}
+		return len;
+	}
+	if (wiz_flush(w) < 0 || wiz_write(w, bsb, off, buf, len) < 0) {
+		return -1;
+	}
+	if (blk == 0 && off == 0 && (buf[0] & 0x80)) {
+		wiz_invalidate(w); // MR.RST, all back to reset values
+		return len;
+	}
+	for (x = off; x < off + len; ++x) {
+		if (!wiz_volatile(blk, x)) {
+			w->sh.reg[blk][x] = buf[x - off];
+			w->sh.valid[blk][x] = 1;
+		}
+	}
+	return len;
+}
+
+int wiz_flush(struct wiz *w) {
+	struct wiz_io io;
+	int blk, a, b, x;
+
+	wio_init(&io);
+	for (blk = 0; blk < WIZ_BLOCKS && w->sh.ndirty > 0; ++blk) {
+		unsigned char *dirty = w->sh.dirty[blk];
+		for (a = 0; a < WIZ_REGS; a = b) {
+			while (a < WIZ_REGS && !dirty[a]) {
+				++a;
+			}
+			if (a >= WIZ_REGS) {
+				break;
+			}
+			// through short gaps of known, stable registers
+			for (b = x = a + 1; x < WIZ_REGS && x - b <= WIZ_GAP; ++x) {
+				if (!w->sh.valid[blk][x] || wiz_volatile(blk, x)) {
+					break;
+				}
+				if (dirty[x]) {
+					b = x + 1;
+				}
+			}
+			if (io.nfr == WIZ_FRAMES) {
+				if (wio_run(w, &io) < 0) {
+					return -1;
+				}
+				wio_init(&io);
+			}
+			wio_frame(&io, wiz_bsb(blk), a, w->sh.reg[blk] + a, NULL,
+									b - a);
+			++w->sh.frames;
+		}
+	}
+	if (io.nfr > 0 && wio_run(w, &io) < 0) {
+		return -1;
+	}
+	memset(&w->sh.dirty, 0, sizeof(w->sh.dirty));
+	w->sh.ndirty = 0;
+	return 0;
+}
+
+int wiz_open(struct wiz *w, struct spi_dev *dev) {
+	unsigned char sz[WIZ_SOCKS][2];
+	unsigned char ver;
+	struct wiz_io io;
+	int s;
+
+	memset(w, 0, sizeof(*w));
+	w->dev = dev;
+	if (wiz_read(w, WIZ_COMMON, VERSIONR, &ver, 1) < 0) {
+		return -1;
+	}
+	if (ver != 0x04) {
+		return -2;
+	}
+	// all the buffer sizes, in one transaction
+	wio_init(&io);
+	for (s = 0; s < WIZ_SOCKS; ++s) {
+		wio_frame(&io, WIZ_SREG(s), Sn_RXBUF_SIZE, NULL, sz[s], 2);
+	}
+	if (wio_run(w, &io) < 0) {
+		return -1;
+	}
+	for (s = 0; s < WIZ_SOCKS; ++s) {
+		w->sock[s].rxsize = wiz_kb(sz[s][0]);
+		w->sock[s].txsize = wiz_kb(sz[s][1]);
+		wiz_note(w, WIZ_SREG(s), Sn_RXBUF_SIZE, sz[s], 2);
+	}
+	wiz_note(w, WIZ_COMMON, VERSIONR, &ver, 1);
+	return 0;
+}
+
+int wiz_read_batch(struct wiz *w, struct wiz_rd *rd, int n) {
+	struct wiz_io io;
+	int x;
+
+	wio_init(&io);
+	for (x = 0; x < n; ++x) {
+		if (rd[x].len <= 0) {
+			continue;
+		}
+		if (io.nfr == WIZ_FRAMES) {
+			if (wio_run(w, &io) < 0) {
+				return -1;
+			}
+			wio_init(&io);
+		}
+		wio_frame(&io, rd[x].bsb, rd[x].off, NULL, rd[x].buf, rd[x].len);
+	}
+	if (io.nfr > 0 && wio_run(w, &io) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Sn_IR and Sn_SR, and Sn_RX_RSR, of each socket: two frames each, as
+// one frame across would carry the 32 bytes between.
+int wiz_snapshot(struct wiz *w, struct wiz_snap *st) {
+	unsigned char p[WIZ_SOCKS][4];
+	struct wiz_rd rd[2 * WIZ_SOCKS];
+	int s;
+
+	for (s = 0; s < WIZ_SOCKS; ++s) {
+		rd[2 * s] = (struct wiz_rd){ WIZ_SREG(s), Sn_IR, p[s], 2 };
+		rd[2 * s + 1] = (struct wiz_rd){ WIZ_SREG(s), Sn_RX_RSR, p[s] + 2, 2 };
+	}
+	if (wiz_read_batch(w, rd, 2 * WIZ_SOCKS) < 0) {
+		return -1;
+	}
+	for (s = 0; s < WIZ_SOCKS; ++s) {
+		st[s].ir = p[s][0];
+		st[s].sr = p[s][1];
+		st[s].rx_len = get16(p[s] + 2);
+		w->sock[s].sr = st[s].sr;
+		w->sock[s].rx_len = st[s].rx_len;
+	}
+	return 0;
+}
+
+int wiz_bufsize(struct wiz *w, int s, int rxkb, int txkb) {
+	unsigned char sz[2];
+	if (s < 0 || s >= WIZ_SOCKS || rxkb < 0 || rxkb > 16 ||
+			txkb < 0 || txkb > 16) {
+		return -1;
+	}
+	sz[0] = rxkb;
+	sz[1] = txkb;
+	if (wiz_reg_write(w, WIZ_SREG(s), Sn_RXBUF_SIZE, sz, 2) < 0 ||
+			wiz_flush(w) < 0) {
+		return -1;
+	}
+	w->sock[s].rxsize = wiz_kb(sz[0]);
+	w->sock[s].txsize = wiz_kb(sz[1]);
+	return 0;
+}
+
+// Until Sn_CR reads 0, the command not yet taken. 'st' is Sn_CR, Sn_IR,
+// Sn_SR as last read. Returns 0, -1 on error, or -2 on timeout.
+static int wiz_cr_wait(struct wiz *w, int s, unsigned char *st) {
+	long long t0 = wiz_now();
+	while (st[0] != 0) {
+		if (wiz_now() - t0 > WIZ_TIMEOUT * 1000000LL) {
+			return -2;
+		}
+		if (wiz_read(w, WIZ_SREG(s), Sn_CR, st, 3) < 0) {
+			return -1;
+		}
+	}
+	w->sock[s].sr = st[2];
+	return 0;
+}
+
+// Any frames in 'io', then command 'cmd' and read back Sn_CR..Sn_SR,
+// in one transaction. Returns Sn_SR, or -1 (-2 on timeout).
+static int wiz_do(struct wiz *w, int s, struct wiz_io *io, int cmd) {
+	unsigned char c = cmd;
+	unsigned char st[3];
+	int e;
+
+	if (w->sh.ndirty > 0 && wiz_flush(w) < 0) {
+		return -1; // registers before the command
+	}
+	wio_frame(io, WIZ_SREG(s), Sn_CR, &c, NULL, 1);
+	wio_frame(io, WIZ_SREG(s), Sn_CR, NULL, st, 3);
+	if (wio_run(w, io) < 0) {
+		return -1;
+	}
+	e = wiz_cr_wait(w, s, st);
+	return e < 0 ? e : st[2];
+}
+
+int wiz_cmd(struct wiz *w, int s, int cmd) {
+	struct wiz_io io;
+	if (s < 0 || s >= WIZ_SOCKS) {
+		return -1;
+	}
+	wio_init(&io);
+	return wiz_do(w, s, &io, cmd);
+}
+
+int wiz_status(struct wiz *w, int s) {
+	unsigned char sr;
+	if (s < 0 || s >= WIZ_SOCKS ||
+			wiz_read(w, WIZ_SREG(s), Sn_SR, &sr, 1) < 0) {
+		return -1;
+	}
+	w->sock[s].sr = sr;
+	return sr;
+}
+
+int wiz_socket(struct wiz *w, int s, int proto, int port) {
+	struct wiz_sock *sk;
+	unsigned char mr = proto;
+	unsigned char pt[2];
+	unsigned char p[10];
+	struct wiz_io io;
+	int sr;
+
+	if (s < 0 || s >= WIZ_SOCKS) {
+		return -1;
+	}
+	sk = &w->sock[s];
+	put16(pt, port);
+	wio_init(&io);
+	wio_frame(&io, WIZ_SREG(s), Sn_MR, &mr, NULL, 1);
+	wio_frame(&io, WIZ_SREG(s), Sn_PORT, pt, NULL, 2);
+	sr = wiz_do(w, s, &io, CR_OPEN);
+	if (sr < 0) {
+		return sr;
+	}
+	wiz_note(w, WIZ_SREG(s), Sn_MR, &mr, 1);
+	wiz_note(w, WIZ_SREG(s), Sn_PORT, pt, 2);
+	// Sn_TX_FSR, TX_RD, TX_WR, RX_RSR, RX_RD: from here on, kept here
+	if (wiz_read(w, WIZ_SREG(s), Sn_TX_FSR, p, sizeof(p)) < 0) {
+		return -1;
+	}
+	sk->tx_free = get16(p);
+	sk->tx_wr = get16(p + 4);
+	sk->rx_len = get16(p + 6);
+	sk->rx_rd = get16(p + 8);
+	sk->sending = 0;
+	return sr;
+}
+
+int wiz_connect(struct wiz *w, int s, unsigned char *ip, int port) {
+	unsigned char dst[6];
+	struct wiz_io io;
+	long long t0 = wiz_now();
+	int sr;
+
+	if (s < 0 || s >= WIZ_SOCKS) {
+		return -1;
+	}
+	memcpy(dst, ip, 4);
+	put16(dst + 4, port);
+	wio_init(&io);
+	wio_frame(&io, WIZ_SREG(s), Sn_DIPR, dst, NULL, 6);
+	sr = wiz_do(w, s, &io, CR_CONNECT);
+	while (sr == WIZ_INIT || sr == WIZ_SYNSENT) {
+		if (wiz_now() - t0 > WIZ_TIMEOUT * 1000000LL) {
+			return -2;
+		}
+		sr = wiz_status(w, s);
+	}
+	return sr == WIZ_ESTABLISHED || sr == WIZ_CLOSE_WAIT ? 0 : -1;
+}
+
+int wiz_listen(struct wiz *w, int s) {
+	int sr = wiz_cmd(w, s, CR_LISTEN);
+	return sr == WIZ_LISTEN ? 0 : -1;
+}
+
+int wiz_close(struct wiz *w, int s) {
+	int sr = wiz_cmd(w, s, CR_CLOSE);
+	return sr < 0 ? sr : 0;
+}
+
+// From Sn_CR..Sn_SR and Sn_TX_FSR..Sn_RX_RSR, as read after a SEND.
+// Returns 0, or -1 if the socket timed out or closed.
+static int wiz_txst(struct wiz_sock *sk, unsigned char *st, unsigned char *p) {
+	sk->sr = st[2];
+	sk->tx_free = get16(p);
+	sk->rx_len = get16(p + 6);
+	if (st[1] & IR_TIMEOUT) {
+		sk->sending = 0;
+		return -1;
+	}
+	if (st[0] == 0 && (st[1] & IR_SEND_OK)) {
+		sk->sending = 0;
+	}
+	if (sk->sr == WIZ_CLOSED) {
+		return -1;
+	}
+	return 0;
+}
+
+// Until SEND_OK of the last SEND, and 'need' bytes free.
+// Returns 0, -1 on error, or -2 on timeout.
+static int wiz_txwait(struct wiz *w, int s, int need) {
+	struct wiz_sock *sk = &w->sock[s];
+	unsigned char st[3];
+	unsigned char p[8];
+	struct wiz_io io;
+	long long t0 = wiz_now();
+
+	while (sk->sending || sk->tx_free < need) {
+		if (wiz_now() - t0 > WIZ_TIMEOUT * 1000000LL) {
+			return -2;
+		}
+		wio_init(&io);
+		wio_frame(&io, WIZ_SREG(s), Sn_CR, NULL, st, 3);
+		wio_frame(&io, WIZ_SREG(s), Sn_TX_FSR, NULL, p, 8);
+		if (wio_run(w, &io) < 0 || wiz_txst(sk, st, p) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// One transaction: clear SEND_OK, destination (UDP), data at Sn_TX_WR,
+// new Sn_TX_WR, SEND, then read back status, free space, and what has
+// arrived meanwhile. Returns 0, or -1 on error.
+static int wiz_txput(struct wiz *w, int s, unsigned char *buf, int len,
+			unsigned char *dst) {
+	struct wiz_sock *sk = &w->sock[s];
+	unsigned char ir = IR_SEND_OK;
+	unsigned char cr = CR_SEND;
+	unsigned char wr[2];
+	unsigned char st[3];
+	unsigned char p[8];
+	struct wiz_io io;
+
+	if (w->sh.ndirty > 0 && wiz_flush(w) < 0) {
+		return -1;
+	}
+	put16(wr, (unsigned short)(sk->tx_wr + len));
+	wio_init(&io);
+	wio_frame(&io, WIZ_SREG(s), Sn_IR, &ir, NULL, 1);
+	if (dst != NULL) {
+		wio_frame(&io, WIZ_SREG(s), Sn_DIPR, dst, NULL, 6);
+	}
+	wio_frame(&io, WIZ_STX(s), sk->tx_wr, buf, NULL, len);
+	wio_frame(&io, WIZ_SREG(s), Sn_TX_WR, wr, NULL, 2);
+	wio_frame(&io, WIZ_SREG(s), Sn_CR, &cr, NULL, 1);
+	wio_frame(&io, WIZ_SREG(s), Sn_CR, NULL, st, 3);
+	wio_frame(&io, WIZ_SREG(s), Sn_TX_FSR, NULL, p, 8);
+	if (wio_run(w, &io) < 0) {
+		return -1;
+	}
+	sk->tx_wr += len;
+	sk->sending = 1;
+	return wiz_txst(sk, st, p);
+}
+
+int wiz_send(struct wiz *w, int s, unsigned char *buf, int len) {
+	struct wiz_sock *sk;
+	int done = 0;
+	int e;
+
+	if (s < 0 || s >= WIZ_SOCKS || len < 0) {
+		return -1;
+	}
+	sk = &w->sock[s];
+	if (sk->txsize == 0) {
+		return -1;
+	}
+	while (done < len) {
+		e = wiz_txwait(w, s, 1);
+		if (e < 0) {
+			return e;
+		}
+		int k = len - done;
+		if (k > sk->tx_free) k = sk->tx_free;
+		if (wiz_txput(w, s, buf + done, k, NULL) < 0) {
+			return -1;
+		}
+		done += k;
+	}
+	return len;
+}
+
+int wiz_sendto(struct wiz *w, int s, unsigned char *buf, int len,
+			unsigned char *ip, int port) {
+	struct wiz_sock *sk;
+	unsigned char dst[6];
+	int e;
+
+	if (s < 0 || s >= WIZ_SOCKS || len <= 0) {
+		return -1;
+	}
+	sk = &w->sock[s];
+	if (len > sk->txsize) {
+		return -1;
+	}
+	e = wiz_txwait(w, s, len);
+	if (e < 0) {
+		return e;
+	}
+	memcpy(dst, ip, 4);
+	put16(dst + 4, port);
+	return wiz_txput(w, s, buf, len, dst) < 0 ? -1 : len;
+}
+
+// Finish a read of 'used' bytes at Sn_RX_RD: any 'rest' of it still to
+// read into 'buf', the new Sn_RX_RD, RECV, and Sn_CR and Sn_RX_RSR read
+// back for next time, in one transaction. Returns 0, or -1 on error.
+static int wiz_rxdone(struct wiz *w, int s, int used, int skip,
+			unsigned char *buf, int rest) {
+	struct wiz_sock *sk = &w->sock[s];
+	unsigned char cr = CR_RECV;
+	unsigned char rd[2];
+	unsigned char st[3];
+	unsigned char p[2];
+	struct wiz_io io;
+
+	put16(rd, (unsigned short)(sk->rx_rd + used));
+	wio_init(&io);
+	if (rest > 0) {
+		wio_frame(&io, WIZ_SRX(s), (unsigned short)(sk->rx_rd + skip),
+						NULL, buf, rest);
+	}
+	wio_frame(&io, WIZ_SREG(s), Sn_RX_RD, rd, NULL, 2);
+	wio_frame(&io, WIZ_SREG(s), Sn_CR, &cr, NULL, 1);
+	wio_frame(&io, WIZ_SREG(s), Sn_CR, NULL, st, 3);
+	wio_frame(&io, WIZ_SREG(s), Sn_RX_RSR, NULL, p, 2);
+	if (wio_run(w, &io) < 0) {
+		return -1;
+	}
+	sk->rx_rd += used;
+	sk->rx_len = get16(p);
+	if (st[0] != 0) {
+		// RECV not taken yet, so that Sn_RX_RSR is stale
+		sk->rx_len = 0;
+		return wiz_cr_wait(w, s, st) < 0 ? -1 : 0;
+	}
+	sk->sr = st[2];
+	return 0;
+}
+
+// Sn_RX_RSR, and as much data as is likely there, in one transaction.
+// The rest, if any, is read by wiz_rxdone().
+int wiz_recv(struct wiz *w, int s, unsigned char *buf, int len) {
+	struct wiz_sock *sk;
+	unsigned char p[2];
+	struct wiz_io io;
+	int k, n;
+
+	if (s < 0 || s >= WIZ_SOCKS || len < 0) {
+		return -1;
+	}
+	sk = &w->sock[s];
+	if (sk->rxsize == 0) {
+		return -1;
+	}
+	k = sk->rx_len > 0 ? sk->rx_len : WIZ_PEEK;
+	if (k > len) k = len;
+	wio_init(&io);
+	wio_frame(&io, WIZ_SREG(s), Sn_RX_RSR, NULL, p, 2);
+	if (k > 0) {
+		wio_frame(&io, WIZ_SRX(s), sk->rx_rd, NULL, buf, k);
+	}
+	if (wio_run(w, &io) < 0) {
+		return -1;
+	}
+	n = get16(p);
+	sk->rx_len = n;
+	if (n > len) n = len;
+	if (n == 0) {
+		return 0;
+	}
+	if (k > n) k = n;
+	return wiz_rxdone(w, s, n, k, buf + k, n - k) < 0 ? -1 : n;
+}
+
+// Sn_RX_RSR into rx_len, read until two reads agree, as one read may be
+// torn low. Returns 0, or -1 on error.
+static int wiz_rsr(struct wiz *w, int s) {
+	unsigned char p[2];
+	int prev = -1;
+	int n = 0;
+
+	for (;;) {
+		if (wiz_read(w, WIZ_SREG(s), Sn_RX_RSR, p, 2) < 0) {
+			return -1;
+		}
+		n = get16(p);
+		if (n == prev) {
+			break;
+		}
+		prev = n;
+	}
+	w->sock[s].rx_len = n;
+	return 0;
+}
+
+// As wiz_recv(), for one datagram, behind its 8-byte header (peer IP,
+// port, length). Any of it past 'len' is dropped.
+int wiz_recvfrom(struct wiz *w, int s, unsigned char *buf, int len,
+			unsigned char *ip, int *port) {
+	struct wiz_sock *sk;
+	unsigned char hdr[8];
+	unsigned char p[2];
+	struct wiz_io io;
+	int k, n, plen;
+
+	if (s < 0 || s >= WIZ_SOCKS || len < 0) {
+		return -1;
+	}
+	sk = &w->sock[s];
+	if (sk->rxsize == 0) {
+		return -1;
+	}
+	k = sk->rx_len > 8 ? sk->rx_len - 8 : WIZ_PEEK;
+	if (k > len) k = len;
+	wio_init(&io);
+	wio_frame(&io, WIZ_SREG(s), Sn_RX_RSR, NULL, p, 2);
+	wio_frame(&io, WIZ_SRX(s), sk->rx_rd, NULL, hdr, 8);
+	if (k > 0) {
+		wio_more(&io, NULL, buf, k);
+	}
+	if (wio_run(w, &io) < 0) {
+		return -1;
+	}
+	sk->rx_len = get16(p);
+	if (sk->rx_len < 8) {
+		return 0;
+	}
+	plen = get16(hdr + 6);
+	if (plen > sk->rx_len - 8 && wiz_rsr(w, s) < 0) {
+		return -1;
+	}
+	if (plen > sk->rx_len - 8) {
+		return -1; // lost track of datagram boundaries
+	}
+	if (ip != NULL) {
+		memcpy(ip, hdr, 4);
+	}
+	if (port != NULL) {
+		*port = get16(hdr + 4);
+	}
+	n = plen < len ? plen : len;
+	if (k > n) k = n;
+	return wiz_rxdone(w, s, 8 + plen, 8 + k, buf + k, n - k) < 0 ? -1 : n;
+}
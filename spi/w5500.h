@@ -0,0 +1,115 @@
+#ifndef __W5500_H__
+#define __W5500_H__
+
+#include "spilib.h"
+
+// WizNet W5500 sockets, see W5500.md.
+#define WIZ_SOCKS	8
+#define WIZ_TIMEOUT	1000	// mS, for commands and SEND_OK
+
+// Block select: common registers, or socket 's' registers and buffers.
+#define WIZ_COMMON	0
+#define WIZ_SREG(s)	(((s) << 2) | 1)
+#define WIZ_STX(s)	(((s) << 2) | 2)
+#define WIZ_SRX(s)	(((s) << 2) | 3)
+
+// Sn_MR protocol
+#define WIZ_TCP		0x01
+#define WIZ_UDP		0x02
+#define WIZ_MACRAW	0x04
+
+// Sn_SR
+#define WIZ_CLOSED	0x00
+#define WIZ_INIT	0x13
+#define WIZ_LISTEN	0x14
+#define WIZ_SYNSENT	0x15
+#define WIZ_ESTABLISHED	0x17
+#define WIZ_CLOSE_WAIT	0x1c
+#define WIZ_SOCK_UDP	0x22
+
+struct wiz_sock {
+	int rxsize;		// buffer bytes
+	int txsize;
+	unsigned short rx_rd;	// host copies of Sn_RX_RD, Sn_TX_WR
+	unsigned short tx_wr;
+	int rx_len;		// Sn_RX_RSR when last read, or 0
+	int tx_free;		// Sn_TX_FSR when last read, less sent since
+	int sending;		// SEND issued, SEND_OK not yet seen
+	unsigned char sr;	// Sn_SR when last read
+};
+
+// Host copy of the common and socket register blocks. Stable registers
+// are read once and then served from here, and writes to them are held
+// until wiz_flush(). Volatile ones (status, interrupts, pointers,
+// commands, the peer's address) are always read, and written through.
+#define WIZ_BLOCKS	(1 + WIZ_SOCKS)	// common, then sockets
+#define WIZ_REGS	0x40
+struct wiz_shadow {
+	unsigned char reg[WIZ_BLOCKS][WIZ_REGS];
+	unsigned char valid[WIZ_BLOCKS][WIZ_REGS];
+	unsigned char dirty[WIZ_BLOCKS][WIZ_REGS];
+	int ndirty;
+	unsigned long hits;	// bytes read from the shadow
+	unsigned long misses;	// bytes read from the chip
+	unsigned long frames;	// flushed
+};
+
+struct wiz {
+	struct spi_dev *dev;
+	struct wiz_sock sock[WIZ_SOCKS];
+	struct wiz_shadow sh;
+};
+
+// Returns 0, -1 on error, or -2 if VERSIONR isn't a W5500's.
+int wiz_open(struct wiz *w, struct spi_dev *dev);
+int wiz_read(struct wiz *w, int bsb, int off, unsigned char *buf, int len);
+int wiz_write(struct wiz *w, int bsb, int off, unsigned char *buf, int len);
+// Registers, through the shadow. Other blocks (buffers) go straight
+// to wiz_read() and wiz_write().
+int wiz_reg_read(struct wiz *w, int bsb, int off, unsigned char *buf, int len);
+int wiz_reg_write(struct wiz *w, int bsb, int off, unsigned char *buf, int len);
+// Write held registers, adjacent ones in one burst, all in one
+// transaction where they fit. Returns 0, or -1 on error.
+int wiz_flush(struct wiz *w);
+// Forget the shadow, e.g. after a reset other than by MR.
+void wiz_invalidate(struct wiz *w);
+// One read of a batch.
+struct wiz_rd {
+	int bsb;
+	int off;
+	unsigned char *buf;
+	int len;
+};
+// Reads in as few transactions as they fit, each one USB round trip
+// with its response in one FT_Read. Returns 0, or -1 on error.
+int wiz_read_batch(struct wiz *w, struct wiz_rd *rd, int n);
+
+// State of every socket, in one round trip.
+struct wiz_snap {
+	unsigned char ir;	// Sn_IR
+	unsigned char sr;	// Sn_SR
+	int rx_len;		// Sn_RX_RSR
+};
+int wiz_snapshot(struct wiz *w, struct wiz_snap *st);
+// Buffer sizes in K (0, 1, 2, 4, 8, 16), before wiz_socket().
+int wiz_bufsize(struct wiz *w, int s, int rxkb, int txkb);
+// Sn_CR command, returns Sn_SR after.
+int wiz_cmd(struct wiz *w, int s, int cmd);
+int wiz_status(struct wiz *w, int s);
+// OPEN with protocol and local port, returns Sn_SR.
+int wiz_socket(struct wiz *w, int s, int proto, int port);
+int wiz_connect(struct wiz *w, int s, unsigned char *ip, int port);
+int wiz_listen(struct wiz *w, int s);
+int wiz_close(struct wiz *w, int s);
+// Queue all of 'buf' (in pieces, as buffer space allows).
+// Returns len, -1 on error, -2 if SEND_OK never came.
+int wiz_send(struct wiz *w, int s, unsigned char *buf, int len);
+// What has arrived, up to 'len', straight into 'buf'. 0 if nothing.
+int wiz_recv(struct wiz *w, int s, unsigned char *buf, int len);
+// UDP: one datagram each.
+int wiz_sendto(struct wiz *w, int s, unsigned char *buf, int len,
+			unsigned char *ip, int port);
+int wiz_recvfrom(struct wiz *w, int s, unsigned char *buf, int len,
+			unsigned char *ip, int *port);
+
+#endif /* __W5500_H__ */
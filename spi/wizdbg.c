@@ -2,8 +2,14 @@
  * General-purpose read/write for WIZ850io (W5500)
  *
  * Usage: wizdbg [options] <bsb> <off> <len>
+ *        wizdbg [options] -m <ms> <bsb> <off> <len>
+ *        wizdbg [options] -a
  *        wizdbg [options] [-w] <bsb> <off> <byte>[...]
+ *        wizdbg [options] -b script|-
  *
+ * With -b, each line of the script is a command as above, all run over
+ * one open device. Plain reads and writes are queued, so that many go
+ * out in one write, and print as they complete.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,144 +18,435 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 #include "ftd2xx.h"
 #include "spilib.h"
+#include "w5500.h"
 
-int main(int argc, char **argv) {
-	int wr = 0;
-	int bsb = 0;
-	int off = 0;
-	int len = 0;
-	int tot = 0;
-	int port = 0;
-	int speed = 0;
-	int verbose = 0;
-	int cs = 'C';
-	unsigned char *bufo;
+#define WDBG_DEPTH	16	// queued transfers, in script mode
+
+// Options and arguments of one command.
+struct wdbg {
+	int wr;
+	int port;
+	int speed;
+	int cs;
+	int tune;
+	int raw;
+	int verbose;
+	int stats;
+	int intwait;	// mS to wait for /INT, or 0
+	int mon;	// mS between polls, or 0
+	int all;	// socket states
+	char *script;
+	int nargs;
+	char **args;
+};
+
+// One read or write, and how to print it.
+struct wdbg_xfer {
+	struct spi_dev *ft;
+	int bsb;
+	int off;
+	int len;
+	int wr;
+	int raw;
+	int *failed;
+	unsigned char *bufo;	// header, then data
 	unsigned char *bufi;
-	int x;
-	int c;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_int(int sig) {
+	stop = 1;
+}
+
+// Poll registers through the shadow, dumping them when they change.
+// Stable registers are read once, so each poll costs only the rest.
+static int monitor(struct spi_dev *ft, int bsb, int off, int len, int ms,
+			int verbose) {
+	struct wiz wz;
+	unsigned char *cur = malloc(len);
+	unsigned char *last = malloc(len);
+	int polls = 0;
 	int e;
-	FT_HANDLE ft;
 
+	if (cur == NULL || last == NULL) {
+		fprintf(stderr, "Out of memory, %d bytes\n", len);
+		free(cur);
+		free(last);
+		return -1;
+	}
+	e = wiz_open(&wz, ft);
+	if (e == -2) {
+		fprintf(stderr, "No W5500 found\n");
+	}
+	stop = 0;
+	signal(SIGINT, on_int);
+	while (e == 0 && !stop) {
+		e = wiz_reg_read(&wz, bsb, off, cur, len);
+		if (e < 0) {
+			break;
+		}
+		e = 0;
+		if (polls++ == 0 || memcmp(cur, last, len) != 0) {
+			dump_buf2(cur, bsb, off, len);
+			fflush(stdout);
+			memcpy(last, cur, len);
+		}
+		usleep(ms * 1000);
+	}
+	signal(SIGINT, SIG_DFL);
+	if (verbose) {
+		fprintf(stderr, "%d polls, %lu bytes from shadow, %lu from chip\n",
+				polls, wz.sh.hits, wz.sh.misses);
+	}
+	free(cur);
+	free(last);
+	return e;
+}
+
+// State of all sockets, in one round trip.
+static int sockets(struct spi_dev *ft) {
+	struct wiz wz;
+	struct wiz_snap st[WIZ_SOCKS];
+	int e = wiz_open(&wz, ft);
+	int s;
+
+	if (e == -2) {
+		fprintf(stderr, "No W5500 found\n");
+	}
+	if (e == 0) {
+		e = wiz_snapshot(&wz, st);
+	}
+	if (e < 0) {
+		return e;
+	}
+	printf("sock  SR  IR  RX_RSR\n");
+	for (s = 0; s < WIZ_SOCKS; ++s) {
+		printf("%4d  %02x  %02x  %6d\n", s, st[s].sr, st[s].ir, st[s].rx_len);
+	}
+	return 0;
+}
+
+// spi_done_t, or called after a synchronous transfer. Frees 'arg'.
+static void wdbg_done(void *arg, unsigned char *bufin, int n) {
+	struct wdbg_xfer *xf = arg;
+	if (n < 0) {
+		fprintf(stderr, "Failure during transfer, error = %d\n",
+							xf->ft->status);
+		*xf->failed = 1;
+	} else if (!xf->wr && xf->raw) {
+		fwrite(xf->bufi + 3, 1, xf->len, stdout);
+	} else if (!xf->wr) {
+		dump_buf2(xf->bufi + 3, xf->bsb, xf->off, xf->len);
+	}
+	free(xf);
+}
+
+// Returns 0, or -1 if the options or arguments don't parse.
+static int wdbg_parse(struct wdbg *d, int argc, char **argv) {
 	extern char *optarg;
 	extern int optind;
+	int c;
+	int e;
 
-	while ((c = getopt(argc, argv, "g:p:s:vwW")) != EOF) {
+	while ((c = getopt(argc, argv, "ab:g:i:m:p:rs:u:vwWS")) != EOF) {
 		switch(c) {
+		case 'a':
+			d->all = 1;
+			break;
+		case 'b':
+			d->script = optarg;
+			break;
 		case 'g':
-			cs = set_cs(optarg[0]);
-			if (cs < 0) {
+			d->cs = set_cs(optarg[0]);
+			if (d->cs < 0) {
 				fprintf(stderr, "Invalid GPIO /CS\n");
-				exit(1);
+				return -1;
 			}
 			break;
+		case 'i':
+			d->intwait = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			d->mon = strtol(optarg, NULL, 0);
+			break;
 		case 'p':
-			port = strtol(optarg, NULL, 0);
+			d->port = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			d->raw = 1;
 			break;
 		case 's':
-			speed = parse_speed(optarg);
+			d->speed = parse_speed(optarg);
+			break;
+		case 'S':
+			d->stats = 1;
+			break;
+		case 'u':
+			d->tune = parse_tune(optarg);
+			if (spi_tune(d->tune) < 0) {
+				fprintf(stderr, "Invalid USB tuning '%s'\n", optarg);
+				return -1;
+			}
 			break;
 		case 'v':
-			verbose = 1;
+			d->verbose = 1;
 			break;
 		case 'w':
-			wr = 1;
+			d->wr = 1;
 			break;
 		case 'W':
-			wr = 2;
+			d->wr = 2;
 			break;
 		default:
 			fprintf(stderr, "Unknown option '%c'\n", c);
-			exit(1);
+			return -1;
 		}
 	}
+	d->nargs = argc - optind;
+	d->args = argv + optind;
 	e = 0; // command parse error?
-	if (wr == 2) {
-		e = (argc - optind != 3);
-	} else if (wr) {
-		e = (argc - optind < 3);
+	if (d->script) {
+		e = (d->nargs != 0);
+	} else if (d->all) {
+		e = (d->nargs != 0 || d->wr || d->intwait || d->mon);
+	} else if (d->wr == 2) {
+		e = (d->nargs != 3);
+	} else if (d->wr) {
+		e = (d->nargs < 3);
 	} else {
-		e = (argc - optind != 3);
+		e = (d->nargs != 3);
 	}
-	if (e) {
+	if (d->mon && (d->wr || d->intwait || d->mon < 0)) {
+		e = 1;
+	}
+	return e ? -1 : 0;
+}
+
+// Run one command, plain reads and writes queued if 'q'.
+// Returns 0, or -1 on error.
+static int wdbg_run(struct spi_dev *ft, struct spi_queue *q, struct wdbg *d,
+			int *failed) {
+	struct wdbg_xfer *xf;
+	unsigned char *hdr;
+	int bsb, off, len;
+	int x = 0;
+	int e;
+
+	if (q != NULL && (d->all || d->mon || d->intwait)) {
+		(void)spi_queue_drain(q); // what was queued goes first
+	}
+	if (d->all) {
+		e = sockets(ft);
+		return e < 0 ? -1 : 0;
+	}
+	bsb = strtol(d->args[x++], NULL, 0);
+	off = strtol(d->args[x++], NULL, 0);
+	if (d->wr == 2) {
+		len = strlen(d->args[x]);
+	} else if (d->wr) {
+		len = d->nargs - x;
+	} else {
+		len = strtol(d->args[x++], NULL, 0);
+	}
+	if (len < 0) {
+		fprintf(stderr, "Invalid length\n");
+		return -1;
+	}
+	if (d->mon) {
+		return monitor(ft, bsb, off, len, d->mon, d->verbose) < 0 ? -1 : 0;
+	}
+	// READ and WRITE commands are always 3 bytes, sent with the data.
+	xf = malloc(sizeof(*xf) + 2 * (3 + len));
+	if (xf == NULL) {
+		fprintf(stderr, "Out of memory, %d bytes\n", len);
+		return -1;
+	}
+	xf->ft = ft;
+	xf->bsb = bsb;
+	xf->off = off;
+	xf->len = len;
+	xf->wr = d->wr;
+	xf->raw = d->raw;
+	xf->failed = failed;
+	xf->bufo = (unsigned char *)(xf + 1);
+	xf->bufi = xf->bufo + 3 + len;
+	hdr = xf->bufo;
+	hdr[0] = (off >> 8) & 0xff; // big-endian address
+	hdr[1] = off & 0xff;
+	hdr[2] = (bsb << 3); // READ
+	if (d->wr == 2) {
+		hdr[2] |= 0x04; // WRITE
+		memcpy(hdr + 3, d->args[x], len);
+	} else if (d->wr) {
+		hdr[2] |= 0x04; // WRITE
+		for (e = 0; x < d->nargs; ++x) {
+			hdr[3 + e++] = (unsigned char)strtol(d->args[x], NULL, 0);
+		}
+	} else {
+		memset(hdr + 3, 0, len);
+	}
+	if (d->intwait) {
+		// The MPSSE holds the transfer until /INT goes low.
+		struct spi_seg seg[] = {
+			{ hdr, NULL, 3 },
+			{ hdr + 3, xf->bufi + 3, len },
+		};
+		if (!d->wr) seg[1].out = NULL;
+		e = spi_set_wait(ft, SPI_WAIT_LOW);
+		if (e == 0) {
+			e = spi_xfer_wait(ft, seg, 2, d->intwait);
+		}
+		// GPIOL1 back to an output, for the lines after this one
+		if (spi_set_wait(ft, SPI_WAIT_OFF) < 0 && e >= 0) {
+			e = -1;
+		}
+		if (e == -2) {
+			fprintf(stderr, "No interrupt in %d mS\n", d->intwait);
+			free(xf);
+			return -1;
+		}
+	} else if (q != NULL && 3 + len <= SPI_QMAX) {
+		e = spi_submit(q, xf->bufo, xf->bufi, 3 + len, wdbg_done, xf);
+		return e < 0 ? -1 : 0;
+	} else if (d->wr) {
+		struct spi_seg seg[] = {
+			{ hdr, NULL, 3 + len },
+		};
+		if (q != NULL) {
+			(void)spi_queue_drain(q);
+		}
+		e = spi_xferv(ft, seg, 1);
+	} else {
+		// Only the address/control is sent, data is clocked in.
+		if (q != NULL) {
+			(void)spi_queue_drain(q);
+		}
+		e = spi_xfer_cmd(ft, hdr, 3, xf->bufi + 3, len);
+	}
+	wdbg_done(xf, xf->bufi, e);
+	return e < 0 ? -1 : 0;
+}
+
+// Script mode.
+struct wdbg_script {
+	struct spi_dev *ft;
+	struct spi_queue *q;
+	struct wdbg *top;	// command line options, each line starts from
+	int failed;		// a queued transfer
+};
+
+// spi_line_t, one line of the script.
+static int wdbg_line(void *arg, int argc, char **argv) {
+	struct wdbg_script *sc = arg;
+	struct wdbg d = *sc->top;
+	d.script = NULL;
+	d.wr = 0;
+	d.raw = 0;
+	d.intwait = 0;
+	d.mon = 0;
+	d.all = 0;
+	if (wdbg_parse(&d, argc, argv) < 0 || d.script ||
+				d.port != sc->top->port || d.tune != sc->top->tune) {
+		fprintf(stderr, "Not a command (no -b, -p, -u in scripts)\n");
+		return -1;
+	}
+	if ((d.speed != sc->top->speed || d.cs != sc->top->cs) &&
+				spi_queue_drain(sc->q) < 0) {
+		return -1;
+	}
+	if (d.speed != sc->top->speed && spi_set_speed(sc->ft, d.speed) < 0) {
+		return -1;
+	}
+	if (d.cs != sc->top->cs && spi_set_cs(sc->ft, d.cs) < 0) {
+		return -1;
+	}
+	sc->top->speed = d.speed; // -s and -g hold for later lines
+	sc->top->cs = d.cs;
+	if (sc->failed) {
+		return -1;
+	}
+	return wdbg_run(sc->ft, sc->q, &d, &sc->failed);
+}
+
+int main(int argc, char **argv) {
+	struct wdbg d;
+	int speed;
+	int failed = 0;
+	int rc = 0;
+	struct spi_dev *ft;
+
+	memset(&d, 0, sizeof(d));
+	d.cs = 'C';
+	d.tune = SPI_TUNE_AUTO;
+	if (wdbg_parse(&d, argc, argv) < 0) {
 		fprintf(stderr, "Usage: %s [options] <bsb> <off> <len>\n", argv[0]);
 		fprintf(stderr, "       %s [options] -w <bsb> <off> <byte>[...]\n", argv[0]);
 		fprintf(stderr, "       %s [options] -W <bsb> <off> <string>\n", argv[0]);
+		fprintf(stderr, "       %s [options] -m <ms> <bsb> <off> <len>\n", argv[0]);
+		fprintf(stderr, "       %s [options] -a\n", argv[0]);
+		fprintf(stderr, "       %s [options] -b script|-\n", argv[0]);
 		fprintf(stderr, "Options:\n"
 				"    -p port  Use port instead of 0\n"
 				"    -s hz   Use hz clock speed (def 1.2M)\n"
+				"    -u tune USB tuning: lat, bulk, auto (def auto)\n"
 				"    -g cs   Use gpio for chip-select (0..3, def C)\n"
+				"    -i ms   Wait up to ms for /INT (on GPIOL1) first\n"
+				"    -a      Print the state of all sockets\n"
+				"    -m ms   Monitor, every ms until ^C, print changes\n"
+				"    -r      Write read data as binary\n"
+				"    -b file Run each line of file (- for stdin) as\n"
+				"            a command, with one open device\n"
+				"    -v      Print settings, and shadow hits with -m\n"
+				"    -S      Print transfer statistics on exit\n"
 		);
 		exit(1);
 	}
-	if (speed > 0) {
-		speed = spi_speed(speed);
+	if (d.speed > 0) {
+		speed = spi_speed(d.speed);
 	} else {
 		speed = spi_speed(0);
 	}
-	if (verbose) {
+	if (d.verbose) {
 		printf("Using speed %sHz\n", print_speed(speed));
-		printf("Using chip-select '%c'\n", cs);
-	}
-	x = optind;
-	bsb = strtol(argv[x++], NULL, 0);
-	off = strtol(argv[x++], NULL, 0);
-	// READ and WRITE commands are always 3 bytes.
-	if (wr == 2) {
-		len = strlen(argv[x]);
-	} else if (wr) {
-		len = argc - x;
-	} else {
-		len = strtol(argv[x++], NULL, 0);
-	}
-#if 0
-	if (len > 61) {
-		fprintf(stderr, "Hardware limited to <= 61 byte transfers\n");
-		exit(1);
+		printf("Using chip-select '%c'\n", d.cs);
 	}
-#endif
-	tot = len + 3;
-	bufo = malloc(tot);
-	bufi = malloc(tot);
-	if (bufo == NULL || bufi == NULL) {
-		fprintf(stderr, "Out of memory, 2x%d bytes\n", tot);
-		exit(1);
-	}
-	bufo[0] = (off >> 8) & 0xff; // big-endian address
-	bufo[1] = off & 0xff;
-	bufo[2] = (bsb << 3); // READ
-	if (wr == 2) {
-		bufo[2] |= 0x04; // WRITE
-		memcpy(bufo + 3, argv[x], len);
-	} else if (wr) {
-		bufo[2] |= 0x04; // WRITE
-		int y = 3;
-		while (x < argc) {
-			bufo[y++] = (unsigned char)strtol(argv[x], NULL, 0);
-			++x;
-		}
-	} else {
-		// Read data is sent as FF...
-		memset(bufo + 3, 0xff, len);
-	}
-	ft = spi_open(port);
+	ft = spi_open(d.port);
 	if (ft == NULL) {
 		fprintf(stderr, "Unable to open device, error = %d\n", ftStatus);
 		exit(1);
 	}
-	if (wr) {
-		e = spi_xfer_long(ft, bufo, bufi, tot);
-	} else {
-		e = spi_xfer_long(ft, bufo, bufi, tot);
-		if (e >= 0) {
-			dump_buf2(bufi + 3, bsb, off, len);
+	if (d.script) {
+		struct wdbg_script sc = { ft, NULL, &d, 0 };
+		FILE *fp = stdin;
+		if (strcmp(d.script, "-") != 0) {
+			fp = fopen(d.script, "r");
 		}
+		sc.q = spi_queue_new(ft, WDBG_DEPTH);
+		if (fp == NULL || sc.q == NULL) {
+			perror(d.script);
+			rc = 1;
+		} else {
+			rc = (spi_script(ft, fp, argv[0], wdbg_line, &sc) != 0 ||
+								sc.failed);
+		}
+		spi_queue_free(sc.q);
+		if (fp != NULL && fp != stdin) {
+			fclose(fp);
+		}
+	} else if (d.all) {
+		rc = (wdbg_run(ft, NULL, &d, &failed) < 0);
+	} else {
+		(void)wdbg_run(ft, NULL, &d, &failed);
 	}
-	if (e < 0) {
-		fprintf(stderr, "Failure during transfer, error = %d\n", ftStatus);
+	fflush(stdout);
+	if (d.stats) {
+		spi_stats_dump(ft, stderr);
 	}
 	spi_close(ft);
-	return 0;
+	return rc;
 }
@@ -0,0 +1,243 @@
+/*
+ * Socket traffic through a WIZ850io (W5500), like netcat
+ *
+ * Usage: wizsock [options] <ip> <port>
+ *
+ * Connects socket -n (TCP, or with -U, UDP datagrams) to <ip>:<port>,
+ * sends stdin, and writes what comes back to stdout, until stdin ends
+ * and nothing more has arrived for -w mS. Network settings (SHAR, SIPR,
+ * GAR, SUBR) are as left by wizdbg -w.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ftd2xx.h"
+#include "spilib.h"
+#include "w5500.h"
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int put_all(unsigned char *buf, int len) {
+	while (len > 0) {
+		int n = write(1, buf, len);
+		if (n < 0) {
+			perror("write");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int port = 0;
+	int speed = 0;
+	int verbose = 0;
+	int stats = 0;
+	int cs = 'C';
+	int sock = 0;
+	int udp = 0;
+	int lport = 5000;
+	int bufkb = 0;
+	int wait = 100;
+	unsigned char ip[4];
+	int dport;
+	static unsigned char bufo[16384];
+	static unsigned char bufi[16384];
+	long long sent = 0, got = 0;
+	long long t0, last;
+	struct wiz wz;
+	int chunk;
+	int eof = 0;
+	int rc = 0;
+	int c;
+	int e;
+	int n;
+	struct spi_dev *ft;
+
+	extern char *optarg;
+	extern int optind;
+
+	while ((c = getopt(argc, argv, "b:g:l:n:p:s:u:vw:SU")) != EOF) {
+		switch(c) {
+		case 'b':
+			bufkb = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			cs = set_cs(optarg[0]);
+			if (cs < 0) {
+				fprintf(stderr, "Invalid GPIO /CS\n");
+				exit(1);
+			}
+			break;
+		case 'l':
+			lport = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			sock = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			port = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			speed = parse_speed(optarg);
+			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'u':
+			if (spi_tune(parse_tune(optarg)) < 0) {
+				fprintf(stderr, "Invalid USB tuning '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'U':
+			udp = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			wait = strtol(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Unknown option '%c'\n", c);
+			exit(1);
+		}
+	}
+	e = (argc - optind != 2 || sock < 0 || sock >= WIZ_SOCKS ||
+		(bufkb != 0 && bufkb != 1 && bufkb != 2 && bufkb != 4 &&
+		 bufkb != 8 && bufkb != 16));
+	if (!e) {
+		e = (sscanf(argv[optind], "%hhu.%hhu.%hhu.%hhu",
+				&ip[0], &ip[1], &ip[2], &ip[3]) != 4);
+	}
+	if (e) {
+		fprintf(stderr, "Usage: %s [options] <ip> <port>\n", argv[0]);
+		fprintf(stderr, "Options:\n"
+				"    -p port  Use port instead of 0\n"
+				"    -s hz   Use hz clock speed (def 1.2M)\n"
+				"    -u tune USB tuning: lat, bulk, auto (def auto)\n"
+				"    -g cs   Use gpio for chip-select (0..3, def C)\n"
+				"    -n sock Use socket 0..7 (def 0)\n"
+				"    -U      UDP, each read of stdin one datagram\n"
+				"    -l port Local port (def 5000)\n"
+				"    -b kb   Socket buffer size, RX and TX (1..16)\n"
+				"    -w ms   Wait for replies after stdin ends (def 100)\n"
+				"    -v      Print settings, and throughput\n"
+				"    -S      Print transfer statistics on exit\n"
+		);
+		exit(1);
+	}
+	dport = strtol(argv[optind + 1], NULL, 0);
+	if (speed > 0) {
+		speed = spi_speed(speed);
+	} else {
+		speed = spi_speed(0);
+	}
+	if (verbose) {
+		fprintf(stderr, "Using speed %sHz\n", print_speed(speed));
+		fprintf(stderr, "Using chip-select '%c'\n", cs);
+	}
+	ft = spi_open(port);
+	if (ft == NULL) {
+		fprintf(stderr, "Unable to open device, error = %d\n", ftStatus);
+		exit(1);
+	}
+	e = wiz_open(&wz, ft);
+	if (e == -2) {
+		fprintf(stderr, "No W5500 found\n");
+		exit(1);
+	}
+	if (e == 0 && bufkb) {
+		e = wiz_bufsize(&wz, sock, bufkb, bufkb);
+	}
+	if (e == 0) {
+		e = wiz_socket(&wz, sock, udp ? WIZ_UDP : WIZ_TCP, lport);
+		e = (e == (udp ? WIZ_SOCK_UDP : WIZ_INIT)) ? 0 : -1;
+	}
+	if (e == 0 && !udp) {
+		e = wiz_connect(&wz, sock, ip, dport);
+		if (e < 0) {
+			fprintf(stderr, "Unable to connect\n");
+			exit(1);
+		}
+	}
+	if (e < 0) {
+		fprintf(stderr, "Unable to open socket, error = %d\n", ft->status);
+		exit(1);
+	}
+	// whatever is sent may all come back (an echo) before it is read
+	chunk = wz.sock[sock].txsize;
+	if (chunk > wz.sock[sock].rxsize - (udp ? 8 : 0)) {
+		chunk = wz.sock[sock].rxsize - (udp ? 8 : 0);
+	}
+	if (chunk > sizeof(bufo)) chunk = sizeof(bufo);
+	t0 = last = now_ms();
+	while (!eof || now_ms() - last < wait) {
+		if (!eof) {
+			n = read(0, bufo, chunk);
+			if (n < 0) {
+				perror("read");
+				rc = 1;
+				break;
+			}
+			if (n == 0) {
+				eof = 1;
+				last = now_ms();
+			} else if (udp) {
+				e = wiz_sendto(&wz, sock, bufo, n, ip, dport);
+			} else {
+				e = wiz_send(&wz, sock, bufo, n);
+			}
+			if (n > 0 && e < 0) {
+				fprintf(stderr, "Send failed, error = %d\n", e);
+				rc = 1;
+				break;
+			}
+			sent += (n > 0 ? n : 0);
+		}
+		if (udp) {
+			n = wiz_recvfrom(&wz, sock, bufi, sizeof(bufi), NULL, NULL);
+		} else {
+			n = wiz_recv(&wz, sock, bufi, sizeof(bufi));
+		}
+		if (n < 0) {
+			fprintf(stderr, "Receive failed\n");
+			rc = 1;
+			break;
+		}
+		if (n > 0) {
+			if (put_all(bufi, n) < 0) {
+				rc = 1;
+				break;
+			}
+			got += n;
+			last = now_ms();
+		}
+	}
+	if (verbose) {
+		long long ms = (eof ? last : now_ms()) - t0;
+		fprintf(stderr, "Sent %lld, received %lld bytes in %lld mS",
+							sent, got, ms);
+		if (ms > 0) {
+			fprintf(stderr, ", %sHz effective",
+				print_speed((int)((sent + got) * 8000 / ms)));
+		}
+		fprintf(stderr, "\n");
+	}
+	(void)wiz_close(&wz, sock);
+	if (stats) {
+		spi_stats_dump(ft, stderr);
+	}
+	spi_close(ft);
+	return rc;
+}